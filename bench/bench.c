@@ -0,0 +1,204 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include "postsrsd_build_config.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Operations are timed in batches, so that the clock resolution does not
+   dominate very fast operations */
+#define BENCH_WARMUP_NS    10000000
+#define BENCH_MIN_BATCH_NS 2000
+#define BENCH_MAX_SAMPLES  100000
+
+bool bench_large = false;
+double bench_min_time = 0.5;
+static const char* bench_filter = NULL;
+static FILE* bench_out = NULL;
+static bool bench_first = true;
+
+uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+bool bench_selected(const char* name)
+{
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+void bench_run(const char* name, bench_fn_t fn, void* arg)
+{
+    if (!bench_selected(name))
+        return;
+    double* samples = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+    if (samples == NULL)
+        log_fatal("out of memory");
+    size_t i = 0;
+    /* Warm up and calibrate the batch size */
+    size_t batch = 0;
+    uint64_t start = bench_now();
+    uint64_t elapsed;
+    do
+    {
+        fn(arg, i++);
+        ++batch;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_WARMUP_NS);
+    batch = (size_t)((double)batch * BENCH_MIN_BATCH_NS / (double)elapsed) + 1;
+    size_t num_samples = 0;
+    uint64_t total_ns = 0;
+    uint64_t budget_ns = (uint64_t)(bench_min_time * 1e9);
+    while (total_ns < budget_ns && num_samples < BENCH_MAX_SAMPLES)
+    {
+        start = bench_now();
+        for (size_t j = 0; j < batch; ++j)
+            fn(arg, i++);
+        elapsed = bench_now() - start;
+        samples[num_samples++] = (double)elapsed / (double)batch;
+        total_ns += elapsed;
+    }
+    qsort(samples, num_samples, sizeof(double), compare_double);
+    size_t ops = num_samples * batch;
+    fprintf(bench_out,
+            "%s\n    {\"name\": \"%s\", \"iterations\": %zu, "
+            "\"batch\": %zu, \"ops_per_sec\": %.1f, "
+            "\"ns_per_op\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"max\": %.1f}}",
+            bench_first ? "" : ",", name, ops, batch,
+            (double)ops * 1e9 / (double)total_ns, samples[0],
+            percentile(samples, num_samples, 0.5),
+            percentile(samples, num_samples, 0.9),
+            percentile(samples, num_samples, 0.99),
+            samples[num_samples - 1]);
+    fflush(bench_out);
+    bench_first = false;
+    free(samples);
+}
+
+void bench_report(const char* name, size_t ops, size_t errors,
+                  uint64_t elapsed_ns)
+{
+    fprintf(bench_out,
+            "%s\n    {\"name\": \"%s\", \"iterations\": %zu, "
+            "\"errors\": %zu, \"ops_per_sec\": %.1f}",
+            bench_first ? "" : ",", name, ops, errors,
+            (double)ops * 1e9 / (double)elapsed_ns);
+    fflush(bench_out);
+    bench_first = false;
+}
+
+void bench_report_memory(const char* name, size_t items, size_t bytes)
+{
+    if (!bench_selected(name))
+        return;
+    fprintf(bench_out,
+            "%s\n    {\"name\": \"%s\", \"items\": %zu, "
+            "\"bytes\": %zu, \"bytes_per_item\": %.1f}",
+            bench_first ? "" : ",", name, items, bytes,
+            items > 0 ? (double)bytes / (double)items : 0.0);
+    fflush(bench_out);
+    bench_first = false;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-l] [-t SECONDS] [-f FILTER] [-o FILE]\n"
+            "\n"
+            "  -l          include benchmarks with very large data sets\n"
+            "  -t SECONDS  minimum run time per benchmark (default: 0.5)\n"
+            "  -f FILTER   only run benchmarks whose name contains FILTER\n"
+            "  -o FILE     write JSON results to FILE instead of stdout\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "lt:f:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+                bench_large = true;
+                break;
+            case 't':
+                bench_min_time = atof(optarg);
+                break;
+            case 'f':
+                bench_filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    bench_out = stdout;
+    if (output != NULL)
+    {
+        bench_out = fopen(output, "w");
+        if (bench_out == NULL)
+        {
+            log_perror(errno, output);
+            return EXIT_FAILURE;
+        }
+    }
+    /* Keep log output of the benchmarked functions out of the timings */
+    log_set_verbosity(LogError);
+    fprintf(bench_out,
+            "{\n  \"version\": \"%s\",\n  \"min_time\": %.3f,\n"
+            "  \"benchmarks\": [",
+            POSTSRSD_VERSION, bench_min_time);
+    bench_srs();
+    bench_codecs();
+    bench_database();
+    fprintf(bench_out, "\n  ]\n}\n");
+    if (bench_out != stdout)
+        fclose(bench_out);
+    return EXIT_SUCCESS;
+}
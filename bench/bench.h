@@ -0,0 +1,44 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* One benchmark operation; i counts the calls since the run started */
+typedef void (*bench_fn_t)(void* arg, size_t i);
+
+extern bool bench_large;
+extern double bench_min_time;
+
+uint64_t bench_now(void);
+bool bench_selected(const char* name);
+void bench_run(const char* name, bench_fn_t fn, void* arg);
+/* Reports a benchmark which does its own timing, e.g. with several
+   processes */
+void bench_report(const char* name, size_t ops, size_t errors,
+                  uint64_t elapsed_ns);
+/* Reports the memory footprint of a data structure with n items */
+void bench_report_memory(const char* name, size_t items, size_t bytes);
+
+void bench_srs(void);
+void bench_codecs(void);
+void bench_database(void);
+
+#endif
@@ -0,0 +1,155 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include "milter.h"
+#include "netstring.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct domain_bench
+{
+    domain_set_t* D;
+    size_t size;
+};
+
+static void bench_domain_set_contains(void* arg, size_t i)
+{
+    struct domain_bench* b = arg;
+    char domain[64];
+    /* Only every other domain is in the set */
+    snprintf(domain, sizeof(domain), "domain%zu.example",
+             (i * 7919) % (2 * b->size));
+    domain_set_contains(b->D, domain);
+}
+
+static void bench_domain_set_contains_subdomain(void* arg, size_t i)
+{
+    struct domain_bench* b = arg;
+    char domain[64];
+    /* Only every other parent domain is a wildcard entry in the set */
+    snprintf(domain, sizeof(domain), "mail.relay.wild%zu.example",
+             (i * 7919) % (2 * b->size));
+    domain_set_contains(b->D, domain);
+}
+
+static void bench_b32h_encode(void* arg, size_t i)
+{
+    char buffer[35];
+    (void)i;
+    b32h_encode(arg, 20, buffer, sizeof(buffer));
+}
+
+static void bench_netstring_encode(void* arg, size_t i)
+{
+    char buffer[600];
+    size_t len;
+    (void)i;
+    netstring_encode(arg, strlen(arg), buffer, sizeof(buffer), &len);
+}
+
+static void bench_netstring_decode(void* arg, size_t i)
+{
+    char buffer[600];
+    size_t len;
+    (void)i;
+    netstring_decode(arg, strlen(arg), buffer, sizeof(buffer), &len);
+}
+
+static const char milter_macros[] = "j\0mx.example.com\0"
+                                    "{daemon_name}\0smtpd\0"
+                                    "v\0Postfix 3.7.3\0"
+                                    "i\0ABCDEF123456\0";
+
+static void bench_milter_parse_macros(void* arg, size_t i)
+{
+    (void)arg;
+    (void)i;
+    free(milter_parse_macros("i", milter_macros, sizeof(milter_macros)));
+}
+
+static void bench_milter_parse_address(void* arg, size_t i)
+{
+    char buffer[513];
+    (void)i;
+    milter_parse_address_buf(arg, buffer, sizeof(buffer));
+}
+
+static void bench_milter_parse_str_list(void* arg, size_t i)
+{
+    static const char rcpt[] = "<user@example.com>\0SIZE=1024\0NOTIFY=NEVER";
+    list_t* L = list_create();
+    (void)arg;
+    (void)i;
+    milter_parse_str_list(L, rcpt, sizeof(rcpt));
+    list_destroy(L, free);
+}
+
+static void run_domain_set_benchmark(size_t size)
+{
+    struct domain_bench b;
+    char domain[64];
+    char name[64];
+
+    b.D = domain_set_create();
+    b.size = size;
+    if (b.D == NULL)
+        log_fatal("out of memory");
+    for (size_t n = 0; n < size; ++n)
+    {
+        snprintf(domain, sizeof(domain), "domain%zu.example", 2 * n);
+        domain_set_add(b.D, domain);
+        snprintf(domain, sizeof(domain), ".wild%zu.example", 2 * n);
+        domain_set_add(b.D, domain);
+    }
+    snprintf(name, sizeof(name), "domain_set_memory/%zu", size);
+    bench_report_memory(name, 2 * size, domain_set_memory(b.D));
+    snprintf(name, sizeof(name), "domain_set_contains/%zu", size);
+    bench_run(name, bench_domain_set_contains, &b);
+    snprintf(name, sizeof(name), "domain_set_contains_subdomain/%zu", size);
+    bench_run(name, bench_domain_set_contains_subdomain, &b);
+    domain_set_destroy(b.D);
+}
+
+void bench_codecs(void)
+{
+    char digest[20];
+    char netstring[600];
+    size_t len;
+    const char* address = "SRS0=vmyz=2W=otherdomain.com=test@example.com";
+
+    run_domain_set_benchmark(10000);
+    run_domain_set_benchmark(100000);
+    if (bench_large)
+        run_domain_set_benchmark(1000000);
+
+    for (unsigned i = 0; i < sizeof(digest); ++i)
+        digest[i] = (char)(i * 13);
+    bench_run("b32h_encode", bench_b32h_encode, digest);
+
+    bench_run("netstring_encode", bench_netstring_encode, (void*)address);
+    netstring_encode(address, strlen(address), netstring, sizeof(netstring),
+                     &len);
+    bench_run("netstring_decode", bench_netstring_decode, netstring);
+
+    bench_run("milter_parse_macros", bench_milter_parse_macros, NULL);
+    bench_run("milter_parse_address", bench_milter_parse_address,
+              "<user@otherdomain.com>");
+    bench_run("milter_parse_str_list", bench_milter_parse_str_list, NULL);
+}
@@ -0,0 +1,154 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include "database.h"
+#include "postsrsd_build_config.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct writer_result
+{
+    size_t ops;
+    size_t errors;
+};
+
+static void run_writer(const char* uri, int id, uint64_t deadline, int fd)
+{
+    struct writer_result result = {0, 0};
+    char key[64];
+    /* Lock contention errors are counted, not logged */
+    if (freopen("/dev/null", "w", stderr) == NULL)
+        exit(EXIT_FAILURE);
+    database_t* db = database_connect(uri, false);
+    if (db == NULL)
+        exit(EXIT_FAILURE);
+    while (bench_now() < deadline)
+    {
+        snprintf(key, sizeof(key), "writer%d-%zu", id,
+                 result.ops + result.errors);
+        if (database_write(db, key, "user@otherdomain.com", 86400))
+            ++result.ops;
+        else
+            ++result.errors;
+    }
+    if (!database_flush(db))
+        result.errors += result.ops;
+    database_disconnect(db);
+    if (write(fd, &result, sizeof(result)) != sizeof(result))
+        exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+}
+
+static void bench_concurrent_writers(const char* scheme, const char* profile,
+                                     const char* options, int num_writers)
+{
+    /* Every writer is a separate process with its own connection, just like
+       the PostSRSd worker processes */
+    char name[64];
+    char dbpath[] = "/tmp/postsrsd_bench_XXXXXX";
+    char uri[256];
+    int fds[2];
+    snprintf(name, sizeof(name), "%s_write/%s/%d_writers", scheme, profile,
+             num_writers);
+    if (!bench_selected(name))
+        return;
+    int fd = mkstemp(dbpath);
+    if (fd < 0)
+        log_fatal("cannot create temporary database file");
+    close(fd);
+    /* The mmap backend only initializes files which it creates itself */
+    unlink(dbpath);
+    snprintf(uri, sizeof(uri), "%s:%s%s", scheme, dbpath, options);
+    /* Create the table before the writers race for it */
+    database_t* db = database_connect(uri, true);
+    if (db == NULL)
+        log_fatal("cannot open %s", uri);
+    database_disconnect(db);
+    if (pipe(fds) < 0)
+        log_fatal("cannot create pipe");
+    /* Do not let the writers inherit buffered output */
+    fflush(NULL);
+    uint64_t start = bench_now();
+    uint64_t deadline = start + (uint64_t)(bench_min_time * 1e9);
+    for (int i = 0; i < num_writers; ++i)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+            log_fatal("cannot fork writer process");
+        if (pid == 0)
+        {
+            close(fds[0]);
+            run_writer(uri, i, deadline, fds[1]);
+        }
+    }
+    close(fds[1]);
+    struct writer_result total = {0, 0};
+    struct writer_result result;
+    int finished = 0;
+    while (read(fds[0], &result, sizeof(result)) == sizeof(result))
+    {
+        total.ops += result.ops;
+        total.errors += result.errors;
+        ++finished;
+    }
+    close(fds[0]);
+    while (wait(NULL) > 0)
+        ;
+    uint64_t elapsed = bench_now() - start;
+    if (finished < num_writers)
+        log_fatal("%d writer processes failed", num_writers - finished);
+    bench_report(name, total.ops, total.errors, elapsed);
+    unlink(dbpath);
+    /* Remove the WAL files of the SQLite concurrent profile and the LMDB
+       lock file */
+    snprintf(uri, sizeof(uri), "%s-wal", dbpath);
+    unlink(uri);
+    snprintf(uri, sizeof(uri), "%s-shm", dbpath);
+    unlink(uri);
+    snprintf(uri, sizeof(uri), "%s-lock", dbpath);
+    unlink(uri);
+}
+
+void bench_database(void)
+{
+    static const int num_writers[] = {1, 4, 16};
+    for (size_t i = 0; i < sizeof(num_writers) / sizeof(num_writers[0]); ++i)
+    {
+#ifdef WITH_SQLITE
+        bench_concurrent_writers("sqlite", "default", "", num_writers[i]);
+        bench_concurrent_writers("sqlite", "concurrent", "?profile=concurrent",
+                                 num_writers[i]);
+        bench_concurrent_writers("sqlite", "concurrent_batch32",
+                                 "?profile=concurrent&batch=32",
+                                 num_writers[i]);
+#endif
+#ifdef WITH_LMDB
+        bench_concurrent_writers("lmdb", "default", "", num_writers[i]);
+        bench_concurrent_writers("lmdb", "nosync", "?sync=off",
+                                 num_writers[i]);
+#endif
+#ifdef HAVE_SYS_MMAN_H
+        bench_concurrent_writers("mmap", "default", "?slots=65536",
+                                 num_writers[i]);
+#endif
+    }
+}
@@ -0,0 +1,166 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include "database.h"
+#include "postsrsd_build_config.h"
+#include "srs.h"
+#include "srs2.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct srs_bench
+{
+    srs_t* srs;
+    database_t* db;
+    domain_set_t* local_domains;
+    char* address;
+};
+
+static void bench_srs_forward(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    char buffer[513];
+    (void)i;
+    srs_forward(b->srs, buffer, sizeof(buffer), "user@otherdomain.com",
+                "example.com");
+}
+
+static void bench_srs_reverse(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    char buffer[513];
+    (void)i;
+    srs_reverse(b->srs, buffer, sizeof(buffer), b->address);
+}
+
+static void bench_postsrsd_forward(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    (void)i;
+    free(postsrsd_forward("user@otherdomain.com", "example.com", b->srs, b->db,
+                          b->local_domains, NULL, NULL, NULL));
+}
+
+static void bench_postsrsd_reverse(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    (void)i;
+    free(postsrsd_reverse(b->address, b->srs, b->db, NULL, NULL, NULL));
+}
+
+static void bench_postsrsd_forward_into(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    char buffer[513];
+    (void)i;
+    postsrsd_forward_into(buffer, sizeof(buffer), "user@otherdomain.com",
+                          "example.com", b->srs, b->db, b->local_domains, NULL,
+                          NULL, NULL);
+}
+
+static void bench_postsrsd_reverse_into(void* arg, size_t i)
+{
+    struct srs_bench* b = arg;
+    char buffer[513];
+    (void)i;
+    postsrsd_reverse_into(buffer, sizeof(buffer), b->address, b->srs, b->db,
+                          NULL, NULL, NULL);
+}
+
+static void run_srs_benchmarks(const char* mode, struct srs_bench* b)
+{
+    char name[64];
+    free(b->address);
+    b->address = postsrsd_forward("user@otherdomain.com", "example.com",
+                                  b->srs, b->db, b->local_domains, NULL, NULL,
+                                  NULL);
+    if (b->address == NULL)
+        log_fatal("cannot create SRS address for benchmark");
+    snprintf(name, sizeof(name), "postsrsd_forward/%s", mode);
+    bench_run(name, bench_postsrsd_forward, b);
+    snprintf(name, sizeof(name), "postsrsd_reverse/%s", mode);
+    bench_run(name, bench_postsrsd_reverse, b);
+    snprintf(name, sizeof(name), "postsrsd_forward_into/%s", mode);
+    bench_run(name, bench_postsrsd_forward_into, b);
+    snprintf(name, sizeof(name), "postsrsd_reverse_into/%s", mode);
+    bench_run(name, bench_postsrsd_reverse_into, b);
+}
+
+void bench_srs(void)
+{
+    struct srs_bench b;
+    char forged[513];
+    char* p;
+
+    b.srs = srs_new();
+    b.db = NULL;
+    b.local_domains = domain_set_create();
+    b.address = NULL;
+    if (b.srs == NULL || b.local_domains == NULL)
+        log_fatal("out of memory");
+    srs_add_secret(b.srs, "tops3cr3t");
+    domain_set_add(b.local_domains, "example.com");
+
+    b.address = malloc(513);
+    if (b.address == NULL)
+        log_fatal("out of memory");
+    srs_forward(b.srs, b.address, 513, "user@otherdomain.com", "example.com");
+    bench_run("srs_forward", bench_srs_forward, &b);
+    bench_run("srs_reverse", bench_srs_reverse, &b);
+
+    /* Forged addresses are checked against every secret */
+    strcpy(forged, b.address);
+    p = forged + 5;
+    *p = *p == 'A' ? 'B' : 'A';
+    for (int i = 1; i < 8; ++i)
+        srs_add_secret(b.srs, "0ld-s3cr3t");
+    free(b.address);
+    b.address = forged;
+    bench_run("srs_reverse/forged_8_secrets", bench_srs_reverse, &b);
+    b.address = NULL;
+    srs_free(b.srs);
+
+    b.srs = srs_new();
+    if (b.srs == NULL)
+        log_fatal("out of memory");
+    srs_add_secret(b.srs, "tops3cr3t");
+    run_srs_benchmarks("embedded", &b);
+#ifdef WITH_SQLITE
+    char dbpath[] = "/tmp/postsrsd_bench_XXXXXX";
+    int fd = mkstemp(dbpath);
+    if (fd < 0)
+        log_fatal("cannot create temporary database file");
+    close(fd);
+    char uri[sizeof(dbpath) + 7];
+    snprintf(uri, sizeof(uri), "sqlite:%s", dbpath);
+    b.db = database_connect(uri, true);
+    if (b.db == NULL)
+        log_fatal("cannot open %s", uri);
+    run_srs_benchmarks("sqlite", &b);
+    database_disconnect(b.db);
+    b.db = NULL;
+    unlink(dbpath);
+#endif
+
+    free(b.address);
+    domain_set_destroy(b.local_domains);
+    srs_free(b.srs);
+}
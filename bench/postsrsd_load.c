@@ -0,0 +1,520 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "milter.h"
+#include "netstring.h"
+#include "postsrsd_build_config.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNECTIONS 4096
+#define MAX_RECIPIENTS  100
+
+enum load_op
+{
+    OP_FORWARD,
+    OP_REVERSE,
+    OP_MILTER,
+    NUM_OPS
+};
+
+static const char* op_names[NUM_OPS] = {"forward", "reverse", "milter"};
+
+struct load_stats
+{
+    uint64_t* latencies;
+    size_t size;
+    size_t capacity;
+    uint64_t errors;
+};
+
+struct load_thread
+{
+    pthread_t thread;
+    unsigned seed;
+    int socketmap_fd;
+    int milter_fd;
+    netstring_reader_t reader;
+    char reverse_address[513];
+    uint64_t connect_errors;
+    struct load_stats stats[NUM_OPS];
+};
+
+static const char* socketmap_endpoint = NULL;
+static const char* milter_endpoint = NULL;
+static unsigned weights[NUM_OPS] = {1, 1, 1};
+static unsigned total_weight = 0;
+static unsigned num_recipients = 3;
+static uint64_t deadline;
+
+static uint64_t load_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int connect_endpoint(const char* endpoint)
+{
+    int fd = -1;
+    if (strncmp(endpoint, "unix:", 5) == 0)
+    {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(endpoint + 5) >= sizeof(sa.sun_path))
+            return -1;
+        strcpy(sa.sun_path, endpoint + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0)
+            goto fail;
+        return fd;
+    }
+    if (strncmp(endpoint, "inet:", 5) == 0)
+    {
+        char host[256];
+        const char* colon = strrchr(endpoint + 5, ':');
+        struct addrinfo hints;
+        struct addrinfo* addrs;
+        if (colon == NULL || (size_t)(colon - endpoint - 5) >= sizeof(host))
+            return -1;
+        memcpy(host, endpoint + 5, colon - endpoint - 5);
+        host[colon - endpoint - 5] = 0;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &addrs) != 0)
+            return -1;
+        for (struct addrinfo* ai = addrs; ai != NULL; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+        return fd;
+    }
+    return -1;
+fail:
+    close(fd);
+    return -1;
+}
+
+static bool socketmap_query(struct load_thread* t, const char* request,
+                            char* reply, size_t size)
+{
+    size_t len;
+    if (t->socketmap_fd < 0)
+    {
+        t->socketmap_fd = connect_endpoint(socketmap_endpoint);
+        if (t->socketmap_fd < 0)
+        {
+            ++t->connect_errors;
+            return false;
+        }
+        netstring_reader_init(&t->reader);
+    }
+    if (netstring_write(t->socketmap_fd, request, strlen(request)) < 0)
+        goto fail;
+    for (;;)
+    {
+        char* data = netstring_reader_next(&t->reader, size, &len);
+        if (data != NULL)
+        {
+            memcpy(reply, data, len + 1);
+            return true;
+        }
+        if (len == SIZE_MAX)
+            goto fail;
+        if (netstring_reader_fill(&t->reader, t->socketmap_fd) <= 0)
+            goto fail;
+    }
+fail:
+    close(t->socketmap_fd);
+    t->socketmap_fd = -1;
+    return false;
+}
+
+static char milter_reply(struct load_thread* t)
+{
+    char buffer[1024];
+    if (milter_receive(t->milter_fd, buffer, sizeof(buffer), NULL) == 0)
+        return 0;
+    return buffer[0];
+}
+
+static bool milter_transaction(struct load_thread* t, bool* ok)
+{
+    static const char macros[] = "Mi\0LOADTEST\0";
+    char address[520];
+    char code;
+    *ok = false;
+    if (t->milter_fd < 0)
+    {
+        /* Version 6, all actions, all protocol steps */
+        static const unsigned char optneg[12] = {0, 0, 0, 6,    0, 0,
+                                                 0, 0xff, 0, 0, 0, 0xff};
+        t->milter_fd = connect_endpoint(milter_endpoint);
+        if (t->milter_fd < 0)
+        {
+            ++t->connect_errors;
+            return false;
+        }
+        if (!milter_send_bytes(t->milter_fd, 'O', optneg, sizeof(optneg)))
+            goto fail;
+        if (milter_reply(t) != 'O')
+            goto fail;
+    }
+    snprintf(address, sizeof(address), "<sender%u@otherdomain%u.com>",
+             rand_r(&t->seed) % 10000, rand_r(&t->seed) % 100);
+    if (!milter_send_bytes(t->milter_fd, 'D', macros, sizeof(macros))
+        || !milter_send_str(t->milter_fd, 'M', address))
+        goto fail;
+    code = milter_reply(t);
+    if (code == 0)
+        goto fail;
+    if (code != 'c')
+        return true;
+    for (unsigned i = 0; i < num_recipients; ++i)
+    {
+        if (i % 2 == 0 && t->reverse_address[0] != 0)
+            snprintf(address, sizeof(address), "<%s>", t->reverse_address);
+        else
+            snprintf(address, sizeof(address), "<rcpt%u@example.com>", i);
+        if (!milter_send_str(t->milter_fd, 'R', address))
+            goto fail;
+        code = milter_reply(t);
+        if (code == 0)
+            goto fail;
+        if (code != 'c')
+            return true;
+    }
+    if (!milter_send(t->milter_fd, 'E'))
+        goto fail;
+    do
+    {
+        code = milter_reply(t);
+        if (code == 0)
+            goto fail;
+    } while (code == '+' || code == '-' || code == 'e');
+    *ok = code == 'a' || code == 'c';
+    return true;
+fail:
+    close(t->milter_fd);
+    t->milter_fd = -1;
+    return false;
+}
+
+static bool run_op(struct load_thread* t, enum load_op op)
+{
+    char request[600];
+    char reply[600];
+    bool ok;
+    switch (op)
+    {
+        case OP_FORWARD:
+            snprintf(request, sizeof(request),
+                     "forward user%u@otherdomain%u.com",
+                     rand_r(&t->seed) % 10000, rand_r(&t->seed) % 100);
+            return socketmap_query(t, request, reply, sizeof(reply))
+                   && strncmp(reply, "OK ", 3) == 0;
+        case OP_REVERSE:
+            snprintf(request, sizeof(request), "reverse %s",
+                     t->reverse_address);
+            return socketmap_query(t, request, reply, sizeof(reply))
+                   && strncmp(reply, "OK ", 3) == 0;
+        case OP_MILTER:
+            return milter_transaction(t, &ok) && ok;
+        default:
+            return false;
+    }
+}
+
+static enum load_op pick_op(struct load_thread* t)
+{
+    unsigned r = rand_r(&t->seed) % total_weight;
+    int op = 0;
+    while (r >= weights[op])
+        r -= weights[op++];
+    return (enum load_op)op;
+}
+
+static bool record(struct load_stats* s, uint64_t latency)
+{
+    if (s->size == s->capacity)
+    {
+        size_t capacity = s->capacity > 0 ? 2 * s->capacity : 4096;
+        uint64_t* p = realloc(s->latencies, capacity * sizeof(uint64_t));
+        if (p == NULL)
+            return false;
+        s->latencies = p;
+        s->capacity = capacity;
+    }
+    s->latencies[s->size++] = latency;
+    return true;
+}
+
+static void* load_thread_run(void* arg)
+{
+    struct load_thread* t = arg;
+    if (weights[OP_REVERSE] > 0)
+    {
+        char reply[600];
+        if (!socketmap_query(t, "forward user@otherdomain.com", reply,
+                             sizeof(reply))
+            || strncmp(reply, "OK ", 3) != 0)
+        {
+            log_error("cannot obtain SRS address for reverse queries");
+            return NULL;
+        }
+        strncpy(t->reverse_address, reply + 3, sizeof(t->reverse_address));
+        t->reverse_address[sizeof(t->reverse_address) - 1] = 0;
+    }
+    while (load_now() < deadline)
+    {
+        enum load_op op = pick_op(t);
+        uint64_t start = load_now();
+        bool ok = run_op(t, op);
+        uint64_t latency = load_now() - start;
+        if (ok)
+            record(&t->stats[op], latency);
+        else
+            ++t->stats[op].errors;
+    }
+    if (t->socketmap_fd >= 0)
+        close(t->socketmap_fd);
+    if (t->milter_fd >= 0)
+        close(t->milter_fd);
+    return NULL;
+}
+
+static int compare_uint64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t* sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)sorted[i] / 1000.0;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-s ENDPOINT] [-m ENDPOINT] [-c CONNECTIONS] "
+            "[-d SECONDS]\n"
+            "          [-w FORWARD:REVERSE:MILTER] [-k RECIPIENTS] [-o FILE]\n"
+            "\n"
+            "  -s ENDPOINT     socketmap endpoint (unix:PATH or "
+            "inet:HOST:PORT)\n"
+            "  -m ENDPOINT     milter endpoint (unix:PATH or inet:HOST:PORT)\n"
+            "  -c CONNECTIONS  concurrent connections per endpoint "
+            "(default: 10)\n"
+            "  -d SECONDS      test duration (default: 10)\n"
+            "  -w WEIGHTS      relative weights of forward queries, reverse "
+            "queries\n"
+            "                  and milter transactions (default: 1:1:1)\n"
+            "  -k RECIPIENTS   recipients per milter transaction "
+            "(default: 3)\n"
+            "  -o FILE         write JSON results to FILE instead of stdout\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned num_connections = 10;
+    double duration = 10;
+    const char* output = NULL;
+    FILE* out = stdout;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:c:d:w:k:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                socketmap_endpoint = optarg;
+                break;
+            case 'm':
+                milter_endpoint = optarg;
+                break;
+            case 'c':
+                num_connections = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                if (sscanf(optarg, "%u:%u:%u", &weights[OP_FORWARD],
+                           &weights[OP_REVERSE], &weights[OP_MILTER])
+                    != 3)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                num_recipients = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (socketmap_endpoint == NULL)
+        weights[OP_FORWARD] = weights[OP_REVERSE] = 0;
+    if (milter_endpoint == NULL)
+        weights[OP_MILTER] = 0;
+    total_weight =
+        weights[OP_FORWARD] + weights[OP_REVERSE] + weights[OP_MILTER];
+    if (total_weight == 0)
+    {
+        log_error("nothing to do: no endpoint with non-zero weight");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (num_connections == 0 || num_connections > MAX_CONNECTIONS)
+    {
+        log_error("number of connections must be between 1 and %d",
+                  MAX_CONNECTIONS);
+        return EXIT_FAILURE;
+    }
+    if (num_recipients == 0 || num_recipients > MAX_RECIPIENTS)
+    {
+        log_error("number of recipients must be between 1 and %d",
+                  MAX_RECIPIENTS);
+        return EXIT_FAILURE;
+    }
+    if (output != NULL)
+    {
+        out = fopen(output, "w");
+        if (out == NULL)
+        {
+            log_perror(errno, output);
+            return EXIT_FAILURE;
+        }
+    }
+    signal_ignore(SIGPIPE);
+
+    struct load_thread* threads = calloc(num_connections, sizeof(*threads));
+    if (threads == NULL)
+        log_fatal("out of memory");
+    uint64_t start = load_now();
+    deadline = start + (uint64_t)(duration * 1e9);
+    unsigned num_threads = 0;
+    for (; num_threads < num_connections; ++num_threads)
+    {
+        struct load_thread* t = &threads[num_threads];
+        t->seed = num_threads * 2654435761u + (unsigned)start;
+        t->socketmap_fd = -1;
+        t->milter_fd = -1;
+        if (pthread_create(&t->thread, NULL, load_thread_run, t) != 0)
+        {
+            log_error("cannot create thread");
+            break;
+        }
+    }
+    for (unsigned i = 0; i < num_threads; ++i)
+        pthread_join(threads[i].thread, NULL);
+    double elapsed = (double)(load_now() - start) / 1e9;
+
+    struct load_stats total[NUM_OPS];
+    uint64_t connect_errors = 0;
+    uint64_t total_count = 0;
+    uint64_t total_errors = 0;
+    memset(total, 0, sizeof(total));
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        connect_errors += threads[i].connect_errors;
+        for (int op = 0; op < NUM_OPS; ++op)
+        {
+            struct load_stats* s = &threads[i].stats[op];
+            for (size_t j = 0; j < s->size; ++j)
+                record(&total[op], s->latencies[j]);
+            total[op].errors += s->errors;
+            free(s->latencies);
+        }
+    }
+    free(threads);
+
+    fprintf(out,
+            "{\n  \"version\": \"%s\",\n  \"connections\": %u,\n"
+            "  \"duration\": %.3f,\n  \"recipients\": %u,\n"
+            "  \"operations\": [",
+            POSTSRSD_VERSION, num_threads, elapsed, num_recipients);
+    bool first = true;
+    for (int op = 0; op < NUM_OPS; ++op)
+    {
+        struct load_stats* s = &total[op];
+        if (weights[op] == 0)
+            continue;
+        qsort(s->latencies, s->size, sizeof(uint64_t), compare_uint64);
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"count\": %zu, "
+                "\"errors\": %" PRIu64 ", \"ops_per_sec\": %.1f, "
+                "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+                "\"p999\": %.1f, \"max\": %.1f}}",
+                first ? "" : ",", op_names[op], s->size, s->errors,
+                (double)s->size / elapsed,
+                percentile_us(s->latencies, s->size, 0.5),
+                percentile_us(s->latencies, s->size, 0.99),
+                percentile_us(s->latencies, s->size, 0.999),
+                percentile_us(s->latencies, s->size, 1.0));
+        first = false;
+        total_count += s->size;
+        total_errors += s->errors;
+        free(s->latencies);
+    }
+    fprintf(out,
+            "\n  ],\n  \"total\": {\"count\": %" PRIu64 ", \"errors\": %" PRIu64
+            ", \"connect_errors\": %" PRIu64 ", \"ops_per_sec\": %.1f}\n}\n",
+            total_count, total_errors, connect_errors,
+            (double)total_count / elapsed);
+    if (out != stdout)
+        fclose(out);
+    return total_errors == 0 && connect_errors == 0 ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+}
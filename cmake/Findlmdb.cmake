@@ -0,0 +1,27 @@
+# Copyright 2026 Timo Röhling <timo@gaussglocke.de>
+# SPDX-License-Identifier: FSFAP
+#
+# Copying and distribution of this file, with or without modification, are
+# permitted in any medium without royalty provided the copyright notice and
+# this notice are preserved. This file is offered as-is, without any warranty.
+#
+include(FindPackageHandleStandardArgs)
+find_package(PkgConfig QUIET)
+if(PkgConfig_FOUND)
+    pkg_search_module(PC_LMDB QUIET lmdb)
+endif()
+find_path(lmdb_INCLUDE_DIR lmdb.h HINTS ${PC_LMDB_INCLUDE_DIRS})
+find_library(lmdb_LIBRARY lmdb HINTS ${PC_LMDB_LIBRARY_DIRS})
+find_package_handle_standard_args(
+    lmdb
+    FOUND_VAR lmdb_FOUND
+    REQUIRED_VARS lmdb_INCLUDE_DIR lmdb_LIBRARY
+)
+if(lmdb_FOUND AND NOT TARGET lmdb::lmdb)
+    add_library(lmdb::lmdb UNKNOWN IMPORTED)
+    set_target_properties(
+        lmdb::lmdb
+        PROPERTIES IMPORTED_LOCATION "${lmdb_LIBRARY}"
+                   INTERFACE_INCLUDE_DIRECTORIES "${lmdb_INCLUDE_DIR}"
+    )
+endif()
@@ -20,7 +20,6 @@
 #include "postsrsd_build_config.h"
 #include "util.h"
 
-#include <ctype.h>
 #include <errno.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -45,6 +44,30 @@ static int parse_original_envelope(cfg_t* cfg, cfg_opt_t* opt,
     return 0;
 }
 
+static int parse_socketmap_engine(cfg_t* cfg, cfg_opt_t* opt,
+                                  const char* value, void* result)
+{
+    if (strcasecmp(value, "process") == 0)
+        *(long*)result = SOCKETMAP_ENGINE_PROCESS;
+    else if (strcasecmp(value, "event") == 0)
+    {
+#ifdef HAVE_SYS_EPOLL_H
+        *(long*)result = SOCKETMAP_ENGINE_EVENT;
+#else
+        cfg_error(cfg, "option '%s' cannot be 'event' on this system",
+                  cfg_opt_name(opt));
+        return -1;
+#endif
+    }
+    else
+    {
+        cfg_error(cfg, "option '%s' must be either 'process' or 'event'",
+                  cfg_opt_name(opt));
+        return -1;
+    }
+    return 0;
+}
+
 static int validate_separator(cfg_t* cfg, cfg_opt_t* opt)
 {
     const char* value = cfg_opt_getstr(opt);
@@ -80,24 +103,6 @@ static int validate_hash_size(cfg_t* cfg, cfg_opt_t* opt)
     return 0;
 }
 
-static bool is_valid_domain_name(const char* s)
-{
-    char prev = 0;
-    if (s == NULL)
-        return false;
-    if (*s == 0)
-        return false;
-    while (*s != 0)
-    {
-        if (*s == '.' && prev == '.')
-            return false;
-        if (!isalnum((unsigned char)*s) && *s != '-' && *s != '.')
-            return false;
-        prev = *s++;
-    }
-    return prev != '.';
-}
-
 static int validate_domain_names(cfg_t* cfg, cfg_opt_t* opt)
 {
     unsigned ndomains = cfg_opt_size(opt);
@@ -181,13 +186,24 @@ cfg_t* config_defaults()
         CFG_INT("hash-minimum", 4, CFGF_NONE),
         CFG_BOOL("always-rewrite", cfg_false, CFGF_NONE),
         CFG_STR("socketmap", "unix:/var/spool/postfix/srs", CFGF_NONE),
+        CFG_INT_CB("socketmap-engine", SOCKETMAP_ENGINE_PROCESS, CFGF_NONE,
+                   parse_socketmap_engine),
         CFG_INT("keep-alive", 30, CFGF_NONE),
         CFG_INT("connection-limit", 200, CFGF_NONE),
+        CFG_INT("worker-pool", 0, CFGF_NONE),
+        CFG_INT("worker-threads", 0, CFGF_NONE),
         CFG_STR("milter", NULL, CFGF_NODEFAULT),
         CFG_BOOL("milter-rewrite-local", cfg_false, CFGF_NONE),
         CFG_INT("milter-recipient-limit", 1000, CFGF_NONE),
+        CFG_STR("metrics", NULL, CFGF_NODEFAULT),
+        CFG_STR("control-socket", NULL, CFGF_NODEFAULT),
         CFG_STR("secrets-file", DEFAULT_SECRETS_FILE, CFGF_NONE),
         CFG_STR("envelope-database", NULL, CFGF_NODEFAULT),
+        CFG_INT("envelope-cache-size", 0, CFGF_NONE),
+        CFG_INT("envelope-cache-ttl", 300, CFGF_NONE),
+        CFG_INT("envelope-cache-negative-ttl", 10, CFGF_NONE),
+        CFG_INT("envelope-write-interval", 3600, CFGF_NONE),
+        CFG_INT("envelope-expire-interval", 3600, CFGF_NONE),
         CFG_STR("pid-file", NULL, CFGF_NODEFAULT),
         CFG_STR("unprivileged-user", DEFAULT_POSTSRSD_USER, CFGF_NONE),
         CFG_STR("chroot-dir", DEFAULT_CHROOT_DIR, CFGF_NONE),
@@ -205,7 +221,14 @@ cfg_t* config_defaults()
     cfg_set_validate_func(cfg, "hash-minimum", validate_hash_size);
     cfg_set_validate_func(cfg, "keep-alive", validate_uint);
     cfg_set_validate_func(cfg, "connection-limit", validate_uint);
+    cfg_set_validate_func(cfg, "worker-pool", validate_uint);
+    cfg_set_validate_func(cfg, "worker-threads", validate_uint);
     cfg_set_validate_func(cfg, "milter-recipient-limit", validate_uint);
+    cfg_set_validate_func(cfg, "envelope-cache-size", validate_uint);
+    cfg_set_validate_func(cfg, "envelope-cache-ttl", validate_uint);
+    cfg_set_validate_func(cfg, "envelope-cache-negative-ttl", validate_uint);
+    cfg_set_validate_func(cfg, "envelope-write-interval", validate_uint);
+    cfg_set_validate_func(cfg, "envelope-expire-interval", validate_uint);
     cfg_set_validate_func(cfg, "unprivileged-user", validate_unprivileged_user);
     return cfg;
 }
@@ -389,46 +412,11 @@ bool srs_domains_from_config(cfg_t* cfg, char** srs_domain,
     char* domains_file = cfg_getstr(cfg, "domains-file");
     if (NONEMPTY_STRING(domains_file))
     {
-        FILE* f = fopen(domains_file, "r");
-        if (f)
-        {
-            char buffer[1024];
-            char* end;
-            while ((domain = fgets(buffer, sizeof(buffer), f)) != NULL)
-            {
-                end = strpbrk(domain, "#\r\n");
-                if (end != NULL)
-                    *end = 0;
-                else
-                    end = domain + strlen(domain);
-                while (isspace((unsigned char)domain[0]))
-                    ++domain;
-                while (end != domain && isspace((unsigned char)*(end - 1)))
-                    *--end = 0;
-                if (NULL_OR_EMPTY_STRING(domain))
-                    continue;
-                if (is_valid_domain_name(domain))
-                {
-                    if (!domain_set_add(*local_domains, domain))
-                        log_warn("duplicate local domain: %s", domain);
-                    if (*srs_domain == NULL)
-                        *srs_domain =
-                            strdup(domain[0] == '.' ? domain + 1 : domain);
-                }
-                else
-                {
-                    log_error("invalid domain name '%s' in domains file",
-                              domain);
-                    goto fail;
-                }
-            }
-            fclose(f);
-        }
-        else
-        {
-            log_error("cannot read local domains from %s", domains_file);
+        if (!domain_set_read_file(*local_domains, domains_file))
             goto fail;
-        }
+        const char* first = domain_set_first(*local_domains);
+        if (*srs_domain == NULL && first != NULL)
+            *srs_domain = strdup(first[0] == '.' ? first + 1 : first);
     }
     if (*srs_domain == NULL)
     {
@@ -20,6 +20,9 @@
 #define SRS_ENVELOPE_EMBEDDED 0
 #define SRS_ENVELOPE_DATABASE 1
 
+#define SOCKETMAP_ENGINE_PROCESS 0
+#define SOCKETMAP_ENGINE_EVENT   1
+
 #include "srs2.h"
 #include "util.h"
 
@@ -16,17 +16,36 @@
  */
 #include "database.h"
 
+#include "metrics.h"
 #include "postsrsd_build_config.h"
 #include "util.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#endif
 #ifdef WITH_REDIS
+#    include <arpa/inet.h>
 #    include <hiredis.h>
+#    include <netinet/in.h>
+#    include <sys/socket.h>
 #endif
 #ifdef WITH_SQLITE
 #    include <sqlite3.h>
 #endif
+#ifdef WITH_LMDB
+#    include <lmdb.h>
+#endif
 #ifdef HAVE_SYS_TIME_H
 #    include <sys/time.h>
 #endif
@@ -36,18 +55,355 @@
 
 struct database
 {
-    char* (*read)(database_t*, const char*);
-    bool (*write)(database_t*, const char*, const char*, unsigned);
-    void (*expire)(database_t*);
+    char* (*read)(database_t*, const char*, size_t);
+    bool (*write)(database_t*, const char*, size_t, const char*, unsigned);
+    bool (*expire)(database_t*, unsigned, size_t*);
+    bool (*flush)(database_t*);
+    bool (*ping)(database_t*);
     void (*disconnect)(database_t*);
     void* handle;
+    char* uri;
+    bool create_if_not_exist;
+    bool connected;
+    bool connection_lost;
+    time_t last_used;
+    time_t next_reconnect;
+    unsigned reconnect_delay;
+    bool read_failed;
+    bool legacy_keys;
+    bool write_pending;
+#if defined(__GNUC__) && defined(HAVE_SYS_MMAN_H)
+    struct pending_write* pending_writes;
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_capacity;
+#endif
 #ifdef WITH_SQLITE
     sqlite3_stmt *read_stmt, *write_stmt, *expire_stmt;
+    unsigned sqlite_batch;
+    unsigned sqlite_pending;
+    unsigned sqlite_busy_errors;
+#endif
+#ifdef WITH_REDIS
+    bool redis_async_writes;
+    unsigned redis_pending;
+    unsigned redis_max_pending;
+    char redis_peer[INET6_ADDRSTRLEN];
+#endif
+#ifdef WITH_LMDB
+    MDB_txn* lmdb_read_txn;
+    char lmdb_expire_key[64];
+    size_t lmdb_expire_key_len;
+#endif
+#if defined(__GNUC__) && defined(HAVE_SYS_MMAN_H)
+    size_t mmap_size;
+    uint64_t mmap_expire_pos;
+    int mmap_fd;
+#endif
+};
+
+/* Older versions stored aliases as base32hex text with an "@1" suffix */
+#define DATABASE_LEGACY_KEY_SIZE 35
+
+/* Persistent connections of long-lived workers are checked before they are
+   used after being idle for a while, and lost connections are reopened
+   with an exponential backoff */
+#define DATABASE_PING_INTERVAL      30
+#define DATABASE_MAX_RECONNECT_DELAY 60
+
+#if defined(__GNUC__) && defined(HAVE_SYS_MMAN_H)
+#    define WITH_ENVELOPE_CACHE 1
+#    define WITH_MMAP_DATABASE  1
 #endif
+
+#ifdef WITH_ENVELOPE_CACHE
+static void spin_wait(unsigned spins)
+{
+    /* Give a preempted lock holder the chance to finish */
+    if (spins % 64 == 63)
+        sched_yield();
+}
+
+/* The envelope cache is a set-associative table with LRU replacement in each
+   set. It is mapped into shared memory before the workers are forked, so
+   all processes and threads share it. Every set has a spinlock; a lock
+   holder that dies would block its set forever, so lookups give up and
+   bypass the cache if they cannot get the lock in time. */
+#    define CACHE_WAYS       8
+#    define CACHE_KEY_SIZE   40
+#    define CACHE_VALUE_SIZE 513
+#    define CACHE_MAX_SPINS  100000
+
+struct cache_entry
+{
+    time_t expires;
+    time_t written;
+    uint64_t last_used;
+    bool negative;
+    unsigned char key_len;
+    char key[CACHE_KEY_SIZE];
+    char value[CACHE_VALUE_SIZE];
+};
+
+struct cache_set
+{
+    char lock;
+    struct cache_entry entries[CACHE_WAYS];
+};
+
+struct cache
+{
+    uint64_t clock;
+    size_t num_sets;
+    struct cache_set sets[];
+};
+
+static struct cache* cache = NULL;
+static size_t cache_mapped_size = 0;
+static unsigned cache_ttl = 0;
+static unsigned cache_negative_ttl = 0;
+static unsigned cache_write_interval = 0;
+
+static struct cache_set* cache_lock(const char* key, size_t key_len)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key_len; ++i)
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    struct cache_set* set = &cache->sets[h % cache->num_sets];
+    for (unsigned spins = 0; spins < CACHE_MAX_SPINS; ++spins)
+    {
+        if (!__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE))
+            return set;
+        spin_wait(spins);
+    }
+    return NULL;
+}
+
+static void cache_unlock(struct cache_set* set)
+{
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+}
+
+static struct cache_entry* cache_find(struct cache_set* set, const char* key,
+                                      size_t key_len, time_t now)
+{
+    for (unsigned i = 0; i < CACHE_WAYS; ++i)
+    {
+        struct cache_entry* e = &set->entries[i];
+        if (e->expires > now && e->key_len == key_len
+            && memcmp(e->key, key, key_len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void cache_put(const char* key, size_t key_len, const char* value,
+                      unsigned ttl, bool written)
+{
+    if (cache == NULL || ttl == 0 || key_len > CACHE_KEY_SIZE
+        || (value != NULL && strlen(value) >= CACHE_VALUE_SIZE))
+        return;
+    struct cache_set* set = cache_lock(key, key_len);
+    if (set == NULL)
+        return;
+    time_t now = time(NULL);
+    struct cache_entry* e = cache_find(set, key, key_len, now);
+    if (e == NULL)
+    {
+        /* Replace an expired entry or the least recently used one */
+        e = &set->entries[0];
+        for (unsigned i = 0; i < CACHE_WAYS && e->expires > now; ++i)
+        {
+            struct cache_entry* f = &set->entries[i];
+            if (f->expires <= now || f->last_used < e->last_used)
+                e = f;
+        }
+        memcpy(e->key, key, key_len);
+        e->key_len = key_len;
+        e->written = 0;
+    }
+    if (written)
+        e->written = now;
+    e->expires = now + ttl;
+    e->last_used = __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED);
+    e->negative = value == NULL;
+    strcpy(e->value, value != NULL ? value : "");
+    cache_unlock(set);
+}
+
+static bool cache_get(const char* key, size_t key_len, char** value)
+{
+    /* Returns true on a cache hit; *value is NULL for cached unknown
+       aliases. */
+    if (cache == NULL || key_len > CACHE_KEY_SIZE)
+        return false;
+    struct cache_set* set = cache_lock(key, key_len);
+    if (set == NULL)
+        return false;
+    bool hit = false;
+    struct cache_entry* e = cache_find(set, key, key_len, time(NULL));
+    if (e != NULL)
+    {
+        e->last_used = __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED);
+        *value = e->negative ? NULL : strdup(e->value);
+        hit = e->negative || *value != NULL;
+    }
+    cache_unlock(set);
+    return hit;
+}
+
+static bool cache_recently_written(const char* key, size_t key_len,
+                                   const char* value)
+{
+    if (cache == NULL || cache_write_interval == 0 || key_len > CACHE_KEY_SIZE)
+        return false;
+    struct cache_set* set = cache_lock(key, key_len);
+    if (set == NULL)
+        return false;
+    time_t now = time(NULL);
+    struct cache_entry* e = cache_find(set, key, key_len, now);
+    bool recent = e != NULL && !e->negative
+                  && e->written + cache_write_interval > now
+                  && strcmp(e->value, value) == 0;
+    cache_unlock(set);
+    return recent;
+}
+
+static void cache_confirm_write(const char* key, size_t key_len, bool success)
+{
+    if (cache == NULL)
+        return;
+    struct cache_set* set = cache_lock(key, key_len);
+    if (set == NULL)
+        return;
+    time_t now = time(NULL);
+    struct cache_entry* e = cache_find(set, key, key_len, now);
+    if (e != NULL)
+        e->written = success ? now : 0;
+    cache_unlock(set);
+}
+
+/* Batched and asynchronous writes are not durable until the backend has
+   committed or acknowledged them, so their keys are queued and only marked
+   as written in the cache once the outcome is known. A failed write is
+   forgotten, and the next request for the same envelope will retry it. */
+struct pending_write
+{
+    unsigned char key_len;
+    char key[CACHE_KEY_SIZE];
 };
 
+static void db_queue_write(database_t* db, const char* key, size_t key_len)
+{
+    if (db->pending_count == db->pending_capacity)
+    {
+        size_t capacity =
+            db->pending_capacity > 0 ? 2 * db->pending_capacity : 16;
+        struct pending_write* writes =
+            malloc(capacity * sizeof(struct pending_write));
+        if (writes == NULL)
+            return;
+        for (size_t i = 0; i < db->pending_count; ++i)
+            writes[i] = db->pending_writes[(db->pending_head + i)
+                                           % db->pending_capacity];
+        free(db->pending_writes);
+        db->pending_writes = writes;
+        db->pending_head = 0;
+        db->pending_capacity = capacity;
+    }
+    struct pending_write* w =
+        &db->pending_writes[(db->pending_head + db->pending_count)
+                            % db->pending_capacity];
+    /* Keys which are too long for the cache only keep their place in the
+       queue */
+    w->key_len = key_len <= CACHE_KEY_SIZE ? key_len : 0;
+    memcpy(w->key, key, w->key_len);
+    ++db->pending_count;
+}
+#endif
+
+static void db_confirm_writes(database_t* db, size_t count, bool success)
+{
+    /* Resolves the oldest count pending writes, or all of them if count is
+       SIZE_MAX */
+#ifdef WITH_ENVELOPE_CACHE
+    while (count-- > 0 && db->pending_count > 0)
+    {
+        struct pending_write* w = &db->pending_writes[db->pending_head];
+        if (w->key_len > 0)
+            cache_confirm_write(w->key, w->key_len, success);
+        db->pending_head = (db->pending_head + 1) % db->pending_capacity;
+        --db->pending_count;
+    }
+#else
+    MAYBE_UNUSED(db);
+    MAYBE_UNUSED(count);
+    MAYBE_UNUSED(success);
+#endif
+}
+
+bool database_cache_init(size_t entries, unsigned ttl, unsigned negative_ttl,
+                         unsigned write_interval)
+{
+#ifdef WITH_ENVELOPE_CACHE
+    size_t num_sets = (entries + CACHE_WAYS - 1) / CACHE_WAYS;
+    size_t size = sizeof(struct cache) + num_sets * sizeof(struct cache_set);
+    cache_ttl = ttl;
+    cache_negative_ttl = negative_ttl;
+    cache_write_interval = write_interval;
+    if (cache != NULL && cache->num_sets == num_sets)
+        return true;
+    database_cache_shutdown();
+    if (num_sets == 0)
+        return true;
+    /* Fresh anonymous mappings are zero-filled, so all entries are expired
+       and all locks are released */
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+    {
+        log_perror(errno, "mmap");
+        return false;
+    }
+    cache = block;
+    cache->num_sets = num_sets;
+    cache_mapped_size = size;
+    return true;
+#else
+    MAYBE_UNUSED(ttl);
+    MAYBE_UNUSED(negative_ttl);
+    MAYBE_UNUSED(write_interval);
+    if (entries > 0)
+        log_warn("envelope cache is not supported on this system");
+    return true;
+#endif
+}
+
+void database_cache_shutdown()
+{
+#ifdef WITH_ENVELOPE_CACHE
+    if (cache != NULL)
+        munmap(cache, cache_mapped_size);
+    cache = NULL;
+    cache_mapped_size = 0;
+#endif
+}
+
 #ifdef WITH_SQLITE
-static char* db_sqlite_read(database_t* db, const char* key)
+/* A connection which keeps running into locked databases is reopened, in
+   case it is the one holding on to a stale lock or snapshot */
+#    define SQLITE_MAX_BUSY_ERRORS 16
+
+static void db_sqlite_check_busy(database_t* db, int result)
+{
+    if (result != SQLITE_BUSY && result != SQLITE_LOCKED)
+        db->sqlite_busy_errors = 0;
+    else if (++db->sqlite_busy_errors >= SQLITE_MAX_BUSY_ERRORS)
+        db->connection_lost = true;
+}
+
+static char* db_sqlite_read(database_t* db, const char* key, size_t key_len)
 {
     if (db->read_stmt == NULL)
     {
@@ -57,16 +413,21 @@ static char* db_sqlite_read(database_t* db, const char* key)
             != SQLITE_OK)
         {
             log_error("failed to prepare sqlite read statement");
+            metrics_inc(METRIC_DATABASE_READ_ERROR);
+            db->read_failed = true;
             return NULL;
         }
     }
     char* value = NULL;
-    sqlite3_bind_text(db->read_stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(db->read_stmt, 1, key, key_len, SQLITE_STATIC);
     int result = sqlite3_step(db->read_stmt);
-    if (result == SQLITE_ERROR)
+    db_sqlite_check_busy(db, result);
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
     {
         sqlite3* handle = (sqlite3*)db->handle;
         log_warn("sqlite read error: %s", sqlite3_errmsg(handle));
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
     }
     if (result == SQLITE_ROW)
     {
@@ -79,8 +440,29 @@ static char* db_sqlite_read(database_t* db, const char* key)
     return value;
 }
 
-static bool db_sqlite_write(database_t* db, const char* key, const char* value,
-                            unsigned lifetime)
+static bool db_sqlite_flush(database_t* db)
+{
+    /* Commits a pending batch of writes */
+    sqlite3* handle = (sqlite3*)db->handle;
+    if (sqlite3_get_autocommit(handle))
+        return true;
+    unsigned pending = db->sqlite_pending;
+    db->sqlite_pending = 0;
+    if (sqlite3_exec(handle, "COMMIT", NULL, NULL, NULL) == SQLITE_OK)
+    {
+        db_confirm_writes(db, SIZE_MAX, true);
+        return true;
+    }
+    log_warn("sqlite write error: %s, %u envelopes lost",
+             sqlite3_errmsg(handle), pending);
+    sqlite3_exec(handle, "ROLLBACK", NULL, NULL, NULL);
+    metrics_add(METRIC_DATABASE_WRITE_ERROR, pending);
+    db_confirm_writes(db, SIZE_MAX, false);
+    return false;
+}
+
+static bool db_sqlite_write(database_t* db, const char* key, size_t key_len,
+                            const char* value, unsigned lifetime)
 {
     if (db->write_stmt == NULL)
     {
@@ -94,11 +476,26 @@ static bool db_sqlite_write(database_t* db, const char* key, const char* value,
             return false;
         }
     }
+    if (db->sqlite_batch > 1 && db->sqlite_pending == 0)
+    {
+        /* Take the write lock right away, so the transaction cannot fail
+           with SQLITE_BUSY halfway through the batch */
+        sqlite3* handle = (sqlite3*)db->handle;
+        int result = sqlite3_exec(handle, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+        db_sqlite_check_busy(db, result);
+        if (result != SQLITE_OK)
+        {
+            log_warn("sqlite write error: %s", sqlite3_errmsg(handle));
+            return false;
+        }
+    }
     bool success = true;
-    sqlite3_bind_text(db->write_stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(db->write_stmt, 1, key, key_len, SQLITE_STATIC);
     sqlite3_bind_text(db->write_stmt, 2, value, -1, SQLITE_STATIC);
     sqlite3_bind_int64(db->write_stmt, 3, time(NULL) + lifetime);
-    if (sqlite3_step(db->write_stmt) == SQLITE_ERROR)
+    int result = sqlite3_step(db->write_stmt);
+    db_sqlite_check_busy(db, result);
+    if (result != SQLITE_DONE)
     {
         sqlite3* handle = (sqlite3*)db->handle;
         log_warn("sqlite write error: %s", sqlite3_errmsg(handle));
@@ -106,94 +503,416 @@ static bool db_sqlite_write(database_t* db, const char* key, const char* value,
     }
     sqlite3_reset(db->write_stmt);
     sqlite3_clear_bindings(db->write_stmt);
+    if (db->sqlite_batch > 1)
+    {
+        /* A batch which has not stored anything yet is closed right away,
+           so the next write can begin a new one */
+        if (!success && db->sqlite_pending == 0)
+            sqlite3_exec((sqlite3*)db->handle, "ROLLBACK", NULL, NULL, NULL);
+        if (success)
+            ++db->sqlite_pending;
+        if (db->sqlite_pending >= db->sqlite_batch)
+            success = db_sqlite_flush(db);
+        db->write_pending = db->sqlite_pending > 0;
+    }
     return success;
 }
 
-static void db_sqlite_expire(database_t* db)
+static bool db_sqlite_expire(database_t* db, unsigned limit, size_t* removed)
 {
+    sqlite3* handle = (sqlite3*)db->handle;
     if (db->expire_stmt == NULL)
     {
-        sqlite3* handle = (sqlite3*)db->handle;
-        if (sqlite3_prepare_v2(handle, "DELETE FROM kv WHERE lt <= ?", -1,
-                               &db->expire_stmt, NULL)
+        /* The oldest entries are found with the ltidx index, so each batch
+           only touches the rows it deletes */
+        if (sqlite3_prepare_v2(handle,
+                               "DELETE FROM kv WHERE k IN (SELECT k FROM kv "
+                               "WHERE lt <= ? ORDER BY lt LIMIT ?)",
+                               -1, &db->expire_stmt, NULL)
             != SQLITE_OK)
         {
             log_error("failed to prepare sqlite expire statement");
-            return;
+            return false;
         }
     }
+    db_sqlite_flush(db);
+    bool success = true;
     sqlite3_bind_int64(db->expire_stmt, 1, time(NULL));
-    sqlite3_step(db->expire_stmt);
+    sqlite3_bind_int64(db->expire_stmt, 2,
+                       limit > 0 ? (sqlite3_int64)limit : -1);
+    if (sqlite3_step(db->expire_stmt) != SQLITE_DONE)
+    {
+        log_warn("sqlite expire error: %s", sqlite3_errmsg(handle));
+        success = false;
+    }
+    else
+        *removed = (size_t)sqlite3_changes(handle);
     sqlite3_reset(db->expire_stmt);
+    return success;
 }
 
 static void db_sqlite_disconnect(database_t* db)
 {
     sqlite3* handle = (sqlite3*)db->handle;
+    db_sqlite_flush(db);
     sqlite3_finalize(db->expire_stmt);
     sqlite3_finalize(db->read_stmt);
     sqlite3_finalize(db->write_stmt);
     sqlite3_close(handle);
 }
 
+struct sqlite_options
+{
+    const char* journal_mode;
+    const char* synchronous;
+    int busy_timeout;
+    long long mmap_size;
+    int without_rowid;
+    unsigned batch;
+};
+
+static const char* sqlite_option_keyword(const char* value,
+                                         const char* const* keywords)
+{
+    for (const char* const* keyword = keywords; *keyword != NULL; ++keyword)
+    {
+        if (strcasecmp(value, *keyword) == 0)
+            return *keyword;
+    }
+    log_error("invalid sqlite option value '%s'", value);
+    return NULL;
+}
+
+static bool sqlite_option_number(const char* option, const char* value,
+                                 long long max_value, long long* number)
+{
+    char* end;
+    long long n = strtoll(value, &end, 10);
+    if (*value == 0 || *end != 0 || n < 0 || n > max_value)
+    {
+        log_error("invalid value for sqlite option '%s'", option);
+        return false;
+    }
+    *number = n;
+    return true;
+}
+
+static bool db_sqlite_parse_options(struct sqlite_options* opts,
+                                    const char* options)
+{
+    /* Options are appended to the URI like a query string, e.g.
+       sqlite:senders.db?profile=concurrent&batch=32 */
+    static const char* const journal_modes[] = {"DELETE", "TRUNCATE",
+                                                "PERSIST", "WAL", NULL};
+    static const char* const sync_modes[] = {"OFF", "NORMAL", "FULL",
+                                             "EXTRA", NULL};
+    char* copy = strdup(options);
+    char* saveptr = NULL;
+    bool success = true;
+    bool profile = false;
+    long long n;
+    if (copy == NULL)
+        return false;
+    for (char* option = strtok_r(copy, "&", &saveptr); option != NULL;
+         option = strtok_r(NULL, "&", &saveptr))
+    {
+        char* value = strchr(option, '=');
+        if (value == NULL)
+        {
+            log_error("missing value for sqlite option '%s'", option);
+            success = false;
+            break;
+        }
+        *value++ = 0;
+        if (strcmp(option, "profile") == 0 && strcmp(value, "default") == 0)
+            profile = false;
+        else if (strcmp(option, "profile") == 0
+                 && strcmp(value, "concurrent") == 0)
+            profile = true;
+        else if (strcmp(option, "journal") == 0)
+        {
+            opts->journal_mode = sqlite_option_keyword(value, journal_modes);
+            if (!(success = opts->journal_mode != NULL))
+                break;
+        }
+        else if (strcmp(option, "synchronous") == 0)
+        {
+            opts->synchronous = sqlite_option_keyword(value, sync_modes);
+            if (!(success = opts->synchronous != NULL))
+                break;
+        }
+        else if (strcmp(option, "busy-timeout") == 0)
+        {
+            if (!(success = sqlite_option_number(option, value, 3600000, &n)))
+                break;
+            opts->busy_timeout = (int)n;
+        }
+        else if (strcmp(option, "mmap-size") == 0)
+        {
+            if (!(success = sqlite_option_number(option, value, 1LL << 40, &n)))
+                break;
+            opts->mmap_size = n;
+        }
+        else if (strcmp(option, "batch") == 0)
+        {
+            if (!(success = sqlite_option_number(option, value, 1024, &n)))
+                break;
+            opts->batch = n > 0 ? (unsigned)n : 1;
+        }
+        else if (strcmp(option, "without-rowid") == 0
+                 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+            opts->without_rowid = strcmp(value, "on") == 0;
+        else
+        {
+            log_error("invalid sqlite option '%s=%s'", option, value);
+            success = false;
+            break;
+        }
+    }
+    free(copy);
+    if (profile)
+    {
+        /* The concurrent profile only fills in what was not set explicitly */
+        if (opts->journal_mode == NULL)
+            opts->journal_mode = "WAL";
+        if (opts->synchronous == NULL)
+            opts->synchronous = "NORMAL";
+        if (opts->busy_timeout < 0)
+            opts->busy_timeout = 5000;
+        if (opts->mmap_size < 0)
+            opts->mmap_size = 64LL << 20;
+        if (opts->without_rowid < 0)
+            opts->without_rowid = 1;
+    }
+    return success;
+}
+
+static void db_sqlite_legacy_alias(sqlite3_context* ctx, int argc,
+                                   sqlite3_value** argv)
+{
+    /* Maps a text key "<base32hex digest>@1" to the digest, or NULL for
+       anything else */
+    char alias[DATABASE_ALIAS_SIZE];
+    MAYBE_UNUSED(argc);
+    if (sqlite3_value_type(argv[0]) == SQLITE_TEXT)
+    {
+        const char* key = (const char*)sqlite3_value_text(argv[0]);
+        if (sqlite3_value_bytes(argv[0]) == 34 && strcmp(key + 32, "@1") == 0
+            && b32h_decode(key, 32, alias, sizeof(alias)) != NULL)
+        {
+            sqlite3_result_blob(ctx, alias, sizeof(alias), SQLITE_TRANSIENT);
+            return;
+        }
+    }
+    sqlite3_result_null(ctx);
+}
+
+static bool db_sqlite_migrate_keys(sqlite3* handle, char** err)
+{
+    /* Older versions stored aliases as base32hex text. The user_version
+       marks databases which have been converted to binary keys. */
+    sqlite3_stmt* stmt;
+    int version = 0;
+    if (sqlite3_prepare_v2(handle, "PRAGMA user_version", -1, &stmt, NULL)
+        != SQLITE_OK)
+        return false;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (version >= 1)
+        return true;
+    if (sqlite3_create_function(handle, "postsrsd_legacy_alias", 1,
+                                SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                db_sqlite_legacy_alias, NULL, NULL)
+        != SQLITE_OK)
+        return false;
+    /* Keys which are already stored in both formats keep the binary one */
+    if (sqlite3_exec(handle,
+                     "BEGIN IMMEDIATE;"
+                     "UPDATE OR IGNORE kv SET k = postsrsd_legacy_alias(k) "
+                     "WHERE postsrsd_legacy_alias(k) IS NOT NULL;"
+                     "DELETE FROM kv "
+                     "WHERE postsrsd_legacy_alias(k) IS NOT NULL;"
+                     "PRAGMA user_version = 1;"
+                     "COMMIT;",
+                     NULL, NULL, err)
+        != SQLITE_OK)
+    {
+        sqlite3_exec(handle, "ROLLBACK", NULL, NULL, NULL);
+        return false;
+    }
+    return true;
+}
+
 static bool db_sqlite_connect(database_t* db, const char* uri,
                               bool create_if_not_exist)
 {
+    struct sqlite_options opts = {NULL, NULL, -1, -1, -1, 1};
     sqlite3* handle;
-    char* err;
-    if (sqlite3_open(uri, &handle) != SQLITE_OK)
+    char* err = NULL;
+    char* filename;
+    char sql[256];
+    const char* options = strchr(uri, '?');
+    if (options != NULL)
+    {
+        if (!db_sqlite_parse_options(&opts, options + 1))
+            return false;
+        filename = strndup(uri, options - uri);
+    }
+    else
+        filename = strdup(uri);
+    if (filename == NULL)
+        return false;
+    if (sqlite3_open(filename, &handle) != SQLITE_OK)
     {
+        free(filename);
         sqlite3_close(handle);
         return false;
     }
+    free(filename);
+    /* The busy timeout must be set first, so the other statements wait for
+       concurrent writers, too. Even without tuning, a short timeout is
+       needed so writes do not fail while the expire worker runs. */
+    sqlite3_busy_timeout(handle,
+                         opts.busy_timeout >= 0 ? opts.busy_timeout : 1000);
+    sql[0] = 0;
+    if (opts.journal_mode != NULL)
+        snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;",
+                 opts.journal_mode);
+    if (opts.synchronous != NULL)
+        snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql),
+                 "PRAGMA synchronous=%s;", opts.synchronous);
+    if (opts.mmap_size >= 0)
+        snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql),
+                 "PRAGMA mmap_size=%lld;", opts.mmap_size);
+    if (sql[0] != 0
+        && sqlite3_exec(handle, sql, NULL, NULL, &err) != SQLITE_OK)
+        goto fail;
     if (create_if_not_exist)
     {
-        if (sqlite3_exec(handle,
-                         "CREATE TABLE IF NOT EXISTS kv ("
-                         "k TEXT NOT NULL UNIQUE ON CONFLICT REPLACE,"
-                         "v TEXT NOT NULL,"
-                         "lt INTEGER NOT NULL);"
-                         "CREATE INDEX IF NOT EXISTS ltidx ON kv (lt)",
-                         NULL, NULL, &err)
-            != SQLITE_OK)
-        {
-            if (err != NULL)
-            {
-                log_error("%s", err);
-                sqlite3_free(err);
-            }
-            sqlite3_close(handle);
-            return false;
-        }
+        /* Existing databases keep their table layout */
+        const char* create_table =
+            opts.without_rowid > 0
+                ? "CREATE TABLE IF NOT EXISTS kv ("
+                  "k BLOB NOT NULL PRIMARY KEY ON CONFLICT REPLACE,"
+                  "v TEXT NOT NULL,"
+                  "lt INTEGER NOT NULL) WITHOUT ROWID;"
+                : "CREATE TABLE IF NOT EXISTS kv ("
+                  "k BLOB NOT NULL UNIQUE ON CONFLICT REPLACE,"
+                  "v TEXT NOT NULL,"
+                  "lt INTEGER NOT NULL);";
+        if (sqlite3_exec(handle, create_table, NULL, NULL, &err) != SQLITE_OK
+            || sqlite3_exec(handle,
+                            "CREATE INDEX IF NOT EXISTS ltidx ON kv (lt)",
+                            NULL, NULL, &err)
+                   != SQLITE_OK
+            || !db_sqlite_migrate_keys(handle, &err))
+            goto fail;
     }
     db->handle = handle;
+    db->legacy_keys = false;
     db->read = db_sqlite_read;
     db->write = db_sqlite_write;
     db->expire = db_sqlite_expire;
+    db->flush = db_sqlite_flush;
+    db->ping = NULL;
     db->disconnect = db_sqlite_disconnect;
     db->read_stmt = NULL;
     db->write_stmt = NULL;
     db->expire_stmt = NULL;
+    db->sqlite_batch = opts.batch;
+    db->sqlite_pending = 0;
+    db->sqlite_busy_errors = 0;
     return true;
+
+fail:
+    if (err != NULL)
+    {
+        log_error("%s", err);
+        sqlite3_free(err);
+    }
+    sqlite3_close(handle);
+    return false;
 }
 #endif
 
 #ifdef WITH_REDIS
-static char* db_redis_read(database_t* db, const char* key)
+static bool db_redis_collect_writes(database_t* db)
+{
+    /* Consume the replies to pipelined writes. Redis answers in order, so
+       these always precede the reply to any command issued later. */
+    redisContext* handle = (redisContext*)db->handle;
+    bool success = true;
+    while (db->redis_pending > 0)
+    {
+        redisReply* reply = NULL;
+        if (redisGetReply(handle, (void**)&reply) != REDIS_OK || reply == NULL)
+        {
+            log_warn("redis connection failure, %u pending writes lost: %s",
+                     db->redis_pending, handle->errstr);
+            db->connection_lost = true;
+            for (; db->redis_pending > 0; --db->redis_pending)
+                metrics_inc(METRIC_DATABASE_WRITE_ERROR);
+            db_confirm_writes(db, SIZE_MAX, false);
+            return false;
+        }
+        --db->redis_pending;
+        if (reply->type == REDIS_REPLY_ERROR)
+        {
+            log_warn("redis write error: %s", reply->str);
+            metrics_inc(METRIC_DATABASE_WRITE_ERROR);
+            success = false;
+        }
+        db_confirm_writes(db, 1, reply->type != REDIS_REPLY_ERROR);
+        freeReplyObject(reply);
+    }
+    return success;
+}
+
+static size_t db_redis_key(char* buffer, size_t bufsize, const char* key,
+                           size_t key_len)
+{
+    /* Keys are binary, so they are passed to Redis with %b */
+    static const char prefix[] = "PostSRSd/";
+    size_t prefix_len = sizeof(prefix) - 1;
+    if (key_len > bufsize - prefix_len)
+        key_len = bufsize - prefix_len;
+    memcpy(buffer, prefix, prefix_len);
+    memcpy(buffer + prefix_len, key, key_len);
+    return prefix_len + key_len;
+}
+
+static char* db_redis_read(database_t* db, const char* key, size_t key_len)
 {
     char buffer[128];
-    snprintf(buffer, sizeof(buffer), "PostSRSd/%s", key);
+    size_t len = db_redis_key(buffer, sizeof(buffer), key, key_len);
     redisContext* handle = (redisContext*)db->handle;
-    redisReply* reply = redisCommand(handle, "GET %s", buffer);
-    if (reply == NULL)
+    redisReply* reply = NULL;
+    /* The GET is queued behind any outstanding writes, so collecting their
+       replies costs no extra round trip. */
+    if (redisAppendCommand(handle, "GET %b", buffer, len) != REDIS_OK)
+    {
+        log_warn("redis connection failure: %s", handle->errstr);
+        db->connection_lost = true;
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
+        return NULL;
+    }
+    db_redis_collect_writes(db);
+    if (redisGetReply(handle, (void**)&reply) != REDIS_OK || reply == NULL)
     {
         log_warn("redis connection failure: %s", handle->errstr);
+        db->connection_lost = true;
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
         return NULL;
     }
     char* value = NULL;
     if (reply->type == REDIS_REPLY_ERROR)
     {
         log_warn("redis read error: %s", reply->str);
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
     }
     if (reply->type == REDIS_REPLY_STRING)
     {
@@ -203,18 +922,48 @@ static char* db_redis_read(database_t* db, const char* key)
     return value;
 }
 
-static bool db_redis_write(database_t* db, const char* key, const char* value,
-                           unsigned lifetime)
+static bool db_redis_write(database_t* db, const char* key, size_t key_len,
+                           const char* value, unsigned lifetime)
 {
     char buffer[128];
-    snprintf(buffer, sizeof(buffer), "PostSRSd/%s", key);
+    size_t len = db_redis_key(buffer, sizeof(buffer), key, key_len);
     redisContext* handle = (redisContext*)db->handle;
     bool success = true;
+    if (db->redis_async_writes)
+    {
+        /* Send the command right away, but do not wait for the reply. The
+           oldest replies are collected first, so this write is still
+           pending when the function returns. */
+        int done = 0;
+        if (db->redis_pending >= db->redis_max_pending)
+            db_redis_collect_writes(db);
+        if (redisAppendCommand(handle, "SETEX %b %u %s", buffer, len, lifetime,
+                               value)
+            != REDIS_OK)
+        {
+            log_warn("redis connection failure: %s", handle->errstr);
+            db->connection_lost = true;
+            return false;
+        }
+        ++db->redis_pending;
+        while (!done)
+        {
+            if (redisBufferWrite(handle, &done) != REDIS_OK)
+            {
+                log_warn("redis connection failure: %s", handle->errstr);
+                db->connection_lost = true;
+                return false;
+            }
+        }
+        db->write_pending = true;
+        return true;
+    }
     redisReply* reply =
-        redisCommand(handle, "SETEX %s %u %s", buffer, lifetime, value);
+        redisCommand(handle, "SETEX %b %u %s", buffer, len, lifetime, value);
     if (reply == NULL)
     {
         log_warn("redis connection failure: %s", handle->errstr);
+        db->connection_lost = true;
         return false;
     }
     if (reply->type == REDIS_REPLY_ERROR)
@@ -226,12 +975,78 @@ static bool db_redis_write(database_t* db, const char* key, const char* value,
     return success;
 }
 
+static bool db_redis_ping(database_t* db)
+{
+    /* Detects connections which the server or a firewall has dropped while
+       the worker was idle */
+    redisContext* handle = (redisContext*)db->handle;
+    if (!db_redis_collect_writes(db))
+        return false;
+    redisReply* reply = redisCommand(handle, "PING");
+    if (reply == NULL)
+    {
+        log_warn("redis connection failure: %s", handle->errstr);
+        return false;
+    }
+    bool success = reply->type == REDIS_REPLY_STATUS;
+    freeReplyObject(reply);
+    return success;
+}
+
 static void db_redis_disconnect(database_t* db)
 {
     redisContext* handle = (redisContext*)db->handle;
+    db_redis_collect_writes(db);
     redisFree(handle);
 }
 
+static bool db_redis_set_options(database_t* db, const char* options)
+{
+    /* Options are appended to the URI like a query string, e.g.
+       redis:localhost:6379?writes=async&max-pending=64 */
+    char* copy = strdup(options);
+    char* saveptr = NULL;
+    bool success = true;
+    if (copy == NULL)
+        return false;
+    for (char* option = strtok_r(copy, "&", &saveptr); option != NULL;
+         option = strtok_r(NULL, "&", &saveptr))
+    {
+        char* value = strchr(option, '=');
+        if (value == NULL)
+        {
+            log_error("missing value for redis option '%s'", option);
+            success = false;
+            break;
+        }
+        *value++ = 0;
+        if (strcmp(option, "writes") == 0 && strcmp(value, "sync") == 0)
+            db->redis_async_writes = false;
+        else if (strcmp(option, "writes") == 0 && strcmp(value, "async") == 0)
+            db->redis_async_writes = true;
+        else if (strcmp(option, "max-pending") == 0)
+        {
+            char* end;
+            long n = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || n < 1 || n > 65536)
+            {
+                log_error("invalid value for redis option 'max-pending'");
+                success = false;
+                break;
+            }
+            db->redis_max_pending = n;
+        }
+        else
+        {
+            log_error("invalid redis option '%s=%s'", option, value);
+            success = false;
+            break;
+        }
+    }
+    free(copy);
+    return success;
+}
+
 static bool db_redis_connect(database_t* db, const char* hostname, int port)
 {
     redisContext* handle;
@@ -252,11 +1067,37 @@ static bool db_redis_connect(database_t* db, const char* hostname, int port)
     }
     if (handle->err)
         goto conn_fail;
-    db->handle = handle;
-    db->read = db_redis_read;
-    db->write = db_redis_write;
-    db->expire = NULL;
+    if (port > 0)
+    {
+        /* Remember the resolved address, so a reconnect still works if the
+           hostname cannot be resolved from within the sandbox */
+        struct sockaddr_storage sa;
+        socklen_t sa_len = sizeof(sa);
+        const void* addr = NULL;
+        if (getpeername(handle->fd, (struct sockaddr*)&sa, &sa_len) == 0)
+        {
+            if (sa.ss_family == AF_INET)
+                addr = &((struct sockaddr_in*)&sa)->sin_addr;
+            else if (sa.ss_family == AF_INET6)
+                addr = &((struct sockaddr_in6*)&sa)->sin6_addr;
+        }
+        if (addr == NULL
+            || inet_ntop(sa.ss_family, addr, db->redis_peer,
+                         sizeof(db->redis_peer))
+                   == NULL)
+            db->redis_peer[0] = 0;
+    }
+    db->handle = handle;
+    /* Text keys of older versions cannot be renamed without scanning the
+       whole keyspace, so they are looked up until they have expired */
+    db->legacy_keys = true;
+    db->read = db_redis_read;
+    db->write = db_redis_write;
+    db->expire = NULL;
+    db->flush = NULL;
+    db->ping = db_redis_ping;
     db->disconnect = db_redis_disconnect;
+    db->redis_pending = 0;
     return true;
 
 conn_fail:
@@ -270,88 +1111,1061 @@ alloc_fail:
 }
 #endif
 
-database_t* database_connect(const char* uri, bool create_if_not_exist)
+#ifdef WITH_LMDB
+/* LMDB does not allow the same environment to be opened more than once in
+   a process, so all connections of a process (i.e. the worker threads)
+   share it. An environment inherited through fork() must not be used. */
+static struct
 {
-    MAYBE_UNUSED(create_if_not_exist);
-    if (NULL_OR_EMPTY_STRING(uri))
+    MDB_env* env;
+    MDB_dbi dbi;
+    char* path;
+    pid_t pid;
+    unsigned refs;
+} lmdb_shared;
+
+static char* db_lmdb_read(database_t* db, const char* key, size_t key_len)
+{
+    int rc;
+    if (db->lmdb_read_txn == NULL)
+        rc = mdb_txn_begin(lmdb_shared.env, NULL, MDB_RDONLY,
+                           &db->lmdb_read_txn);
+    else
+        rc = mdb_txn_renew(db->lmdb_read_txn);
+    if (rc != 0)
     {
-        log_error("not database uri configured");
+        if (db->lmdb_read_txn != NULL)
+            mdb_txn_abort(db->lmdb_read_txn);
+        db->lmdb_read_txn = NULL;
+        log_warn("lmdb read error: %s", mdb_strerror(rc));
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
         return NULL;
     }
-#ifdef WITH_SQLITE
-    if (strncmp(uri, "sqlite:", 7) == 0)
+    /* Values are stored as 64-bit expiry timestamp followed by the string,
+       and are copied out of the memory map before the read snapshot is
+       released */
+    MDB_val k = {.mv_size = key_len, .mv_data = (void*)key};
+    MDB_val v;
+    char* value = NULL;
+    rc = mdb_get(db->lmdb_read_txn, lmdb_shared.dbi, &k, &v);
+    if (rc == 0 && v.mv_size > sizeof(int64_t))
+    {
+        int64_t expires;
+        memcpy(&expires, v.mv_data, sizeof(expires));
+        if (expires > time(NULL))
+            value = strndup((const char*)v.mv_data + sizeof(expires),
+                            v.mv_size - sizeof(expires));
+    }
+    else if (rc != 0 && rc != MDB_NOTFOUND)
     {
-        database_t* db = (database_t*)malloc(sizeof(struct database));
-        if (db == NULL)
+        log_warn("lmdb read error: %s", mdb_strerror(rc));
+        metrics_inc(METRIC_DATABASE_READ_ERROR);
+        db->read_failed = true;
+    }
+    mdb_txn_reset(db->lmdb_read_txn);
+    return value;
+}
+
+static bool db_lmdb_write(database_t* db, const char* key, size_t key_len,
+                          const char* value, unsigned lifetime)
+{
+    MAYBE_UNUSED(db);
+    MDB_txn* txn;
+    int rc = mdb_txn_begin(lmdb_shared.env, NULL, 0, &txn);
+    if (rc == 0)
+    {
+        int64_t expires = time(NULL) + lifetime;
+        size_t len = strlen(value);
+        MDB_val k = {.mv_size = key_len, .mv_data = (void*)key};
+        MDB_val v = {.mv_size = sizeof(expires) + len, .mv_data = NULL};
+        rc = mdb_put(txn, lmdb_shared.dbi, &k, &v, MDB_RESERVE);
+        if (rc == 0)
         {
-            log_error("failed to allocate database connection handle");
-            return NULL;
+            memcpy(v.mv_data, &expires, sizeof(expires));
+            memcpy((char*)v.mv_data + sizeof(expires), value, len);
+            rc = mdb_txn_commit(txn);
         }
-        if (!db_sqlite_connect(db, uri + 7, create_if_not_exist))
+        else
+            mdb_txn_abort(txn);
+    }
+    if (rc != 0)
+    {
+        log_warn("lmdb write error: %s", mdb_strerror(rc));
+        return false;
+    }
+    return true;
+}
+
+/* Every transaction examines a bounded number of keys, so the write lock
+   is never held for a full scan of a large database */
+#    define LMDB_EXPIRE_SCAN_SIZE 4096
+
+static bool db_lmdb_expire_step(database_t* db, bool resume, unsigned limit,
+                                size_t* removed, bool* done)
+{
+    /* Without a secondary index, expired entries are found by walking the
+       keys in order. Each step resumes where the previous one stopped, so
+       the background expiry eventually covers all keys. */
+    MDB_txn* txn;
+    MDB_cursor* cursor;
+    MDB_val k, v;
+    int rc = mdb_txn_begin(lmdb_shared.env, NULL, 0, &txn);
+    if (rc != 0)
+        goto fail;
+    rc = mdb_cursor_open(txn, lmdb_shared.dbi, &cursor);
+    if (rc != 0)
+    {
+        mdb_txn_abort(txn);
+        goto fail;
+    }
+    if (resume && db->lmdb_expire_key_len > 0)
+    {
+        k.mv_size = db->lmdb_expire_key_len;
+        k.mv_data = db->lmdb_expire_key;
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+    }
+    else
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_FIRST);
+    time_t now = time(NULL);
+    size_t count = 0;
+    for (size_t scanned = 0; rc == 0 && scanned < LMDB_EXPIRE_SCAN_SIZE
+                             && (limit == 0 || *removed + count < limit);
+         ++scanned)
+    {
+        int64_t expires = 0;
+        if (v.mv_size >= sizeof(expires))
+            memcpy(&expires, v.mv_data, sizeof(expires));
+        if (expires <= now)
         {
-            log_error("failed to connect to '%s'", uri);
-            free(db);
-            return NULL;
+            rc = mdb_cursor_del(cursor, 0);
+            if (rc != 0)
+                break;
+            ++count;
+        }
+        /* After a deletion, the cursor already points to the next key,
+           which MDB_NEXT returns without moving on */
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_NEXT);
+    }
+    db->lmdb_expire_key_len = 0;
+    if (rc == 0 && k.mv_size <= sizeof(db->lmdb_expire_key))
+    {
+        memcpy(db->lmdb_expire_key, k.mv_data, k.mv_size);
+        db->lmdb_expire_key_len = k.mv_size;
+    }
+    /* A key which cannot be saved ends the scan early */
+    *done = db->lmdb_expire_key_len == 0;
+    mdb_cursor_close(cursor);
+    if (rc != 0 && rc != MDB_NOTFOUND)
+    {
+        mdb_txn_abort(txn);
+        goto fail;
+    }
+    rc = mdb_txn_commit(txn);
+    if (rc != 0)
+        goto fail;
+    *removed += count;
+    return true;
+
+fail:
+    log_warn("lmdb expire error: %s", mdb_strerror(rc));
+    return false;
+}
+
+static bool db_lmdb_expire(database_t* db, unsigned limit, size_t* removed)
+{
+    /* A limited batch continues the scan of the previous batch, a full
+       expiry starts at the first key */
+    bool done = false;
+    bool resume = limit > 0;
+    *removed = 0;
+    while (!done && (limit == 0 || *removed < limit))
+    {
+        if (!db_lmdb_expire_step(db, resume, limit, removed, &done))
+            return false;
+        resume = true;
+    }
+    return true;
+}
+
+static void db_lmdb_disconnect(database_t* db)
+{
+    if (db->lmdb_read_txn != NULL)
+        mdb_txn_abort(db->lmdb_read_txn);
+    if (--lmdb_shared.refs == 0)
+    {
+        mdb_env_close(lmdb_shared.env);
+        free(lmdb_shared.path);
+        lmdb_shared.env = NULL;
+        lmdb_shared.path = NULL;
+    }
+}
+
+static bool db_lmdb_parse_options(const char* options, size_t* map_size,
+                                  unsigned* max_readers, unsigned* flags)
+{
+    /* lmdb:PATH?map-size=256&max-readers=1024&sync=off */
+    char* copy = strdup(options);
+    char* saveptr = NULL;
+    bool success = true;
+    if (copy == NULL)
+        return false;
+    for (char* option = strtok_r(copy, "&", &saveptr); option != NULL;
+         option = strtok_r(NULL, "&", &saveptr))
+    {
+        char* value = strchr(option, '=');
+        char* end;
+        long n;
+        if (value == NULL)
+        {
+            log_error("missing value for lmdb option '%s'", option);
+            success = false;
+            break;
+        }
+        *value++ = 0;
+        if (strcmp(option, "sync") == 0 && strcmp(value, "on") == 0)
+            *flags &= ~(unsigned)MDB_NOSYNC;
+        else if (strcmp(option, "sync") == 0 && strcmp(value, "off") == 0)
+            *flags |= MDB_NOSYNC;
+        else if (strcmp(option, "map-size") == 0)
+        {
+            n = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || n < 1
+                || (unsigned long)n > SIZE_MAX / (1024 * 1024))
+            {
+                log_error("invalid value for lmdb option 'map-size'");
+                success = false;
+                break;
+            }
+            *map_size = (size_t)n * 1024 * 1024;
+        }
+        else if (strcmp(option, "max-readers") == 0)
+        {
+            n = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || n < 1 || n > 65536)
+            {
+                log_error("invalid value for lmdb option 'max-readers'");
+                success = false;
+                break;
+            }
+            *max_readers = (unsigned)n;
+        }
+        else
+        {
+            log_error("invalid lmdb option '%s=%s'", option, value);
+            success = false;
+            break;
+        }
+    }
+    free(copy);
+    return success;
+}
+
+static bool db_lmdb_open(const char* path, bool create_if_not_exist,
+                         size_t map_size, unsigned max_readers,
+                         unsigned flags)
+{
+    MDB_txn* txn;
+    struct stat st;
+    int rc, dead;
+    if (!create_if_not_exist && stat(path, &st) < 0)
+    {
+        log_perror(errno, path);
+        return false;
+    }
+    rc = mdb_env_create(&lmdb_shared.env);
+    if (rc != 0)
+        goto fail;
+    rc = mdb_env_set_mapsize(lmdb_shared.env, map_size);
+    if (rc == 0)
+        rc = mdb_env_set_maxreaders(lmdb_shared.env, max_readers);
+    /* Each connection keeps its read transaction for reuse, which must not
+       be tied to the thread that created it */
+    if (rc == 0)
+        rc = mdb_env_open(lmdb_shared.env, path,
+                          flags | MDB_NOSUBDIR | MDB_NOTLS, 0600);
+    if (rc == 0)
+        rc = mdb_txn_begin(lmdb_shared.env, NULL, 0, &txn);
+    if (rc == 0)
+    {
+        rc = mdb_dbi_open(txn, NULL, 0, &lmdb_shared.dbi);
+        if (rc == 0)
+            rc = mdb_txn_commit(txn);
+        else
+            mdb_txn_abort(txn);
+    }
+    if (rc != 0)
+    {
+        mdb_env_close(lmdb_shared.env);
+        goto fail;
+    }
+    /* Release reader slots of processes which died without closing the
+       environment, or the reader table would eventually fill up */
+    mdb_reader_check(lmdb_shared.env, &dead);
+    return true;
+
+fail:
+    log_error("%s: %s", path, mdb_strerror(rc));
+    lmdb_shared.env = NULL;
+    return false;
+}
+
+static bool db_lmdb_connect(database_t* db, const char* uri,
+                            bool create_if_not_exist)
+{
+    size_t map_size = 256 * 1024 * 1024;
+    unsigned max_readers = 1024;
+    unsigned flags = 0;
+    char* path;
+    const char* options = strchr(uri, '?');
+    if (options != NULL)
+    {
+        if (!db_lmdb_parse_options(options + 1, &map_size, &max_readers,
+                                   &flags))
+            return false;
+        path = strndup(uri, options - uri);
+    }
+    else
+        path = strdup(uri);
+    if (path == NULL)
+        return false;
+    if (lmdb_shared.env != NULL && lmdb_shared.pid != getpid())
+    {
+        /* Inherited from the parent process; the handle is not closed
+           because that would release the parent's locks */
+        lmdb_shared.env = NULL;
+        lmdb_shared.refs = 0;
+        free(lmdb_shared.path);
+        lmdb_shared.path = NULL;
+    }
+    if (lmdb_shared.env == NULL)
+    {
+        if (!db_lmdb_open(path, create_if_not_exist, map_size, max_readers,
+                          flags))
+        {
+            free(path);
+            return false;
         }
-        return db;
+        lmdb_shared.path = path;
+        lmdb_shared.pid = getpid();
     }
+    else
+    {
+        bool same_path = strcmp(lmdb_shared.path, path) == 0;
+        free(path);
+        if (!same_path)
+        {
+            log_error("only one lmdb database can be open at a time");
+            return false;
+        }
+    }
+    ++lmdb_shared.refs;
+    db->handle = lmdb_shared.env;
+    db->legacy_keys = false;
+    db->read = db_lmdb_read;
+    db->write = db_lmdb_write;
+    db->expire = db_lmdb_expire;
+    db->flush = NULL;
+    db->ping = NULL;
+    db->disconnect = db_lmdb_disconnect;
+    db->lmdb_read_txn = NULL;
+    db->lmdb_expire_key_len = 0;
+    return true;
+}
+#endif
+
+#ifdef WITH_MMAP_DATABASE
+/* The mmap: backend is a file with fixed-size slots in an open-addressing
+   hash table. A key may live in any of the MMAP_DB_PROBES slots after its
+   home slot; if all of them are in use, the entry which expires first is
+   replaced. Every slot has a sequence counter which is odd while the slot
+   is being written, so readers can detect and retry torn reads without
+   taking any locks. Writers for the same key are serialized by a striped
+   spinlock in the file header, and lock the slot itself with its sequence
+   counter. Every process holds a shared fcntl() lock on the file while it
+   is connected; if the database is opened with create_if_not_exist and
+   nobody else has it open, spinlocks and write markers left behind by a
+   killed writer are cleared. */
+#    define MMAP_DB_MAGIC      "PSRSDKV1"
+#    define MMAP_DB_HEADER     4096
+#    define MMAP_DB_LOCKS      1024
+#    define MMAP_DB_PROBES     16
+#    define MMAP_DB_KEY_SIZE   40
+#    define MMAP_DB_VALUE_SIZE 520
+#    define MMAP_DB_MAX_SPINS  100000
+
+struct mmap_db_header
+{
+    char magic[8];
+    uint32_t slot_size;
+    uint32_t reserved;
+    uint64_t num_slots;
+    char locks[MMAP_DB_LOCKS];
+};
+
+struct mmap_db_slot
+{
+    uint32_t seq;
+    uint32_t key_len;
+    int64_t expires;
+    char key[MMAP_DB_KEY_SIZE];
+    char value[MMAP_DB_VALUE_SIZE];
+};
+
+static_assert(sizeof(struct mmap_db_header) <= MMAP_DB_HEADER,
+              "mmap database header does not fit");
+
+static struct mmap_db_slot* mmap_db_get_slot(database_t* db, uint64_t i)
+{
+    struct mmap_db_header* header = db->handle;
+    return (struct mmap_db_slot*)((char*)db->handle + MMAP_DB_HEADER)
+           + i % header->num_slots;
+}
+
+static uint64_t mmap_db_hash(const char* key, size_t key_len)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key_len; ++i)
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return h;
+}
+
+static bool mmap_db_key_equal(const struct mmap_db_slot* slot,
+                              const char* key, size_t key_len)
+{
+    return slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0;
+}
+
+static bool mmap_db_lock_slot(struct mmap_db_slot* slot, uint32_t* seq)
+{
+    *seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    return (*seq & 1) == 0
+           && __atomic_compare_exchange_n(&slot->seq, seq, *seq + 1, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void mmap_db_unlock_slot(struct mmap_db_slot* slot, uint32_t seq)
+{
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static bool mmap_db_lock_file(int fd, short type, bool wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) < 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static void mmap_db_recover(const char* path, struct mmap_db_header* header,
+                            void* block)
+{
+    size_t recovered = 0;
+    memset(header->locks, 0, sizeof(header->locks));
+    struct mmap_db_slot* slots =
+        (struct mmap_db_slot*)((char*)block + MMAP_DB_HEADER);
+    for (uint64_t i = 0; i < header->num_slots; ++i)
+    {
+        struct mmap_db_slot* slot = &slots[i];
+        if ((slot->seq & 1) == 0)
+            continue;
+        /* The slot may be torn, so we cannot trust its contents */
+        slot->expires = 0;
+        slot->key_len = 0;
+        memset(slot->key, 0, sizeof(slot->key));
+        memset(slot->value, 0, sizeof(slot->value));
+        ++slot->seq;
+        ++recovered;
+    }
+    if (recovered > 0)
+        log_warn("%s: cleared %zu slots from interrupted writes", path,
+                 recovered);
+}
+
+static char* db_mmap_read(database_t* db, const char* key, size_t key_len)
+{
+    if (key_len == 0 || key_len > MMAP_DB_KEY_SIZE)
+        return NULL;
+    uint64_t h = mmap_db_hash(key, key_len);
+    time_t now = time(NULL);
+    char value[MMAP_DB_VALUE_SIZE];
+    for (unsigned i = 0; i < MMAP_DB_PROBES; ++i)
+    {
+        struct mmap_db_slot* slot = mmap_db_get_slot(db, h + i);
+        for (unsigned spins = 0;; ++spins)
+        {
+            if (spins == MMAP_DB_MAX_SPINS)
+            {
+                log_warn("mmap database slot is locked");
+                metrics_inc(METRIC_DATABASE_READ_ERROR);
+                db->read_failed = true;
+                return NULL;
+            }
+            spin_wait(spins);
+            uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                continue;
+            bool found = mmap_db_key_equal(slot, key, key_len)
+                         && slot->expires > now;
+            if (found)
+                memcpy(value, slot->value, sizeof(value));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            if (found)
+            {
+                value[sizeof(value) - 1] = 0;
+                return NONEMPTY_STRING(value) ? strdup(value) : NULL;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool db_mmap_write(database_t* db, const char* key, size_t key_len,
+                          const char* value, unsigned lifetime)
+{
+    if (key_len == 0 || key_len > MMAP_DB_KEY_SIZE
+        || strlen(value) >= MMAP_DB_VALUE_SIZE)
+    {
+        log_warn("mmap database entry is too large");
+        return false;
+    }
+    struct mmap_db_header* header = db->handle;
+    uint64_t h = mmap_db_hash(key, key_len);
+    char* lock = &header->locks[h % MMAP_DB_LOCKS];
+    time_t now = time(NULL);
+    bool success = false;
+    unsigned spins;
+    for (spins = 0; spins < MMAP_DB_MAX_SPINS; ++spins)
+    {
+        if (!__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+            break;
+        spin_wait(spins);
+    }
+    if (spins == MMAP_DB_MAX_SPINS)
+    {
+        log_warn("mmap database write lock is held too long");
+        return false;
+    }
+    for (spins = 0; spins < MMAP_DB_MAX_SPINS && !success; ++spins)
+    {
+        /* Only writers holding the stripe lock can store this key, so a
+           slot with a matching key cannot appear behind our back */
+        struct mmap_db_slot* target = NULL;
+        for (unsigned i = 0; i < MMAP_DB_PROBES; ++i)
+        {
+            struct mmap_db_slot* slot = mmap_db_get_slot(db, h + i);
+            if (mmap_db_key_equal(slot, key, key_len))
+            {
+                target = slot;
+                break;
+            }
+            if (target == NULL || slot->expires < target->expires)
+                target = slot;
+        }
+        int64_t expires = target->expires;
+        uint32_t old_key_len = target->key_len;
+        char old_key[MMAP_DB_KEY_SIZE];
+        memcpy(old_key, target->key, sizeof(old_key));
+        uint32_t seq;
+        if (!mmap_db_lock_slot(target, &seq))
+        {
+            spin_wait(spins);
+            continue;
+        }
+        if (target->expires != expires || target->key_len != old_key_len
+            || memcmp(target->key, old_key, sizeof(old_key)) != 0)
+        {
+            /* Another writer has claimed the slot in the meantime */
+            mmap_db_unlock_slot(target, seq);
+            continue;
+        }
+        if (expires > now && !mmap_db_key_equal(target, key, key_len))
+        {
+            log_warn("mmap database is full, replacing an unexpired envelope");
+            metrics_inc(METRIC_DATABASE_EVICTED);
+        }
+        target->expires = now + lifetime;
+        target->key_len = key_len;
+        memset(target->key, 0, sizeof(target->key));
+        memcpy(target->key, key, key_len);
+        memcpy(target->value, value, strlen(value) + 1);
+        mmap_db_unlock_slot(target, seq);
+        success = true;
+    }
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+    if (!success)
+        log_warn("mmap database slot is locked");
+    return success;
+}
+
+static bool db_mmap_expire(database_t* db, unsigned limit, size_t* removed)
+{
+    /* Expired slots are reused anyway; clearing them just keeps stale
+       envelopes from lingering in the file */
+    struct mmap_db_header* header = db->handle;
+    time_t now = time(NULL);
+    *removed = 0;
+    for (uint64_t n = 0; n < header->num_slots; ++n)
+    {
+        if (limit > 0 && *removed >= limit)
+            break;
+        struct mmap_db_slot* slot = mmap_db_get_slot(db, db->mmap_expire_pos++);
+        uint32_t seq;
+        if (slot->expires == 0 || slot->expires > now
+            || !mmap_db_lock_slot(slot, &seq))
+            continue;
+        if (slot->expires != 0 && slot->expires <= now)
+        {
+            slot->expires = 0;
+            slot->key_len = 0;
+            memset(slot->key, 0, sizeof(slot->key));
+            memset(slot->value, 0, sizeof(slot->value));
+            ++*removed;
+        }
+        mmap_db_unlock_slot(slot, seq);
+    }
+    return true;
+}
+
+static void db_mmap_disconnect(database_t* db)
+{
+    munmap(db->handle, db->mmap_size);
+    close(db->mmap_fd);
+}
+
+static bool db_mmap_connect(database_t* db, const char* uri,
+                            bool create_if_not_exist)
+{
+    /* mmap:PATH[?slots=N] */
+    uint64_t num_slots = 65536;
+    char* path;
+    const char* options = strchr(uri, '?');
+    if (options != NULL)
+    {
+        char* end;
+        if (strncmp(options, "?slots=", 7) != 0)
+        {
+            log_error("invalid mmap option '%s'", options + 1);
+            return false;
+        }
+        long long n = strtoll(options + 7, &end, 10);
+        if (options[7] == 0 || *end != 0 || n < MMAP_DB_PROBES
+            || n > (1LL << 32))
+        {
+            log_error("invalid value for mmap option 'slots'");
+            return false;
+        }
+        num_slots = (uint64_t)n;
+        path = strndup(uri, options - uri);
+    }
+    else
+        path = strdup(uri);
+    if (path == NULL)
+        return false;
+    bool initialize = false;
+    int fd = -1;
+    if (create_if_not_exist)
+    {
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        initialize = fd >= 0;
+    }
+    if (fd < 0)
+        fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_perror(errno, path);
+        free(path);
+        return false;
+    }
+    size_t size = MMAP_DB_HEADER + num_slots * sizeof(struct mmap_db_slot);
+    struct stat st;
+    if (initialize)
+    {
+        if (ftruncate(fd, size) < 0)
+        {
+            log_perror(errno, path);
+            goto fail;
+        }
+    }
+    else
+    {
+        if (fstat(fd, &st) < 0)
+        {
+            log_perror(errno, path);
+            goto fail;
+        }
+        size = st.st_size;
+    }
+    if (size < MMAP_DB_HEADER)
+    {
+        log_error("%s: not an mmap database", path);
+        goto fail;
+    }
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (block == MAP_FAILED)
+    {
+        log_perror(errno, "mmap");
+        goto fail;
+    }
+    struct mmap_db_header* header = block;
+    if (initialize)
+    {
+        /* The file is zero-filled, so all slots are empty and unlocked */
+        header->slot_size = sizeof(struct mmap_db_slot);
+        header->num_slots = num_slots;
+        memcpy(header->magic, MMAP_DB_MAGIC, sizeof(header->magic));
+    }
+    else if (memcmp(header->magic, MMAP_DB_MAGIC, sizeof(header->magic)) != 0
+             || header->slot_size != sizeof(struct mmap_db_slot)
+             || header->num_slots < MMAP_DB_PROBES
+             || header->num_slots
+                    > (size - MMAP_DB_HEADER) / sizeof(struct mmap_db_slot))
+    {
+        log_error("%s: not an mmap database", path);
+        munmap(block, size);
+        goto fail;
+    }
+    if (create_if_not_exist && mmap_db_lock_file(fd, F_WRLCK, false))
+        mmap_db_recover(path, header, block);
+    /* Replaces the exclusive lock atomically, if we got it */
+    if (!mmap_db_lock_file(fd, F_RDLCK, true))
+    {
+        log_perror(errno, path);
+        munmap(block, size);
+        goto fail;
+    }
+    free(path);
+    db->handle = block;
+    db->legacy_keys = false;
+    db->read = db_mmap_read;
+    db->write = db_mmap_write;
+    db->expire = db_mmap_expire;
+    db->flush = NULL;
+    db->ping = NULL;
+    db->disconnect = db_mmap_disconnect;
+    db->mmap_size = size;
+    db->mmap_expire_pos = 0;
+    db->mmap_fd = fd;
+    return true;
+
+fail:
+    close(fd);
+    if (initialize)
+        unlink(path);
+    free(path);
+    return false;
+}
+#endif
+
+static bool db_connect_backend(database_t* db)
+{
+    const char* uri = db->uri;
+#ifdef WITH_SQLITE
+    if (strncmp(uri, "sqlite:", 7) == 0)
+        return db_sqlite_connect(db, uri + 7, db->create_if_not_exist);
+#endif
+#ifdef WITH_MMAP_DATABASE
+    if (strncmp(uri, "mmap:", 5) == 0)
+        return db_mmap_connect(db, uri + 5, db->create_if_not_exist);
+#endif
+#ifdef WITH_LMDB
+    if (strncmp(uri, "lmdb:", 5) == 0)
+        return db_lmdb_connect(db, uri + 5, db->create_if_not_exist);
 #endif
 #ifdef WITH_REDIS
     if (strncmp(uri, "redis:", 6) == 0)
     {
-        database_t* db = (database_t*)malloc(sizeof(struct database));
-        if (db == NULL)
+        int port;
+        char* hostname = NULL;
+        const char* options = strchr(uri, '?');
+        db->redis_async_writes = false;
+        db->redis_max_pending = 128;
+        if (options != NULL)
         {
-            log_error("failed to allocate database connection handle");
-            return NULL;
+            char* address = strndup(&uri[6], options - &uri[6]);
+            if (address != NULL && db_redis_set_options(db, options + 1))
+                hostname = endpoint_for_redis(address, &port);
+            free(address);
         }
-        int port;
-        char* hostname = endpoint_for_redis(&uri[6], &port);
+        else
+            hostname = endpoint_for_redis(&uri[6], &port);
         if (hostname == NULL)
         {
             log_error("invalid database uri '%s'", uri);
-            free(db);
-            return NULL;
+            return false;
         }
-        if (!db_redis_connect(db, hostname, port))
+        /* The hostname is resolved again on every reconnect, in case the
+           Redis server has moved to a different address */
+        bool success = db_redis_connect(db, hostname, port);
+        if (!success && port > 0 && db->redis_peer[0] != 0)
         {
-            log_error("failed to connect to '%s'", uri);
-            free(hostname);
-            free(db);
-            return NULL;
+            log_info("trying last known redis address %s", db->redis_peer);
+            success = db_redis_connect(db, db->redis_peer, port);
         }
         free(hostname);
-        return db;
+        return success;
     }
 #endif
     log_error("unsupported database '%s'", uri);
-    return NULL;
+    return false;
 }
 
-char* database_read(database_t* db, const char* key)
+static bool db_reconnect(database_t* db)
+{
+    /* Lost connections are reopened, but not more often than the backoff
+       allows, so a database outage does not become a reconnect storm */
+    time_t now = time(NULL);
+    if (now < db->next_reconnect)
+        return false;
+    if (db->connected)
+        db->disconnect(db);
+    db->connected = false;
+    db_confirm_writes(db, SIZE_MAX, false);
+    metrics_inc(METRIC_DATABASE_RECONNECT);
+    if (db_connect_backend(db))
+    {
+        log_info("reconnected to '%s'", db->uri);
+        db->connected = true;
+        db->connection_lost = false;
+        db->reconnect_delay = 0;
+        db->last_used = now;
+        return true;
+    }
+    if (db->reconnect_delay == 0)
+        db->reconnect_delay = 1;
+    else if (db->reconnect_delay < DATABASE_MAX_RECONNECT_DELAY / 2)
+        db->reconnect_delay *= 2;
+    else
+        db->reconnect_delay = DATABASE_MAX_RECONNECT_DELAY;
+    db->next_reconnect = now + db->reconnect_delay;
+    log_warn("failed to reconnect to '%s', retrying in %u seconds", db->uri,
+             db->reconnect_delay);
+    return false;
+}
+
+static bool db_ready(database_t* db)
+{
+    time_t now = time(NULL);
+    if (db->connected && !db->connection_lost && db->ping != NULL
+        && now - db->last_used >= DATABASE_PING_INTERVAL && !db->ping(db))
+        db->connection_lost = true;
+    db->last_used = now;
+    if (db->connected && !db->connection_lost)
+        return true;
+    return db_reconnect(db);
+}
+
+database_t* database_connect(const char* uri, bool create_if_not_exist)
+{
+    if (NULL_OR_EMPTY_STRING(uri))
+    {
+        log_error("not database uri configured");
+        return NULL;
+    }
+    database_t* db = (database_t*)malloc(sizeof(struct database));
+    if (db == NULL)
+    {
+        log_error("failed to allocate database connection handle");
+        return NULL;
+    }
+    db->uri = strdup(uri);
+    db->create_if_not_exist = create_if_not_exist;
+    db->connection_lost = false;
+    db->last_used = time(NULL);
+    db->next_reconnect = 0;
+    db->reconnect_delay = 0;
+    db->read_failed = false;
+    db->write_pending = false;
+#ifdef WITH_ENVELOPE_CACHE
+    db->pending_writes = NULL;
+    db->pending_head = 0;
+    db->pending_count = 0;
+    db->pending_capacity = 0;
+#endif
+#ifdef WITH_REDIS
+    db->redis_peer[0] = 0;
+#endif
+    if (db->uri == NULL || !db_connect_backend(db))
+    {
+        log_error("failed to connect to '%s'", uri);
+        free(db->uri);
+        free(db);
+        return NULL;
+    }
+    /* A reconnect must not try to create the database again */
+    db->create_if_not_exist = false;
+    db->connected = true;
+    return db;
+}
+
+static char* db_read(database_t* db, const char* key, size_t key_len,
+                     const char* legacy_key)
 {
     if (db != NULL && key != NULL)
-        return db->read(db, key);
+    {
+#ifdef WITH_ENVELOPE_CACHE
+        char* value;
+        if (cache_get(key, key_len, &value))
+        {
+            metrics_inc(METRIC_DATABASE_CACHE_HIT);
+            return value;
+        }
+        if (cache != NULL)
+            metrics_inc(METRIC_DATABASE_CACHE_MISS);
+#endif
+        metrics_inc(METRIC_DATABASE_READ);
+        db->read_failed = false;
+        if (!db_ready(db))
+        {
+            metrics_inc(METRIC_DATABASE_READ_ERROR);
+            db->read_failed = true;
+            return NULL;
+        }
+        char* result = db->read(db, key, key_len);
+        /* Reads have no side effects, so they are retried once on a fresh
+           connection */
+        if (result == NULL && db->connection_lost && db_ready(db))
+        {
+            db->read_failed = false;
+            result = db->read(db, key, key_len);
+        }
+        if (result == NULL && legacy_key != NULL && !db->read_failed)
+            result = db->read(db, legacy_key, strlen(legacy_key));
+#ifdef WITH_ENVELOPE_CACHE
+        if (result != NULL)
+            cache_put(key, key_len, result, cache_ttl, false);
+        else if (!db->read_failed)
+            cache_put(key, key_len, NULL, cache_negative_ttl, false);
+#endif
+        return result;
+    }
     return NULL;
 }
 
-bool database_write(database_t* db, const char* key, const char* value,
-                    unsigned lifetime)
+char* database_read(database_t* db, const char* key)
+{
+    if (key == NULL)
+        return NULL;
+    return db_read(db, key, strlen(key), NULL);
+}
+
+char* database_read_alias(database_t* db, const char* alias)
+{
+    char legacy_key[DATABASE_LEGACY_KEY_SIZE];
+    if (db == NULL || alias == NULL)
+        return NULL;
+    if (!db->legacy_keys)
+        return db_read(db, alias, DATABASE_ALIAS_SIZE, NULL);
+    /* Older versions stored the base32hex encoded alias as text */
+    if (b32h_encode(alias, DATABASE_ALIAS_SIZE, legacy_key, sizeof(legacy_key))
+        == NULL)
+        return NULL;
+    strcat(legacy_key, "@1");
+    return db_read(db, alias, DATABASE_ALIAS_SIZE, legacy_key);
+}
+
+static bool db_write(database_t* db, const char* key, size_t key_len,
+                     const char* value, unsigned lifetime)
 {
     if (db != NULL && key != NULL && value != NULL)
-        return db->write(db, key, value, lifetime);
+    {
+#ifdef WITH_ENVELOPE_CACHE
+        /* The same sender is mapped to the same key every time, so there is
+           no need to store it again until the write interval has passed. */
+        if (cache_recently_written(key, key_len, value))
+        {
+            metrics_inc(METRIC_DATABASE_WRITE_COALESCED);
+            return true;
+        }
+#endif
+        metrics_inc(METRIC_DATABASE_WRITE);
+        /* Storing the same envelope again is harmless, so writes are
+           retried once on a fresh connection, too */
+        db->write_pending = false;
+        bool success =
+            db_ready(db) && db->write(db, key, key_len, value, lifetime);
+        if (!success && db->connection_lost && db_ready(db))
+            success = db->write(db, key, key_len, value, lifetime);
+        if (success)
+        {
+#ifdef WITH_ENVELOPE_CACHE
+            unsigned ttl = cache_ttl > cache_write_interval
+                               ? cache_ttl
+                               : cache_write_interval;
+            cache_put(key, key_len, value, lifetime < ttl ? lifetime : ttl,
+                      !db->write_pending);
+            if (db->write_pending)
+                db_queue_write(db, key, key_len);
+#endif
+            return true;
+        }
+        metrics_inc(METRIC_DATABASE_WRITE_ERROR);
+    }
     return false;
 }
 
+bool database_write(database_t* db, const char* key, const char* value,
+                    unsigned lifetime)
+{
+    if (key == NULL)
+        return false;
+    return db_write(db, key, strlen(key), value, lifetime);
+}
+
+bool database_write_alias(database_t* db, const char* alias,
+                          const char* value, unsigned lifetime)
+{
+    return db_write(db, alias, DATABASE_ALIAS_SIZE, value, lifetime);
+}
+
+bool database_flush(database_t* db)
+{
+    if (db != NULL && db->connected && db->flush != NULL)
+        return db->flush(db);
+    return true;
+}
+
 void database_expire(database_t* db)
 {
-    if (db != NULL && db->expire != NULL)
-        db->expire(db);
+    size_t removed;
+    database_expire_batch(db, 0, &removed);
+}
+
+bool database_expire_batch(database_t* db, unsigned limit, size_t* removed)
+{
+    *removed = 0;
+    if (db == NULL)
+        return false;
+    if (db->expire == NULL)
+        return true;
+    if (!db_ready(db) || !db->expire(db, limit, removed))
+        return false;
+    metrics_add(METRIC_DATABASE_EXPIRED, *removed);
+    return true;
 }
 
 void database_disconnect(database_t* db)
 {
     if (db != NULL)
-        db->disconnect(db);
+    {
+        if (db->connected)
+            db->disconnect(db);
+        free(db->uri);
+#ifdef WITH_ENVELOPE_CACHE
+        free(db->pending_writes);
+#endif
+    }
     free(db);
 }
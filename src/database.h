@@ -18,15 +18,28 @@
 #define DATABASE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct database;
 typedef struct database database_t;
 
+/* Envelope senders are stored under the SHA-1 digest of their address */
+#define DATABASE_ALIAS_SIZE 20
+
 database_t* database_connect(const char* uri, bool create_if_not_exist);
 char* database_read(database_t* db, const char* key);
+char* database_read_alias(database_t* db, const char* alias);
 bool database_write(database_t* db, const char* key, const char* value,
                     unsigned lifetime);
+bool database_write_alias(database_t* db, const char* alias,
+                          const char* value, unsigned lifetime);
+bool database_flush(database_t* db);
 void database_expire(database_t* db);
+bool database_expire_batch(database_t* db, unsigned limit, size_t* removed);
 void database_disconnect(database_t* db);
 
+bool database_cache_init(size_t entries, unsigned ttl, unsigned negative_ttl,
+                         unsigned write_interval);
+void database_cache_shutdown();
+
 #endif
@@ -17,9 +17,12 @@
 #include "main.h"
 
 #include "database.h"
+#include "metrics.h"
 #include "milter.h"
 #include "netstring.h"
 #include "postsrsd_build_config.h"
+#include "sha1.h"
+#include "socketmap.h"
 #include "srs.h"
 
 #include <errno.h>
@@ -30,23 +33,116 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+#    include <pthread.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
 
-#define PAYLOAD_SIZE MILTER_PAYLOAD_SIZE
+#define PAYLOAD_SIZE             MILTER_PAYLOAD_SIZE
+#define SOCKETMAP_PIPELINE_DEPTH 16
 
 #define FD_UNUSED    0
 #define FD_SOCKETMAP 1
 #define FD_MILTER    2
 #define FD_WATCH     3
+#define FD_METRICS   4
+#define FD_CONTROL   5
+#define FD_RELOAD    6
+
+#define WORKER_PER_CONNECTION 0
+#define WORKER_POOL           1
+#define WORKER_EVENTS         2
+#define WORKER_THREADS        3
+
+/* Expired envelopes are deleted in small batches with a short pause in
+   between, so the workers are never locked out of the database for long */
+#define EXPIRE_BATCH_SIZE     1000
+#define EXPIRE_BATCH_PAUSE_MS 10
+
+/* After a reload, old workers keep serving their open connections with the
+   configuration they were started with, so the clients are not forced to
+   reconnect all at once. A draining connection is closed once it has been
+   idle for this many seconds */
+#define RELOAD_IDLE_TIMEOUT   1
+
+/* The unprivileged check of a reloaded configuration runs in the
+   background, but a check process which hangs, e.g. on an unreachable
+   database, is killed after this many seconds */
+#define CHECK_TIMEOUT 10
+
+/* Control commands are handled by the main loop, too, so a client cannot
+   hold on to it for longer than this */
+#define CONTROL_TIMEOUT_MS 2000
+
+/* Long-lived workers which fail, e.g. because the database is unreachable,
+   are restarted after 1, 2, 4, ... seconds, so a broken setup does not
+   turn into a fork loop */
+#define WORKER_MAX_RESTART_DELAY 60
 
+/* In worker thread mode, signals are only handled by the main thread of
+   the worker process, and SIGALRM is not used at all. */
 static volatile sig_atomic_t timeout = 0;
 static volatile sig_atomic_t reload_requested = 0, shutdown_requested = 0;
 static bool files_changed = false, files_changed_unsafe = false;
 static time_t last_file_watch_event = 0;
 static bool sd_notify_support = false;
 static sandbox_t* sandbox = NULL;
+static pid_t main_pid = 0;
+static pid_t expire_worker = 0;
+static time_t next_expire = 0;
+static pid_set_t* pool_workers = NULL;
+static pid_set_t* event_workers = NULL;
+static pid_set_t* thread_workers = NULL;
+static unsigned worker_restart_delay = 0;
+static time_t next_worker_restart = 0;
+static bool use_socket_timeouts = false;
+
+/* A reload prepares the new state in a helper thread, so the main loop can
+   keep accepting connections while the configuration and the domains file
+   are loaded. The helper writes a byte to the reload pipe when it is done,
+   and the main loop forks the unprivileged check of the new state. Once
+   the check process has exited successfully, the main loop commits the new
+   state. A process forked
+   while the helper holds a lock (stdio, NSS, ...) would deadlock, so the
+   main loop does not fork until the helper is gone; per-connection clients
+   wait in the listen backlog, and long-lived workers keep accepting. */
+struct reload_job
+{
+    int argc;
+    char** argv;
+    postsrsd_t state;
+    bool success;
+    bool running;
+    pid_t check_pid;
+    time_t check_deadline;
+    bool check_done;
+    bool check_passed;
+    struct timespec started;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+static struct reload_job reload_job;
+static int reload_pipe[2] = {-1, -1};
+
+static void close_reload_pipe()
+{
+    /* Forked processes have no use for the reload pipe of the main loop */
+    for (int i = 0; i < 2; ++i)
+    {
+        if (reload_pipe[i] >= 0)
+            close(reload_pipe[i]);
+        reload_pipe[i] = -1;
+    }
+}
 
 void init_state(postsrsd_t* state)
 {
@@ -54,12 +150,17 @@ void init_state(postsrsd_t* state)
     state->srs = NULL;
     state->socketmap = NULL;
     state->milter = NULL;
+    state->metrics = NULL;
+    state->control = NULL;
     state->srs_domain = NULL;
     state->local_domains = NULL;
     state->file_watch = NULL;
     state->target_uid = 0;
     state->target_gid = 0;
     state->connection_limit = 0;
+    state->worker_pool = 0;
+    state->worker_threads = 0;
+    state->socketmap_engine = SOCKETMAP_ENGINE_PROCESS;
 }
 
 void finalize_state(postsrsd_t* state)
@@ -79,6 +180,16 @@ void finalize_state(postsrsd_t* state)
         endpoint_destroy(state->milter);
         state->milter = NULL;
     }
+    if (state->metrics != NULL)
+    {
+        endpoint_destroy(state->metrics);
+        state->metrics = NULL;
+    }
+    if (state->control != NULL)
+    {
+        endpoint_destroy(state->control);
+        state->control = NULL;
+    }
     string_set(&state->srs_domain, NULL);
     if (state->local_domains != NULL)
     {
@@ -142,17 +253,17 @@ static bool drop_privileges(postsrsd_t* state)
     return true;
 }
 
-static bool check_unprivileged_work(postsrsd_t* state)
+static pid_t fork_unprivileged_check(postsrsd_t* state)
 {
-    int status;
     pid_t worker_pid = fork();
     if (worker_pid < 0)
     {
         log_perror(errno, "fork");
-        return false;
+        return -1;
     }
     if (worker_pid == 0)
     {
+        close_reload_pipe();
         if (!drop_privileges(state))
             exit(EXIT_FAILURE);
         if (cfg_getint(state->cfg, "original-envelope")
@@ -167,19 +278,18 @@ static bool check_unprivileged_work(postsrsd_t* state)
             {
                 log_fatal("failed to enable sandboxing for worker processes");
             }
-            database_expire(db);
+            /* The remaining entries are left to the expire worker */
+            size_t removed;
+            database_expire_batch(db, EXPIRE_BATCH_SIZE, &removed);
             database_disconnect(db);
         }
         exit(EXIT_SUCCESS);
     }
-retry:
-    if (waitpid(worker_pid, &status, 0) < 0)
-    {
-        if (errno == EINTR)
-            goto retry;
-        log_perror(errno, "waitpid");
-        return false;
-    }
+    return worker_pid;
+}
+
+static bool unprivileged_check_passed(int status)
+{
     if (WIFEXITED(status))
     {
         return (WEXITSTATUS(status) == EXIT_SUCCESS);
@@ -192,6 +302,23 @@ retry:
     return false;
 }
 
+static bool check_unprivileged_work(postsrsd_t* state)
+{
+    int status;
+    pid_t worker_pid = fork_unprivileged_check(state);
+    if (worker_pid < 0)
+        return false;
+retry:
+    if (waitpid(worker_pid, &status, 0) < 0)
+    {
+        if (errno == EINTR)
+            goto retry;
+        log_perror(errno, "waitpid");
+        return false;
+    }
+    return unprivileged_check_passed(status);
+}
+
 static bool daemonize(postsrsd_t* state)
 {
     if (!cfg_getbool(state->cfg, "daemonize"))
@@ -214,7 +341,7 @@ static void on_timeout(int signum)
 
 static void on_reload_requested(int signum)
 {
-    reload_requested = signum;
+    ATOMIC_STORE(reload_requested, signum);
 }
 
 static void on_shutdown_requested(int signum)
@@ -222,13 +349,70 @@ static void on_shutdown_requested(int signum)
     shutdown_requested = signum;
 }
 
-static bool prepare_client(postsrsd_t* state, int conn, database_t** db)
+static void on_child_exited(int signum)
+{
+    /* The handler only exists to interrupt poll() in the main loop, so
+       that terminated pool workers are replaced without delay. */
+    MAYBE_UNUSED(signum);
+}
+
+static void start_timeout(int seconds)
+{
+    if (use_socket_timeouts)
+        return;
+    timeout = 0;
+    alarm(seconds);
+}
+
+static void stop_timeout()
+{
+    if (!use_socket_timeouts)
+        alarm(0);
+}
+
+static int idle_timeout(time_t* drain_deadline, int keep_alive)
+{
+    /* Returns how long a connection may be idle before it is closed, or -1
+       if a draining connection has reached its deadline and must be closed
+       at the current request boundary. */
+    if (!ATOMIC_LOAD(reload_requested))
+        return keep_alive;
+    time_t now = time(NULL);
+    if (*drain_deadline == 0)
+        *drain_deadline = now + keep_alive;
+    else if (keep_alive > 0 && now >= *drain_deadline)
+        return -1;
+    return RELOAD_IDLE_TIMEOUT;
+}
+
+static bool wait_for_request(int conn, int keep_alive, time_t* drain_deadline)
+{
+    /* The idle time is counted in short poll() steps, so a worker notices
+       a reload while it waits for the next request, even in thread mode,
+       where SIGHUP does not interrupt the wait. Returns false if the
+       connection has been idle for too long. */
+    int idle = 0;
+    for (;;)
+    {
+        int limit = idle_timeout(drain_deadline, keep_alive);
+        if (limit < 0 || (limit > 0 && idle >= limit))
+            return false;
+        struct pollfd pfd;
+        pfd.fd = conn;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, RELOAD_IDLE_TIMEOUT * 1000);
+        if (ready > 0)
+            return true;
+        if (ready < 0 && errno != EINTR)
+            return false;
+        if (ready == 0)
+            ++idle;
+    }
+}
+
+static bool prepare_connection(int conn)
 {
-    if (state == NULL || db == NULL)
-        return false;
-    *db = NULL;
-    if (!drop_privileges(state))
-        return false;
     int flags = fcntl(conn, F_GETFL);
     if (flags & O_NONBLOCK)
     {
@@ -238,144 +422,187 @@ static bool prepare_client(postsrsd_t* state, int conn, database_t** db)
             return false;
         }
     }
+    return true;
+}
+
+static bool prepare_worker(postsrsd_t* state, database_t** db,
+                           size_t num_db, int worker_type)
+{
+    if (state == NULL || db == NULL)
+        return false;
+    for (size_t i = 0; i < num_db; ++i)
+        db[i] = NULL;
+    close_reload_pipe();
+    if (!drop_privileges(state))
+        return false;
     if (cfg_getint(state->cfg, "original-envelope") == SRS_ENVELOPE_DATABASE)
     {
-        *db = database_connect(cfg_getstr(state->cfg, "envelope-database"),
-                               false);
-        if (*db == NULL)
-            return false;
+        /* Database handles cannot be shared between threads, so every
+           worker thread gets its own connection */
+        for (size_t i = 0; i < num_db; ++i)
+        {
+            db[i] = database_connect(
+                cfg_getstr(state->cfg, "envelope-database"), false);
+            if (db[i] == NULL)
+                goto fail;
+        }
     }
     signal_set_handler(SIGALRM, on_timeout);
+    /* A reload must not interrupt a request in progress */
+    signal_set_handler_restart(SIGHUP, on_reload_requested);
     signal_reset_handler(SIGTERM);
     signal_reset_handler(SIGINT);
-    if (cfg_getbool(state->cfg, "seccomp") && sandbox != NULL
-        && !sandbox_enable(sandbox))
+    signal_reset_handler(SIGCHLD);
+    if (cfg_getbool(state->cfg, "seccomp") && sandbox != NULL)
     {
-        log_error("failed to activate seccomp sandboxing");
-        return false;
+        if (worker_type != WORKER_PER_CONNECTION
+            && !sandbox_allow_accept(sandbox))
+        {
+            log_error("failed to extend seccomp sandbox for workers");
+            goto fail;
+        }
+        if (worker_type == WORKER_EVENTS && !sandbox_allow_epoll(sandbox))
+        {
+            log_error("failed to extend seccomp sandbox for event handling");
+            goto fail;
+        }
+        if (worker_type == WORKER_THREADS && !sandbox_allow_threads(sandbox))
+        {
+            log_error("failed to extend seccomp sandbox for worker threads");
+            goto fail;
+        }
+        if (!sandbox_enable(sandbox))
+        {
+            log_error("failed to activate seccomp sandboxing");
+            goto fail;
+        }
     }
     return true;
+fail:
+    for (size_t i = 0; i < num_db; ++i)
+    {
+        database_disconnect(db[i]);
+        db[i] = NULL;
+    }
+    return false;
 }
 
-void handle_socketmap_client(postsrsd_t* state, int conn)
+static void serve_socketmap_client(postsrsd_t* state, int conn, database_t* db)
 {
-    database_t* db;
-    if (!prepare_client(state, conn, &db))
-        exit(EXIT_FAILURE);
-    const bool always_rewrite = cfg_getbool(state->cfg, "always-rewrite");
+    /* Requests are read in bulk, and the responses to all complete requests
+       in the buffer are sent back with a single writev(), so a client can
+       pipeline its queries without paying a syscall per byte or response. */
     const int keep_alive = cfg_getint(state->cfg, "keep-alive");
-    for (;;)
+    char responses[SOCKETMAP_PIPELINE_DEPTH]
+                  [NETSTRING_HEADER_SIZE + SOCKETMAP_REQUEST_SIZE + 1];
+    struct iovec iov[SOCKETMAP_PIPELINE_DEPTH];
+    bool needs_commit[SOCKETMAP_PIPELINE_DEPTH];
+    netstring_reader_t reader;
+    bool close_connection = false;
+    time_t drain_deadline = 0;
+    netstring_reader_init(&reader);
+    while (!close_connection)
     {
-        char buffer[1024];
+        size_t num_responses = 0;
         size_t len;
-        char* addr;
-        bool error;
-        char* eob;
-        if (reload_requested)
-            break;
-        timeout = 0;
-        alarm(keep_alive);
-        char* request = netstring_read(conn, buffer, sizeof(buffer), &len);
-        if (timeout)
-            break;
-        if (request == NULL)
+        while (num_responses < SOCKETMAP_PIPELINE_DEPTH && !close_connection)
         {
-            if (len != 0)
+            char* request =
+                netstring_reader_next(&reader, SOCKETMAP_REQUEST_SIZE, &len);
+            char* response = responses[num_responses] + NETSTRING_HEADER_SIZE;
+            needs_commit[num_responses] = false;
+            if (request == NULL)
             {
-                netstring_write(conn, "PERM Invalid query.", 19);
+                if (len == 0)
+                    break;
                 log_error("invalid socketmap query, closing connection");
+                memcpy(response, "PERM Invalid query.", 19);
+                len = 19;
+                close_connection = true;
             }
-            break;
-        }
-        alarm(0);
-        char* query_type = strtok_r(request, " ", &addr);
-        if (query_type == NULL)
-        {
-            netstring_write(conn, "PERM Invalid query.", 19);
-            log_error("invalid socketmap query, closing connection");
-            break;
-        }
-        if (len > PAYLOAD_SIZE + (size_t)(addr - request))
-        {
-            netstring_write(conn, "PERM Too big.", 13);
-            log_warn("socketmap query is too big");
-            continue;
-        }
-        char* rewritten = NULL;
-        const char* info = NULL;
-        if (strcmp(query_type, "forward") == 0)
-        {
-            rewritten =
-                postsrsd_forward(addr, state->srs_domain, state->srs, db,
-                                 always_rewrite ? NULL : state->local_domains,
-                                 &error, &info, "socketmap");
-        }
-        else if (strcmp(query_type, "reverse") == 0)
-        {
-            rewritten = postsrsd_reverse(addr, state->srs, db, &error, &info,
-                                         "socketmap");
-        }
-        else
-        {
-            error = true;
-            info = "Invalid map.";
-            log_warn("invalid key in socketmap query");
-        }
-        if (rewritten)
-        {
-            eob = stpncpy(stpcpy(buffer, "OK "), rewritten, sizeof(buffer) - 4);
-            free(rewritten);
-            netstring_write(conn, buffer, eob - buffer);
-        }
-        else
-        {
-            if (error)
+            else
             {
-                eob = stpcpy(buffer, "PERM ");
+                len = socketmap_process_request(state, db, request, len,
+                                                response,
+                                                SOCKETMAP_REQUEST_SIZE,
+                                                &close_connection,
+                                                &needs_commit[num_responses]);
             }
-            else
+            iov[num_responses].iov_base =
+                netstring_frame(response, len, &iov[num_responses].iov_len);
+            ++num_responses;
+        }
+        if (num_responses > 0)
+        {
+            /* Batched envelope writes must be committed before the client
+               sees the rewritten addresses */
+            if (!database_flush(db))
             {
-                eob = stpcpy(buffer, "NOTFOUND ");
+                for (size_t i = 0; i < num_responses; ++i)
+                {
+                    if (!needs_commit[i])
+                        continue;
+                    char* response = responses[i] + NETSTRING_HEADER_SIZE;
+                    memcpy(response, SOCKETMAP_TEMP_FAILURE,
+                           sizeof(SOCKETMAP_TEMP_FAILURE) - 1);
+                    iov[i].iov_base = netstring_frame(
+                        response, sizeof(SOCKETMAP_TEMP_FAILURE) - 1,
+                        &iov[i].iov_len);
+                }
             }
-            if (info)
-                eob = stpncpy(eob, info, sizeof(buffer) - 9);
-            netstring_write(conn, buffer, eob - buffer);
+            if (!writev_all(conn, iov, num_responses))
+                break;
+            continue;
         }
+        if (!wait_for_request(conn, keep_alive, &drain_deadline))
+            break;
+        if (netstring_reader_fill(&reader, conn) <= 0)
+            break;
     }
+}
+
+void handle_socketmap_client(postsrsd_t* state, int conn)
+{
+    database_t* db;
+    if (!prepare_connection(conn)
+        || !prepare_worker(state, &db, 1, WORKER_PER_CONNECTION))
+        exit(EXIT_FAILURE);
+    serve_socketmap_client(state, conn, db);
     database_disconnect(db);
 }
 
-void handle_milter_client(postsrsd_t* state, int conn)
+static void serve_milter_client(postsrsd_t* state, int conn, database_t* db)
 {
 #define MILTER_AWAIT_OPTNEG      0
 #define MILTER_AWAIT_MAIL        1
 #define MILTER_AWAIT_RCPT        2
 #define MILTER_AWAIT_RCPT_OR_EOM 3
-    database_t* db;
     char buffer[PAYLOAD_SIZE];
+    char reversed[PAYLOAD_SIZE + 1];
     size_t len, truncated;
-    if (!prepare_client(state, conn, &db))
-        exit(EXIT_FAILURE);
-    if (reload_requested)
-        return;
     const bool always_rewrite = cfg_getbool(state->cfg, "always-rewrite");
     const bool rewrite_local = cfg_getbool(state->cfg, "milter-rewrite-local");
     const size_t milter_recipient_limit =
         cfg_getint(state->cfg, "milter-recipient-limit");
     const int keep_alive = cfg_getint(state->cfg, "keep-alive");
     int milter_state = MILTER_AWAIT_OPTNEG;
+    time_t drain_deadline = 0;
     char* queue_id = NULL;
     string_set(&queue_id, strdup("NOQUEUE"));
     list_t* sender = list_create();
     list_t* recipients = list_create();
     for (;;)
     {
-        timeout = 0;
-        alarm(keep_alive);
+        /* A draining connection is only closed between mail transactions */
+        if ((milter_state == MILTER_AWAIT_OPTNEG
+             || milter_state == MILTER_AWAIT_MAIL)
+            && !wait_for_request(conn, keep_alive, &drain_deadline))
+            break;
+        start_timeout(keep_alive);
         len = milter_receive(conn, buffer, sizeof(buffer), &truncated);
         if (len == 0 || timeout)
             break;
-        alarm(0);
+        stop_timeout();
         char action = buffer[0];
         char* addr = NULL;
         const char* info = NULL;
@@ -515,8 +742,9 @@ void handle_milter_client(postsrsd_t* state, int conn)
                             goto done;
                         goto cleanup;
                     }
-                    char* rewritten = postsrsd_reverse(addr, state->srs, db,
-                                                       &error, &info, queue_id);
+                    char* rewritten = postsrsd_reverse_into(
+                        reversed, sizeof(reversed), addr, state->srs, db,
+                        &error, &info, queue_id);
                     if (rewritten)
                     {
                         if (!milter_send_str(conn, MILTER_DO_DELRCPT, old_rcpt))
@@ -529,7 +757,6 @@ void handle_milter_client(postsrsd_t* state, int conn)
                             && !domain_set_contains(state->local_domains,
                                                     domain + 1))
                             is_local = false;
-                        free(rewritten);
                     }
                     else if (error)
                     {
@@ -565,6 +792,14 @@ void handle_milter_client(postsrsd_t* state, int conn)
                         list_get(sender, 0), state->srs_domain, state->srs, db,
                         always_rewrite ? NULL : state->local_domains, &error,
                         &info, queue_id);
+                    if (rewritten && !database_flush(db))
+                    {
+                        log_error("%s: failed to store envelope", queue_id);
+                        free(rewritten);
+                        if (!milter_tempfail(conn))
+                            goto done;
+                        goto cleanup;
+                    }
                     if (rewritten)
                     {
                         list_replace_at(sender, 0, rewritten, free);
@@ -597,8 +832,6 @@ cleanup:
                 string_set(&queue_id, strdup("NOQUEUE"));
                 if (milter_state != MILTER_AWAIT_OPTNEG)
                     milter_state = MILTER_AWAIT_MAIL;
-                if (reload_requested)
-                    goto done;
                 break;
             default:
                 log_warn("%s: MTA sent unexpected milter command", queue_id);
@@ -611,9 +844,18 @@ cleanup:
         }
     }
 done:
-    list_clear(sender, free);
-    list_clear(recipients, free);
+    list_destroy(sender, free);
+    list_destroy(recipients, free);
     string_set(&queue_id, NULL);
+}
+
+void handle_milter_client(postsrsd_t* state, int conn)
+{
+    database_t* db;
+    if (!prepare_connection(conn)
+        || !prepare_worker(state, &db, 1, WORKER_PER_CONNECTION))
+        exit(EXIT_FAILURE);
+    serve_milter_client(state, conn, db);
     database_disconnect(db);
 }
 
@@ -650,44 +892,69 @@ static bool config_changed_str(cfg_t* old_cfg, cfg_t* new_cfg, const char* name)
     return true;
 }
 
-static bool setup_state(int argc, char** argv, postsrsd_t* state)
+static bool prepare_state(int argc, char** argv, postsrsd_t* new_state)
 {
-    postsrsd_t new_state;
-    bool socketmap_rollback = false;
-    bool milter_rollback = false;
-    init_state(&new_state);
-    new_state.cfg = config_from_commandline(argc, argv);
-    if (new_state.cfg == NULL)
+    /* Everything in here must be safe to run in the background while the
+       main loop keeps serving with the current state */
+    init_state(new_state);
+    new_state->cfg = config_from_commandline(argc, argv);
+    if (new_state->cfg == NULL)
         goto fail;
-    if (cfg_getbool(new_state.cfg, "syslog"))
-        log_enable_syslog();
-    else
-        log_disable_syslog();
-    log_set_verbosity(cfg_getbool(new_state.cfg, "debug") ? LogDebug : LogInfo);
-    new_state.srs = srs_from_config(new_state.cfg);
-    if (new_state.srs == NULL)
+    new_state->srs = srs_from_config(new_state->cfg);
+    if (new_state->srs == NULL)
         goto fail;
-    const char* domains_file = cfg_getstr(new_state.cfg, "domains-file");
-    if (cfg_getbool(new_state.cfg, "domains-file-watch")
+    const char* domains_file = cfg_getstr(new_state->cfg, "domains-file");
+    if (cfg_getbool(new_state->cfg, "domains-file-watch")
         && NONEMPTY_STRING(domains_file))
     {
-        new_state.file_watch = file_watch_create();
-        if (new_state.file_watch == NULL)
+        new_state->file_watch = file_watch_create();
+        if (new_state->file_watch == NULL)
         {
             log_error("failed to setup inotify watch");
             goto fail;
         }
-        file_watch_if_modified(new_state.file_watch, domains_file,
+        file_watch_if_modified(new_state->file_watch, domains_file,
                                on_file_watch_event);
     }
-    if (!srs_domains_from_config(new_state.cfg, &new_state.srs_domain,
-                                 &new_state.local_domains))
+    if (!srs_domains_from_config(new_state->cfg, &new_state->srs_domain,
+                                 &new_state->local_domains))
         goto fail;
-    if (!unprivileged_user_from_config(new_state.cfg, &new_state.target_uid,
-                                       &new_state.target_gid))
+    /* Local domains can be changed at runtime if they are watched or if
+       there is a control socket; otherwise, there is no need for the
+       shared update table */
+    if ((new_state->file_watch != NULL
+         || NONEMPTY_STRING(cfg_getstr(new_state->cfg, "control-socket")))
+        && !domain_set_share_updates(new_state->local_domains))
+        log_warn("local domain changes require a full reload");
+    if (!unprivileged_user_from_config(new_state->cfg, &new_state->target_uid,
+                                       &new_state->target_gid))
         goto fail;
-    if (!check_unprivileged_work(&new_state))
+#ifndef HAVE_PTHREAD
+    if (cfg_getint(new_state->cfg, "worker-threads") > 0)
+    {
+        log_error("worker threads are not supported on this system");
         goto fail;
+    }
+#endif
+    return true;
+fail:
+    finalize_state(new_state);
+    return false;
+}
+
+static bool commit_state(postsrsd_t* state, postsrsd_t* prepared)
+{
+    postsrsd_t new_state = *prepared;
+    bool socketmap_rollback = false;
+    bool milter_rollback = false;
+    bool metrics_rollback = false;
+    bool control_rollback = false;
+    init_state(prepared);
+    if (cfg_getbool(new_state.cfg, "syslog"))
+        log_enable_syslog();
+    else
+        log_disable_syslog();
+    log_set_verbosity(cfg_getbool(new_state.cfg, "debug") ? LogDebug : LogInfo);
     if (config_changed_str(state->cfg, new_state.cfg, "socketmap"))
     {
         const char* value = cfg_getstr(new_state.cfg, "socketmap");
@@ -724,9 +991,82 @@ static bool setup_state(int argc, char** argv, postsrsd_t* state)
         state->milter = NULL;
         milter_rollback = true;
     }
+    if (config_changed_str(state->cfg, new_state.cfg, "metrics"))
+    {
+        const char* value = cfg_getstr(new_state.cfg, "metrics");
+        if (NONEMPTY_STRING(value))
+        {
+            new_state.metrics = endpoint_create(value);
+            if (new_state.metrics == NULL)
+                goto fail;
+        }
+    }
+    else
+    {
+        new_state.metrics = state->metrics;
+        state->metrics = NULL;
+        metrics_rollback = true;
+    }
+    if (config_changed_str(state->cfg, new_state.cfg, "control-socket"))
+    {
+        const char* value = cfg_getstr(new_state.cfg, "control-socket");
+        if (NONEMPTY_STRING(value))
+        {
+            /* The control socket changes the local domains, so only root
+               may connect to it */
+            if (strncmp(value, "unix:", 5) != 0)
+            {
+                log_error("control socket must be a unix socket");
+                goto fail;
+            }
+            new_state.control = endpoint_create(value);
+            if (new_state.control == NULL)
+                goto fail;
+            if (chmod(value + 5, 0600) < 0)
+            {
+                log_perror(errno, value + 5);
+                goto fail;
+            }
+        }
+    }
+    else
+    {
+        new_state.control = state->control;
+        state->control = NULL;
+        control_rollback = true;
+    }
     /* If we reached this point, the new configuration is valid, so we commit */
     finalize_state(state);
     new_state.connection_limit = cfg_getint(new_state.cfg, "connection-limit");
+    new_state.worker_pool = cfg_getint(new_state.cfg, "worker-pool");
+    new_state.worker_threads = cfg_getint(new_state.cfg, "worker-threads");
+    new_state.socketmap_engine = cfg_getint(new_state.cfg, "socketmap-engine");
+    if (new_state.worker_pool > new_state.connection_limit)
+    {
+        log_warn("worker pool size exceeds the connection limit, using %zu "
+                 "workers",
+                 new_state.connection_limit);
+        new_state.worker_pool = new_state.connection_limit;
+    }
+    if (new_state.worker_threads > new_state.connection_limit)
+    {
+        log_warn("number of worker threads exceeds the connection limit, "
+                 "using %zu threads",
+                 new_state.connection_limit);
+        new_state.worker_threads = new_state.connection_limit;
+    }
+    if (new_state.worker_threads > 0 && new_state.worker_pool > 0)
+        log_warn("worker-pool is ignored if worker-threads is set");
+    /* The cache must be mapped before the workers are forked. If it cannot
+       be mapped, we carry on without it. */
+    size_t cache_size = 0;
+    if (cfg_getint(new_state.cfg, "original-envelope")
+        == SRS_ENVELOPE_DATABASE)
+        cache_size = cfg_getint(new_state.cfg, "envelope-cache-size");
+    database_cache_init(
+        cache_size, cfg_getint(new_state.cfg, "envelope-cache-ttl"),
+        cfg_getint(new_state.cfg, "envelope-cache-negative-ttl"),
+        cfg_getint(new_state.cfg, "envelope-write-interval"));
     *state = new_state;
     return true;
 fail:
@@ -747,23 +1087,243 @@ fail:
         state->milter = new_state.milter;
         new_state.milter = NULL;
     }
+    if (metrics_rollback)
+    {
+        state->metrics = new_state.metrics;
+        new_state.metrics = NULL;
+    }
+    if (control_rollback)
+    {
+        state->control = new_state.control;
+        new_state.control = NULL;
+    }
     finalize_state(&new_state);
     return false;
 }
 
+static bool setup_state(int argc, char** argv, postsrsd_t* state)
+{
+    postsrsd_t new_state;
+    if (!prepare_state(argc, argv, &new_state))
+        return false;
+    if (!check_unprivileged_work(&new_state))
+    {
+        finalize_state(&new_state);
+        return false;
+    }
+    return commit_state(state, &new_state);
+}
+
+static void* run_reload_job(void* arg)
+{
+    struct reload_job* J = (struct reload_job*)arg;
+    char done = 1;
+    J->success = prepare_state(J->argc, J->argv, &J->state);
+    if (write(reload_pipe[1], &done, 1) < 0)
+        log_perror(errno, "write");
+    return NULL;
+}
+
+static void start_reload_job(int argc, char** argv)
+{
+    reload_job.argc = argc;
+    reload_job.argv = argv;
+    reload_job.running = true;
+    clock_gettime(CLOCK_MONOTONIC, &reload_job.started);
+#ifdef HAVE_PTHREAD
+    /* Signals must keep interrupting the poll() in the main loop */
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    int err =
+        pthread_create(&reload_job.thread, NULL, run_reload_job, &reload_job);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (err == 0)
+        return;
+    log_perror(err, "pthread_create");
+#endif
+    run_reload_job(&reload_job);
+    reload_job.running = false;
+}
+
+static void wait_reload_job()
+{
+    char done;
+    if (read(reload_pipe[0], &done, 1) < 0)
+        log_perror(errno, "read");
+#ifdef HAVE_PTHREAD
+    if (reload_job.running)
+        pthread_join(reload_job.thread, NULL);
+#endif
+    reload_job.running = false;
+}
+
+static bool start_reload_check()
+{
+    /* Forking is only safe once the helper thread is gone */
+    reload_job.check_done = false;
+    reload_job.check_passed = false;
+    reload_job.check_pid = fork_unprivileged_check(&reload_job.state);
+    if (reload_job.check_pid < 0)
+    {
+        reload_job.check_pid = 0;
+        return false;
+    }
+    reload_job.check_deadline = time(NULL) + CHECK_TIMEOUT;
+    return true;
+}
+
+static void expire_reload_check()
+{
+    if (reload_job.check_pid <= 0 || reload_job.check_done
+        || reload_job.check_deadline == 0
+        || time(NULL) < reload_job.check_deadline)
+        return;
+    log_error("Worker process did not finish in time");
+    kill(reload_job.check_pid, SIGKILL);
+    /* The process is reaped like any other child */
+    reload_job.check_deadline = 0;
+}
+
+static bool reload_in_progress()
+{
+    return reload_job.running || reload_job.check_pid > 0;
+}
+
+static bool finish_reload_job(postsrsd_t* state)
+{
+    struct timespec now;
+    if (reload_job.success && !reload_job.check_passed)
+    {
+        finalize_state(&reload_job.state);
+        reload_job.success = false;
+    }
+    bool success =
+        reload_job.success && commit_state(state, &reload_job.state);
+    reload_job.success = false;
+    reload_job.check_pid = 0;
+    reload_job.check_done = false;
+    reload_job.check_passed = false;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_us =
+        (uint64_t)(now.tv_sec - reload_job.started.tv_sec) * 1000000
+        + (now.tv_nsec - reload_job.started.tv_nsec) / 1000;
+    metrics_set(METRIC_RELOAD_DURATION, elapsed_us);
+    metrics_inc(success ? METRIC_RELOAD_SUCCESS : METRIC_RELOAD_FAILURE);
+    if (success)
+        log_info("configuration reloaded in %.1f ms", elapsed_us / 1000.0);
+    else
+        log_error("configuration error, rolling back changes");
+    return success;
+}
+
+static bool update_local_domains(postsrsd_t* state)
+{
+    char* srs_domain = NULL;
+    domain_set_t* local_domains = NULL;
+    size_t added = 0, removed = 0;
+    if (!srs_domains_from_config(state->cfg, &srs_domain, &local_domains))
+        return false;
+    /* A different SRS domain needs a full reload */
+    bool success = strcmp(srs_domain, state->srs_domain) == 0
+                   && domain_set_update_from(state->local_domains,
+                                             local_domains, &added, &removed);
+    if (success)
+        log_info("local domains updated: %zu added, %zu removed", added,
+                 removed);
+    free(srs_domain);
+    domain_set_destroy(local_domains);
+    return success;
+}
+
+static void control_reply(int conn, const char* reply)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)reply;
+    iov[0].iov_len = strlen(reply);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    writev_all(conn, iov, 2);
+}
+
+static void control_command(postsrsd_t* state, int conn, char* line)
+{
+    char* domain = strchr(line, ' ');
+    if (domain != NULL)
+        *domain++ = 0;
+    bool add = strcmp(line, "add") == 0;
+    if (!add && strcmp(line, "remove") != 0)
+    {
+        control_reply(conn, "ERROR unknown command");
+        return;
+    }
+    if (!is_valid_domain_name(domain))
+    {
+        control_reply(conn, "ERROR invalid domain name");
+        return;
+    }
+    if (!add && strcasecmp(domain, state->srs_domain) == 0)
+    {
+        control_reply(conn, "ERROR cannot remove the SRS domain");
+        return;
+    }
+    if (!domain_set_update(state->local_domains, domain, add))
+    {
+        control_reply(conn, "ERROR update table is full, reload required");
+        return;
+    }
+    log_info("local domain %s %s via control socket", domain,
+             add ? "added" : "removed");
+    control_reply(conn, "OK");
+}
+
+static void serve_control_client(postsrsd_t* state, int conn)
+{
+    /* One command per line: "add DOMAIN" or "remove DOMAIN" */
+    char buffer[1024];
+    size_t received = 0;
+    struct timespec deadline;
+    deadline_after(&deadline, CONTROL_TIMEOUT_MS);
+    while (wait_readable(conn, &deadline))
+    {
+        ssize_t r =
+            read(conn, buffer + received, sizeof(buffer) - 1 - received);
+        if (r <= 0)
+            break;
+        received += r;
+        buffer[received] = 0;
+        char* line = buffer;
+        char* eol;
+        while ((eol = strpbrk(line, "\r\n")) != NULL)
+        {
+            *eol = 0;
+            if (*line != 0)
+                control_command(state, conn, line);
+            line = eol + 1;
+        }
+        received -= line - buffer;
+        memmove(buffer, line, received);
+        if (received == sizeof(buffer) - 1)
+        {
+            control_reply(conn, "ERROR line too long");
+            break;
+        }
+    }
+}
+
 static size_t setup_poll(postsrsd_t* state, struct pollfd* fds, int* fd_types,
-                         size_t max_fds)
+                         size_t max_fds, bool with_socketmap, bool with_milter)
 {
     size_t num_fds = 0;
     size_t remaining_fds = max_fds;
-    size_t num_socketmap_fds =
-        endpoint_prepare_poll(state->socketmap, fds + num_fds, remaining_fds);
+    size_t num_socketmap_fds = endpoint_prepare_poll(
+        with_socketmap ? state->socketmap : NULL, fds + num_fds, remaining_fds);
     for (size_t i = num_fds; i < num_fds + num_socketmap_fds; ++i)
         fd_types[i] = FD_SOCKETMAP;
     remaining_fds -= num_socketmap_fds;
     num_fds += num_socketmap_fds;
-    size_t num_milter_fds =
-        endpoint_prepare_poll(state->milter, fds + num_fds, remaining_fds);
+    size_t num_milter_fds = endpoint_prepare_poll(
+        with_milter ? state->milter : NULL, fds + num_fds, remaining_fds);
     for (size_t i = num_fds; i < num_fds + num_milter_fds; ++i)
         fd_types[i] = FD_MILTER;
     remaining_fds -= num_milter_fds;
@@ -779,6 +1339,239 @@ static size_t setup_poll(postsrsd_t* state, struct pollfd* fds, int* fd_types,
     return num_fds;
 }
 
+static size_t setup_main_poll(postsrsd_t* state, struct pollfd* fds,
+                              int* fd_types, size_t max_fds)
+{
+    /* The main process only accepts connections which are not handled by
+       long-lived workers. */
+    bool fork_per_connection =
+        state->worker_pool == 0 && state->worker_threads == 0;
+    size_t num_fds = setup_poll(
+        state, fds, fd_types, max_fds,
+        fork_per_connection
+            && state->socketmap_engine == SOCKETMAP_ENGINE_PROCESS,
+        fork_per_connection);
+    /* Metrics requests are cheap and always answered by the main process */
+    size_t num_metrics_fds = endpoint_prepare_poll(
+        state->metrics, fds + num_fds, max_fds - num_fds);
+    for (size_t i = num_fds; i < num_fds + num_metrics_fds; ++i)
+        fd_types[i] = FD_METRICS;
+    num_fds += num_metrics_fds;
+    size_t num_control_fds = endpoint_prepare_poll(
+        state->control, fds + num_fds, max_fds - num_fds);
+    for (size_t i = num_fds; i < num_fds + num_control_fds; ++i)
+        fd_types[i] = FD_CONTROL;
+    num_fds += num_control_fds;
+    if (reload_pipe[0] >= 0 && num_fds < max_fds)
+    {
+        fds[num_fds].fd = reload_pipe[0];
+        fds[num_fds].events = POLLIN;
+        fds[num_fds].revents = 0;
+        fd_types[num_fds++] = FD_RELOAD;
+    }
+    return num_fds;
+}
+
+static bool worker_keep_running()
+{
+    return !ATOMIC_LOAD(reload_requested) && getppid() == main_pid;
+}
+
+static void serve_connections(postsrsd_t* state, database_t* db)
+{
+    struct pollfd fds[16];
+    int fd_types[sizeof(fds) / sizeof(struct pollfd)];
+    size_t num_fds = setup_poll(
+        state, fds, fd_types, sizeof(fds) / sizeof(struct pollfd),
+        state->socketmap_engine == SOCKETMAP_ENGINE_PROCESS, true);
+#ifdef HAVE_SYS_TIME_H
+    struct timeval keep_alive;
+    keep_alive.tv_sec = cfg_getint(state->cfg, "keep-alive");
+    keep_alive.tv_usec = 0;
+#endif
+    while (worker_keep_running())
+    {
+        if (poll(fds, num_fds, 1000) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_perror(errno, "poll");
+            break;
+        }
+        for (unsigned i = 0; i < num_fds && !ATOMIC_LOAD(reload_requested);
+             ++i)
+        {
+            if (!fds[i].revents)
+                continue;
+            int conn = accept(fds[i].fd, NULL, NULL);
+            if (conn < 0)
+            {
+                /* All workers are woken up by a new connection, but only
+                   one of them gets to accept it. */
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                    && errno != ECONNABORTED)
+                    log_perror(errno, "accept");
+                continue;
+            }
+            metrics_inc(METRIC_CONNECTION_ACCEPTED);
+#ifdef HAVE_SYS_TIME_H
+            if (use_socket_timeouts
+                && setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &keep_alive,
+                              sizeof(keep_alive))
+                       < 0)
+                log_perror(errno, "setsockopt");
+#endif
+            if (prepare_connection(conn))
+            {
+                switch (fd_types[i])
+                {
+                    case FD_SOCKETMAP:
+                        serve_socketmap_client(state, conn, db);
+                        break;
+                    case FD_MILTER:
+                        serve_milter_client(state, conn, db);
+                        break;
+                    default:
+                        log_error("socket dispatch error");
+                        break;
+                }
+            }
+            stop_timeout();
+            close(conn);
+        }
+    }
+}
+
+static void serve_pool_connections(postsrsd_t* state)
+{
+    database_t* db;
+    /* Pool workers only listen for clients; configuration changes are
+       detected by the main process, which signals us to exit. */
+    file_watch_destroy(state->file_watch);
+    state->file_watch = NULL;
+    if (!prepare_worker(state, &db, 1, WORKER_POOL))
+        exit(EXIT_FAILURE);
+    serve_connections(state, db);
+    database_disconnect(db);
+}
+
+#ifdef HAVE_PTHREAD
+struct worker_thread
+{
+    postsrsd_t* state;
+    database_t* db;
+    pthread_t thread;
+};
+
+static void* run_worker_thread(void* arg)
+{
+    struct worker_thread* T = (struct worker_thread*)arg;
+    serve_connections(T->state, T->db);
+    return NULL;
+}
+#endif
+
+static void serve_worker_threads(postsrsd_t* state)
+{
+#ifdef HAVE_PTHREAD
+    size_t num_threads = state->worker_threads, started = 0;
+    struct worker_thread* threads =
+        calloc(num_threads, sizeof(struct worker_thread));
+    database_t** db = calloc(num_threads, sizeof(database_t*));
+    if (threads == NULL || db == NULL)
+    {
+        log_error("out of memory");
+        exit(EXIT_FAILURE);
+    }
+    file_watch_destroy(state->file_watch);
+    state->file_watch = NULL;
+    use_socket_timeouts = true;
+    if (!prepare_worker(state, db, num_threads, WORKER_THREADS))
+        exit(EXIT_FAILURE);
+    /* The worker threads block all signals, so they are handled by the main
+       thread, which does nothing but wait for the workers to finish. */
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+        threads[i].state = state;
+        threads[i].db = db[i];
+        int err = pthread_create(&threads[i].thread, NULL, run_worker_thread,
+                                 &threads[i]);
+        if (err != 0)
+        {
+            log_perror(err, "pthread_create");
+            break;
+        }
+        ++started;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i].thread, NULL);
+    for (size_t i = 0; i < num_threads; ++i)
+        database_disconnect(db[i]);
+    free(db);
+    free(threads);
+    if (started == 0)
+        exit(EXIT_FAILURE);
+#else
+    MAYBE_UNUSED(state);
+    log_error("worker threads are not supported on this system");
+    exit(EXIT_FAILURE);
+#endif
+}
+
+static void serve_socketmap_events(postsrsd_t* state)
+{
+    database_t* db;
+    file_watch_destroy(state->file_watch);
+    state->file_watch = NULL;
+    if (!prepare_worker(state, &db, 1, WORKER_EVENTS))
+        exit(EXIT_FAILURE);
+    bool ok = socketmap_serve_events(state, db, worker_keep_running);
+    database_disconnect(db);
+    if (!ok)
+        exit(EXIT_FAILURE);
+}
+
+static void release_worker_state(postsrsd_t* state, pid_set_t* P)
+{
+    /* The listening sockets are shared with the main process and must not
+       be closed or unlinked by a worker. */
+    endpoint_release(state->socketmap);
+    state->socketmap = NULL;
+    endpoint_release(state->milter);
+    state->milter = NULL;
+    endpoint_release(state->metrics);
+    state->metrics = NULL;
+    endpoint_release(state->control);
+    state->control = NULL;
+    finalize_state(state);
+    sandbox_release(sandbox);
+    pid_set_destroy(P);
+    pid_set_destroy(pool_workers);
+    pid_set_destroy(event_workers);
+    pid_set_destroy(thread_workers);
+}
+
+static void delay_worker_restart()
+{
+    /* Workers which fail together only count once */
+    time_t now = time(NULL);
+    if (now < next_worker_restart)
+        return;
+    if (worker_restart_delay == 0)
+        worker_restart_delay = 1;
+    else if (worker_restart_delay < WORKER_MAX_RESTART_DELAY / 2)
+        worker_restart_delay *= 2;
+    else
+        worker_restart_delay = WORKER_MAX_RESTART_DELAY;
+    next_worker_restart = now + worker_restart_delay;
+    log_warn("worker process failed, restarting in %u seconds",
+             worker_restart_delay);
+}
+
 static void collect_finished_workers(pid_set_t* P)
 {
     pid_t pid;
@@ -786,7 +1579,12 @@ static void collect_finished_workers(pid_set_t* P)
     do
     {
         pid = waitpid(0, &child_status, WNOHANG);
-        if (pid > 0)
+        if (pid > 0 && pid == reload_job.check_pid)
+        {
+            reload_job.check_passed = unprivileged_check_passed(child_status);
+            reload_job.check_done = true;
+        }
+        else if (pid > 0)
         {
             if (WIFEXITED(child_status)
                 && WEXITSTATUS(child_status) != EXIT_SUCCESS)
@@ -812,16 +1610,121 @@ static void collect_finished_workers(pid_set_t* P)
                         break;
                 }
             }
+            if (pid == expire_worker)
+                expire_worker = 0;
             pid_set_remove(P, pid);
+            bool worker = pid_set_remove(pool_workers, pid);
+            worker = pid_set_remove(event_workers, pid) || worker;
+            worker = pid_set_remove(thread_workers, pid) || worker;
+            /* SIGTERM is only sent on shutdown */
+            if (worker
+                && ((WIFEXITED(child_status)
+                     && WEXITSTATUS(child_status) != EXIT_SUCCESS)
+                    || (WIFSIGNALED(child_status)
+                        && WTERMSIG(child_status) != SIGTERM)))
+                delay_worker_restart();
         }
     } while (pid > 0);
 }
 
+static void spawn_workers(postsrsd_t* state, pid_set_t* P, pid_set_t* W,
+                          size_t count, void (*serve)(postsrsd_t*))
+{
+    while (pid_set_size(W) < count)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            serve(state);
+            release_worker_state(state, P);
+            exit(EXIT_SUCCESS);
+        }
+        if (pid < 0)
+        {
+            log_perror(errno, "fork");
+            break;
+        }
+        pid_set_add(P, pid);
+        pid_set_add(W, pid);
+    }
+}
+
+static void run_expire_worker(postsrsd_t* state)
+{
+    database_t* db;
+    size_t total = 0, removed;
+    if (!prepare_worker(state, &db, 1, WORKER_PER_CONNECTION))
+        exit(EXIT_FAILURE);
+    time_t start = time(NULL);
+    while (database_expire_batch(db, EXPIRE_BATCH_SIZE, &removed))
+    {
+        total += removed;
+        if (removed < EXPIRE_BATCH_SIZE)
+            break;
+        poll(NULL, 0, EXPIRE_BATCH_PAUSE_MS);
+    }
+    database_disconnect(db);
+    if (total > 0)
+        log_info("removed %zu expired envelopes from the database in %ld s",
+                 total, (long)(time(NULL) - start));
+}
+
+static void spawn_expire_worker(postsrsd_t* state, pid_set_t* P)
+{
+    unsigned interval = cfg_getint(state->cfg, "envelope-expire-interval");
+    if (cfg_getint(state->cfg, "original-envelope") != SRS_ENVELOPE_DATABASE
+        || interval == 0 || expire_worker > 0)
+        return;
+    time_t now = time(NULL);
+    if (now < next_expire)
+        return;
+    next_expire = now + interval;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        run_expire_worker(state);
+        release_worker_state(state, P);
+        exit(EXIT_SUCCESS);
+    }
+    if (pid < 0)
+    {
+        log_perror(errno, "fork");
+        return;
+    }
+    pid_set_add(P, pid);
+    expire_worker = pid;
+}
+
+static void spawn_missing_workers(postsrsd_t* state, pid_set_t* P)
+{
+    bool event_engine = state->socketmap_engine == SOCKETMAP_ENGINE_EVENT;
+    bool pool_has_work =
+        state->milter != NULL || (state->socketmap != NULL && !event_engine);
+    bool threaded = state->worker_threads > 0;
+    time_t now = time(NULL);
+    if (now < next_worker_restart)
+        return;
+    /* The backoff is reset once the restarted workers have kept running
+       for as long as the last delay */
+    if (worker_restart_delay > 0
+        && now >= next_worker_restart + (time_t)worker_restart_delay)
+        worker_restart_delay = 0;
+    spawn_workers(state, P, pool_workers,
+                  pool_has_work && !threaded ? state->worker_pool : 0,
+                  serve_pool_connections);
+    spawn_workers(state, P, thread_workers, pool_has_work && threaded ? 1 : 0,
+                  serve_worker_threads);
+    spawn_workers(state, P, event_workers,
+                  event_engine && state->socketmap != NULL ? 1 : 0,
+                  serve_socketmap_events);
+}
+
 #ifndef POSTSRSD_FUZZING
 int main(int argc, char** argv)
 {
     postsrsd_t state;
     init_state(&state);
+    init_state(&reload_job.state);
     FILE* pf = NULL;
     pid_set_t* P = NULL;
     int exit_code = EXIT_FAILURE;
@@ -833,6 +1736,19 @@ int main(int argc, char** argv)
 #    endif
     if (!setup_state(argc, argv, &state))
         goto shutdown;
+    /* Pick the SHA-1 implementation before worker threads exist */
+    sha_set_backend(SHA_BACKEND_AUTO);
+    log_debug("using %s SHA-1 implementation",
+              sha_backend_name(sha_get_backend()));
+    if (!metrics_init())
+        goto shutdown;
+    if (pipe(reload_pipe) < 0)
+    {
+        log_perror(errno, "pipe");
+        goto shutdown;
+    }
+    fcntl(reload_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(reload_pipe[1], F_SETFD, FD_CLOEXEC);
     sandbox = sandbox_init();
     if (sandbox == NULL)
         log_warn("seccomp sandbox is unavailable");
@@ -849,6 +1765,15 @@ int main(int argc, char** argv)
     P = pid_set_create();
     if (P == NULL)
         goto shutdown;
+    pool_workers = pid_set_create();
+    if (pool_workers == NULL)
+        goto shutdown;
+    event_workers = pid_set_create();
+    if (event_workers == NULL)
+        goto shutdown;
+    thread_workers = pid_set_create();
+    if (thread_workers == NULL)
+        goto shutdown;
     if (!daemonize(&state))
         goto shutdown;
     if (pf != NULL)
@@ -858,15 +1783,18 @@ int main(int argc, char** argv)
         pf = NULL;
     }
     exit_code = EXIT_SUCCESS;
+    main_pid = getpid();
     signal_set_handler(SIGHUP, on_reload_requested);
     signal_set_handler_once(SIGTERM, on_shutdown_requested);
     signal_set_handler_once(SIGINT, on_shutdown_requested);
     signal_ignore(SIGPIPE);
+    signal_set_handler(SIGCHLD, on_child_exited);
     sd_notify_support = sd_notify("READY=1\nMAINPID=%d", (int)getpid());
     struct pollfd fds[16];
     int fd_types[sizeof(fds) / sizeof(struct pollfd)];
-    size_t num_fds =
-        setup_poll(&state, fds, fd_types, sizeof(fds) / sizeof(struct pollfd));
+    size_t num_fds = setup_main_poll(&state, fds, fd_types,
+                                     sizeof(fds) / sizeof(struct pollfd));
+    bool reload_finished = false, reload_checked = false;
     for (;;)
     {
         if (shutdown_requested)
@@ -880,7 +1808,46 @@ int main(int argc, char** argv)
         {
             files_changed = true;
         }
-        if (reload_requested || files_changed)
+        /* A changed domains file is applied incrementally if possible, so
+           the workers can keep running */
+        if (reload_finished)
+        {
+            reload_finished = false;
+            wait_reload_job();
+            /* A failed preparation is reported right away */
+            if (!reload_job.success || !start_reload_check())
+                reload_checked = true;
+        }
+        expire_reload_check();
+        if (reload_job.check_done)
+            reload_checked = true;
+        if (reload_checked)
+        {
+            reload_checked = false;
+            if (finish_reload_job(&state))
+            {
+                pid_set_kill(P, SIGHUP);
+                /* The old workers finish their current requests and exit,
+                   so we start new workers right away. */
+                pid_set_clear(pool_workers);
+                pid_set_clear(event_workers);
+                pid_set_clear(thread_workers);
+                worker_restart_delay = 0;
+                next_worker_restart = 0;
+                num_fds = setup_main_poll(&state, fds, fd_types,
+                                          sizeof(fds) / sizeof(struct pollfd));
+            }
+            if (sd_notify_support)
+                sd_notify("READY=1");
+        }
+        /* While a reload is prepared, changes are left for the new state */
+        if (files_changed && !reload_requested && !reload_in_progress()
+            && update_local_domains(&state))
+        {
+            files_changed = false;
+            files_changed_unsafe = false;
+        }
+        if ((reload_requested || files_changed) && !reload_in_progress())
         {
             if (sd_notify_support)
             {
@@ -907,31 +1874,35 @@ int main(int argc, char** argv)
                 else
                     log_info("file change detected, reloading configuration.");
             }
-            if (setup_state(argc, argv, &state))
-            {
-                pid_set_kill(P, SIGHUP);
-                num_fds = setup_poll(&state, fds, fd_types,
-                                     sizeof(fds) / sizeof(struct pollfd));
-            }
-            else
-            {
-                log_error("configuration error, rolling back changes");
-            }
-            if (sd_notify_support)
-                sd_notify("READY=1");
+            start_reload_job(argc, argv);
         }
-        if (poll(fds, num_fds, 1000) < 0)
+        if (!reload_job.running)
+        {
+            spawn_missing_workers(&state, P);
+            spawn_expire_worker(&state, P);
+        }
+        for (size_t i = 0; i < num_fds; ++i)
+        {
+            if (fd_types[i] == FD_SOCKETMAP || fd_types[i] == FD_MILTER)
+                fds[i].events = reload_job.running ? 0 : POLLIN;
+        }
+        metrics_set(METRIC_CHILDREN, pid_set_size(P));
+        metrics_set(METRIC_CONNECTION_LIMIT, state.connection_limit);
+        int ready = poll(fds, num_fds, 1000);
+        if (ready < 0 && errno != EINTR)
         {
-            if (errno == EINTR)
-                continue;
             log_perror(errno, "poll");
             goto shutdown;
         }
-        for (unsigned i = 0; i < num_fds; ++i)
+        for (unsigned i = 0; ready > 0 && i < num_fds; ++i)
         {
             if (fds[i].revents)
             {
-                if (fds[i].fd == file_watch_poll_fd(state.file_watch))
+                if (fd_types[i] == FD_RELOAD)
+                {
+                    reload_finished = true;
+                }
+                else if (fds[i].fd == file_watch_poll_fd(state.file_watch))
                 {
                     file_watch_process_events(state.file_watch);
                 }
@@ -943,12 +1914,26 @@ int main(int argc, char** argv)
                         log_perror(errno, "accept");
                         continue;
                     }
+                    if (fd_types[i] == FD_METRICS)
+                    {
+                        metrics_serve(conn);
+                        close(conn);
+                        continue;
+                    }
+                    if (fd_types[i] == FD_CONTROL)
+                    {
+                        serve_control_client(&state, conn);
+                        close(conn);
+                        continue;
+                    }
                     if (pid_set_size(P) >= state.connection_limit)
                     {
                         log_warn("connection limit reached");
+                        metrics_inc(METRIC_CONNECTION_REJECTED);
                         close(conn);
                         continue;
                     }
+                    metrics_inc(METRIC_CONNECTION_ACCEPTED);
                     pid_t pid = fork();
                     if (pid == 0)
                     {
@@ -956,6 +1941,10 @@ int main(int argc, char** argv)
                         state.socketmap = NULL;
                         endpoint_release(state.milter);
                         state.milter = NULL;
+                        endpoint_release(state.metrics);
+                        state.metrics = NULL;
+                        endpoint_release(state.control);
+                        state.control = NULL;
                         switch (fd_types[i])
                         {
                             case FD_SOCKETMAP:
@@ -971,6 +1960,9 @@ int main(int argc, char** argv)
                         finalize_state(&state);
                         sandbox_release(sandbox);
                         pid_set_destroy(P);
+                        pid_set_destroy(pool_workers);
+                        pid_set_destroy(event_workers);
+                        pid_set_destroy(thread_workers);
                         exit(EXIT_SUCCESS);
                     }
                     if (pid > 0)
@@ -990,12 +1982,26 @@ int main(int argc, char** argv)
 shutdown:
     if (pf != NULL)
         fclose(pf);
+    if (reload_job.running)
+        wait_reload_job();
+    if (reload_job.check_pid > 0 && !reload_job.check_done)
+    {
+        kill(reload_job.check_pid, SIGKILL);
+        waitpid(reload_job.check_pid, NULL, 0);
+    }
+    finalize_state(&reload_job.state);
+    close_reload_pipe();
     finalize_state(&state);
     sandbox_release(sandbox);
     collect_finished_workers(P);
     pid_set_kill(P, SIGTERM);
     pid_set_wait(P);
     pid_set_destroy(P);
+    pid_set_destroy(pool_workers);
+    pid_set_destroy(event_workers);
+    pid_set_destroy(thread_workers);
+    database_cache_shutdown();
+    metrics_shutdown();
     return exit_code;
 }
 #endif
@@ -28,11 +28,16 @@ struct postsrsd
     srs_t* srs;
     endpoint_t* socketmap;
     endpoint_t* milter;
+    endpoint_t* metrics;
+    endpoint_t* control;
     char* srs_domain;
     domain_set_t* local_domains;
     file_watch_t* file_watch;
     int target_uid, target_gid;
     size_t connection_limit;
+    size_t worker_pool;
+    size_t worker_threads;
+    int socketmap_engine;
 };
 typedef struct postsrsd postsrsd_t;
 
@@ -0,0 +1,316 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#include "postsrsd_build_config.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#endif
+
+#define METRICS_NUM_BUCKETS 12
+#define METRICS_BUFFER_SIZE 16384
+
+/* Scrapes are answered by the main loop, which must not wait for a slow
+   client for longer than this */
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+struct metrics_histogram_data
+{
+    uint64_t buckets[METRICS_NUM_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+};
+
+/* The counter block is mapped into shared memory before the first child
+   is forked, so all processes update the same counters. */
+struct metrics_block
+{
+    uint64_t counters[METRICS_NUM_COUNTERS];
+    uint64_t gauges[METRICS_NUM_GAUGES];
+    struct metrics_histogram_data histograms[METRICS_NUM_HISTOGRAMS];
+};
+
+struct metrics_info
+{
+    const char* name;
+    const char* labels;
+    const char* help;
+};
+
+static struct metrics_block* metrics = NULL;
+
+/* Upper bounds of the latency histogram buckets in microseconds; the last
+   bucket is unbounded. */
+static const uint64_t bucket_bounds[METRICS_NUM_BUCKETS - 1] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 100000};
+
+static const struct metrics_info counter_info[METRICS_NUM_COUNTERS] = {
+    {"postsrsd_forward_total", "result=\"rewritten\"",
+     "Envelope senders processed for forwarding."},
+    {"postsrsd_forward_total", "result=\"local_domain\"", NULL},
+    {"postsrsd_forward_total", "result=\"no_domain\"", NULL},
+    {"postsrsd_forward_total", "result=\"not_rewritten\"", NULL},
+    {"postsrsd_forward_total", "result=\"error\"", NULL},
+    {"postsrsd_reverse_total", "result=\"reversed\"",
+     "Recipients processed for reversal."},
+    {"postsrsd_reverse_total", "result=\"not_srs\"", NULL},
+    {"postsrsd_reverse_total", "result=\"hash_invalid\"", NULL},
+    {"postsrsd_reverse_total", "result=\"timestamp_expired\"", NULL},
+    {"postsrsd_reverse_total", "result=\"unknown_alias\"", NULL},
+    {"postsrsd_reverse_total", "result=\"error\"", NULL},
+    {"postsrsd_database_operations_total", "op=\"read\"",
+     "Envelope database operations."},
+    {"postsrsd_database_operations_total", "op=\"write\"", NULL},
+    {"postsrsd_database_errors_total", "op=\"read\"",
+     "Failed envelope database operations."},
+    {"postsrsd_database_errors_total", "op=\"write\"", NULL},
+    {"postsrsd_database_cache_total", "result=\"hit\"",
+     "Envelope database reads by cache result."},
+    {"postsrsd_database_cache_total", "result=\"miss\"", NULL},
+    {"postsrsd_database_writes_coalesced_total", NULL,
+     "Envelope database writes skipped for recently stored envelopes."},
+    {"postsrsd_database_expired_total", NULL,
+     "Expired envelopes removed from the database."},
+    {"postsrsd_database_reconnects_total", NULL,
+     "Attempts to reopen a lost envelope database connection."},
+    {"postsrsd_database_evicted_total", NULL,
+     "Unexpired envelopes replaced because the mmap database was full."},
+    {"postsrsd_connections_total", "result=\"accepted\"",
+     "Client connections accepted."},
+    {"postsrsd_connections_total", "result=\"rejected\"", NULL},
+    {"postsrsd_reloads_total", "result=\"success\"",
+     "Configuration reloads."},
+    {"postsrsd_reloads_total", "result=\"failure\"", NULL},
+};
+
+static const struct metrics_info gauge_info[METRICS_NUM_GAUGES] = {
+    {"postsrsd_children", NULL, "Running child processes."},
+    {"postsrsd_connection_limit", NULL,
+     "Configured maximum number of child processes."},
+    {"postsrsd_last_reload_duration_microseconds", NULL,
+     "Time taken by the most recent configuration reload."},
+};
+
+static const struct metrics_info histogram_info[METRICS_NUM_HISTOGRAMS] = {
+    {"postsrsd_forward_duration_seconds", NULL,
+     "Time spent rewriting envelope senders."},
+    {"postsrsd_reverse_duration_seconds", NULL,
+     "Time spent reversing recipients."},
+};
+
+bool metrics_init()
+{
+    if (metrics != NULL)
+        return true;
+#ifdef HAVE_SYS_MMAN_H
+    void* block =
+        mmap(NULL, sizeof(struct metrics_block), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+    {
+        log_perror(errno, "mmap");
+        return false;
+    }
+    metrics = block;
+#else
+    /* Without shared memory, only the main process is accounted for */
+    metrics = calloc(1, sizeof(struct metrics_block));
+    if (metrics == NULL)
+        return false;
+#endif
+    return true;
+}
+
+void metrics_shutdown()
+{
+    if (metrics == NULL)
+        return;
+#ifdef HAVE_SYS_MMAN_H
+    munmap(metrics, sizeof(struct metrics_block));
+#else
+    free(metrics);
+#endif
+    metrics = NULL;
+}
+
+void metrics_inc(enum metrics_counter counter)
+{
+    if (metrics != NULL)
+        ATOMIC_ADD(metrics->counters[counter], 1);
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t value)
+{
+    if (metrics != NULL)
+        ATOMIC_ADD(metrics->counters[counter], value);
+}
+
+void metrics_set(enum metrics_gauge gauge, uint64_t value)
+{
+    if (metrics != NULL)
+        ATOMIC_STORE(metrics->gauges[gauge], value);
+}
+
+uint64_t metrics_start()
+{
+    struct timespec ts;
+    if (metrics == NULL)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t start)
+{
+    if (metrics == NULL || start == 0)
+        return;
+    uint64_t elapsed = metrics_start() - start;
+    uint64_t elapsed_us = elapsed / 1000;
+    unsigned i = 0;
+    while (i < METRICS_NUM_BUCKETS - 1 && elapsed_us > bucket_bounds[i])
+        ++i;
+    struct metrics_histogram_data* h = &metrics->histograms[histogram];
+    ATOMIC_ADD(h->buckets[i], 1);
+    ATOMIC_ADD(h->sum_ns, elapsed);
+    ATOMIC_ADD(h->count, 1);
+}
+
+static void format_header(char* buffer, size_t bufsize, size_t* pos,
+                          const struct metrics_info* info, const char* type)
+{
+    if (*pos < bufsize)
+        *pos += snprintf(buffer + *pos, bufsize - *pos,
+                         "# HELP %s %s\n# TYPE %s %s\n", info->name,
+                         info->help, info->name, type);
+}
+
+static void format_value(char* buffer, size_t bufsize, size_t* pos,
+                         const char* name, const char* labels, uint64_t value)
+{
+    if (*pos >= bufsize)
+        return;
+    if (labels != NULL)
+        *pos += snprintf(buffer + *pos, bufsize - *pos, "%s{%s} %llu\n", name,
+                         labels, (unsigned long long)value);
+    else
+        *pos += snprintf(buffer + *pos, bufsize - *pos, "%s %llu\n", name,
+                         (unsigned long long)value);
+}
+
+size_t metrics_format(char* buffer, size_t bufsize)
+{
+    struct metrics_block empty;
+    const struct metrics_block* m = metrics;
+    char name[128];
+    char labels[32];
+    size_t pos = 0;
+
+    if (bufsize == 0)
+        return 0;
+    buffer[0] = 0;
+    if (m == NULL)
+    {
+        memset(&empty, 0, sizeof(empty));
+        m = &empty;
+    }
+    for (unsigned i = 0; i < METRICS_NUM_COUNTERS; ++i)
+    {
+        if (counter_info[i].help != NULL)
+            format_header(buffer, bufsize, &pos, &counter_info[i], "counter");
+        format_value(buffer, bufsize, &pos, counter_info[i].name,
+                     counter_info[i].labels, ATOMIC_LOAD(m->counters[i]));
+    }
+    for (unsigned i = 0; i < METRICS_NUM_GAUGES; ++i)
+    {
+        format_header(buffer, bufsize, &pos, &gauge_info[i], "gauge");
+        format_value(buffer, bufsize, &pos, gauge_info[i].name, NULL,
+                     ATOMIC_LOAD(m->gauges[i]));
+    }
+    for (unsigned i = 0; i < METRICS_NUM_HISTOGRAMS; ++i)
+    {
+        const struct metrics_histogram_data* h = &m->histograms[i];
+        uint64_t cumulative = 0;
+        format_header(buffer, bufsize, &pos, &histogram_info[i], "histogram");
+        snprintf(name, sizeof(name), "%s_bucket", histogram_info[i].name);
+        for (unsigned j = 0; j < METRICS_NUM_BUCKETS; ++j)
+        {
+            cumulative += ATOMIC_LOAD(h->buckets[j]);
+            if (j < METRICS_NUM_BUCKETS - 1)
+                snprintf(labels, sizeof(labels), "le=\"%g\"",
+                         (double)bucket_bounds[j] / 1e6);
+            else
+                strcpy(labels, "le=\"+Inf\"");
+            format_value(buffer, bufsize, &pos, name, labels, cumulative);
+        }
+        if (pos < bufsize)
+            pos += snprintf(buffer + pos, bufsize - pos, "%s_sum %.9f\n",
+                            histogram_info[i].name,
+                            (double)ATOMIC_LOAD(h->sum_ns) / 1e9);
+        snprintf(name, sizeof(name), "%s_count", histogram_info[i].name);
+        format_value(buffer, bufsize, &pos, name, NULL,
+                     ATOMIC_LOAD(h->count));
+    }
+    return pos < bufsize ? pos : bufsize - 1;
+}
+
+void metrics_serve(int conn)
+{
+    static const char header_fmt[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    char request[1024];
+    char header[sizeof(header_fmt) + 20];
+    char body[METRICS_BUFFER_SIZE];
+    struct timespec deadline;
+    struct iovec iov[2];
+    size_t received = 0;
+
+    /* The request itself is irrelevant, every request gets the metrics.
+       We wait briefly for it so the client does not see a reset. */
+    deadline_after(&deadline, METRICS_REQUEST_TIMEOUT_MS);
+    while (received < sizeof(request) - 1 && wait_readable(conn, &deadline))
+    {
+        ssize_t r = read(conn, request + received,
+                         sizeof(request) - 1 - received);
+        if (r <= 0)
+            break;
+        received += r;
+        request[received] = 0;
+        if (strstr(request, "\r\n\r\n") != NULL
+            || strstr(request, "\n\n") != NULL)
+            break;
+    }
+    size_t length = metrics_format(body, sizeof(body));
+    int n = snprintf(header, sizeof(header), header_fmt, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = n;
+    iov[1].iov_base = body;
+    iov[1].iov_len = length;
+    writev_all(conn, iov, 2);
+}
@@ -0,0 +1,79 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum metrics_counter
+{
+    METRIC_FORWARD_REWRITTEN,
+    METRIC_FORWARD_LOCAL_DOMAIN,
+    METRIC_FORWARD_NO_DOMAIN,
+    METRIC_FORWARD_NOT_REWRITTEN,
+    METRIC_FORWARD_ERROR,
+    METRIC_REVERSE_REVERSED,
+    METRIC_REVERSE_NOT_SRS,
+    METRIC_REVERSE_HASH_INVALID,
+    METRIC_REVERSE_TIMESTAMP_EXPIRED,
+    METRIC_REVERSE_UNKNOWN_ALIAS,
+    METRIC_REVERSE_ERROR,
+    METRIC_DATABASE_READ,
+    METRIC_DATABASE_WRITE,
+    METRIC_DATABASE_READ_ERROR,
+    METRIC_DATABASE_WRITE_ERROR,
+    METRIC_DATABASE_CACHE_HIT,
+    METRIC_DATABASE_CACHE_MISS,
+    METRIC_DATABASE_WRITE_COALESCED,
+    METRIC_DATABASE_EXPIRED,
+    METRIC_DATABASE_RECONNECT,
+    METRIC_DATABASE_EVICTED,
+    METRIC_CONNECTION_ACCEPTED,
+    METRIC_CONNECTION_REJECTED,
+    METRIC_RELOAD_SUCCESS,
+    METRIC_RELOAD_FAILURE,
+    METRICS_NUM_COUNTERS
+};
+
+enum metrics_gauge
+{
+    METRIC_CHILDREN,
+    METRIC_CONNECTION_LIMIT,
+    METRIC_RELOAD_DURATION,
+    METRICS_NUM_GAUGES
+};
+
+enum metrics_histogram
+{
+    METRIC_FORWARD_DURATION,
+    METRIC_REVERSE_DURATION,
+    METRICS_NUM_HISTOGRAMS
+};
+
+bool metrics_init();
+void metrics_shutdown();
+void metrics_inc(enum metrics_counter counter);
+void metrics_add(enum metrics_counter counter, uint64_t value);
+void metrics_set(enum metrics_gauge gauge, uint64_t value);
+uint64_t metrics_start();
+void metrics_observe(enum metrics_histogram histogram, uint64_t start);
+size_t metrics_format(char* buffer, size_t bufsize);
+void metrics_serve(int conn);
+
+#endif
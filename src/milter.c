@@ -48,7 +48,7 @@ static_assert(sizeof(struct milter_packet) == 5,
 
 size_t milter_receive(int fd, void* buffer, size_t size, size_t* truncated)
 {
-    static char discardpile[512];
+    char discardpile[512];
     uint32_t len;
     ssize_t r;
     if (truncated != NULL)
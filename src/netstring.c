@@ -18,9 +18,11 @@
 
 #include "util.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <unistd.h>
 
 char* netstring_encode(const char* data, size_t length, char* buffer,
                        size_t bufsize, size_t* encoded_length)
@@ -134,3 +136,98 @@ int netstring_write(int fd, const char* data, size_t length)
         return writev_all(fd, iov, 1) ? 3 : -1;
     }
 }
+
+char* netstring_frame(char* data, size_t length, size_t* encoded_length)
+{
+    /* Turns the payload into a netstring in place, without copying it. The
+       caller must provide NETSTRING_HEADER_SIZE bytes in front of the
+       payload and one byte after it. */
+    char* p = data;
+    size_t n = length;
+    *--p = ':';
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    data[length] = ',';
+    if (encoded_length != NULL)
+        *encoded_length = data + length + 1 - p;
+    return p;
+}
+
+void netstring_reader_init(netstring_reader_t* reader)
+{
+    reader->begin = 0;
+    reader->end = 0;
+}
+
+ssize_t netstring_reader_fill(netstring_reader_t* reader, int fd)
+{
+    if (reader->begin == reader->end)
+    {
+        reader->begin = 0;
+        reader->end = 0;
+    }
+    else if (reader->begin > 0 && reader->end == sizeof(reader->buffer))
+    {
+        memmove(reader->buffer, reader->buffer + reader->begin,
+                reader->end - reader->begin);
+        reader->end -= reader->begin;
+        reader->begin = 0;
+    }
+    if (reader->end == sizeof(reader->buffer))
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t r = read(fd, reader->buffer + reader->end,
+                     sizeof(reader->buffer) - reader->end);
+    if (r > 0)
+        reader->end += r;
+    return r;
+}
+
+char* netstring_reader_next(netstring_reader_t* reader, size_t bufsize,
+                            size_t* decoded_length)
+{
+    /* Decodes the next netstring in place. The payload must be shorter than
+       bufsize, just like with netstring_read(). Returns NULL with a decoded
+       length of zero if the netstring is still incomplete, and NULL with a
+       decoded length of SIZE_MAX if the buffered data is not a valid
+       netstring. */
+    char* data = reader->buffer + reader->begin;
+    size_t available = reader->end - reader->begin;
+    size_t length = 0;
+    size_t i = 0;
+    if (decoded_length != NULL)
+        *decoded_length = 0;
+    if (bufsize > sizeof(reader->buffer) - 24)
+        bufsize = sizeof(reader->buffer) - 24;
+    while (i < available && data[i] != ':')
+    {
+        if (data[i] < '0' || data[i] > '9' || i >= 20)
+            goto invalid;
+        length = 10 * length + (data[i] - '0');
+        if (length > 100000 || length >= bufsize)
+            goto invalid;
+        ++i;
+    }
+    if (i == available)
+        return NULL;
+    if (i == 0)
+        goto invalid;
+    if (available < i + length + 2)
+        return NULL;
+    if (data[i + length + 1] != ',')
+        goto invalid;
+    data[i + length + 1] = 0;
+    reader->begin += i + length + 2;
+    if (decoded_length != NULL)
+        *decoded_length = length;
+    return data + i + 1;
+invalid:
+    if (decoded_length != NULL)
+        *decoded_length = SIZE_MAX;
+    return NULL;
+}
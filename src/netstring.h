@@ -19,6 +19,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+
+#define NETSTRING_READER_SIZE 2048
+/* Space that netstring_frame() needs in front of the payload */
+#define NETSTRING_HEADER_SIZE 21
+
+struct netstring_reader
+{
+    size_t begin;
+    size_t end;
+    char buffer[NETSTRING_READER_SIZE];
+};
+typedef struct netstring_reader netstring_reader_t;
 
 char* netstring_encode(const char* data, size_t length, char* buffer,
                        size_t bufsize, size_t* encoded_length);
@@ -27,5 +40,11 @@ char* netstring_decode(const char* netstring, size_t encoded_length,
 char* netstring_read(int fd, char* buffer, size_t bufsize,
                      size_t* decoded_length);
 int netstring_write(int fd, const char* data, size_t length);
+char* netstring_frame(char* data, size_t length, size_t* encoded_length);
+
+void netstring_reader_init(netstring_reader_t* reader);
+ssize_t netstring_reader_fill(netstring_reader_t* reader, int fd);
+char* netstring_reader_next(netstring_reader_t* reader, size_t bufsize,
+                            size_t* decoded_length);
 
 #endif
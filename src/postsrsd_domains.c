@@ -0,0 +1,88 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "postsrsd_build_config.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "Usage: %s compile INPUT OUTPUT\n"
+            "       %s check FILE DOMAIN...\n"
+            "\n"
+            "  compile  convert the domains file INPUT to the binary index\n"
+            "           OUTPUT, which is replaced atomically\n"
+            "  check    test if each DOMAIN is a local domain according to\n"
+            "           the domains file or binary index FILE\n",
+            argv0, argv0);
+}
+
+static int compile(const char* input, const char* output)
+{
+    domain_set_t* D = domain_set_create();
+    if (D == NULL)
+        log_fatal("out of memory");
+    if (!domain_set_read_file(D, input))
+    {
+        domain_set_destroy(D);
+        return EXIT_FAILURE;
+    }
+    bool success = domain_set_write_index(D, output);
+    domain_set_destroy(D);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int check(const char* file, int ndomains, char* const* domains)
+{
+    domain_set_t* D = domain_set_create();
+    if (D == NULL)
+        log_fatal("out of memory");
+    if (!domain_set_read_file(D, file))
+    {
+        domain_set_destroy(D);
+        return EXIT_FAILURE;
+    }
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < ndomains; ++i)
+    {
+        bool local = domain_set_contains(D, domains[i]);
+        printf("%s: %s\n", domains[i], local ? "local" : "not local");
+        if (!local)
+            result = EXIT_FAILURE;
+    }
+    domain_set_destroy(D);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 2 && strcmp(argv[1], "-v") == 0)
+    {
+        puts(POSTSRSD_VERSION);
+        return EXIT_SUCCESS;
+    }
+    if (argc == 4 && strcmp(argv[1], "compile") == 0)
+        return compile(argv[2], argv[3]);
+    if (argc >= 4 && strcmp(argv[1], "check") == 0)
+        return check(argv[2], argc - 3, argv + 3);
+    usage(argv[0]);
+    return argc == 2 && strcmp(argv[1], "-h") == 0 ? EXIT_SUCCESS
+                                                   : EXIT_FAILURE;
+}
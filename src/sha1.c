@@ -22,8 +22,34 @@
 
 #include "postsrsd_build_config.h"
 
+#include <stdint.h>
 #include <string.h> /* memcpy, strcpy, memset */
 
+/* Hardware accelerated implementations of the compression function are
+   selected at runtime if the CPU supports them */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H)
+#    include <cpuid.h>
+#    include <immintrin.h>
+#    define SHA_X86
+#endif
+#if defined(__GNUC__) && defined(__aarch64__) && defined(HAVE_ARM_NEON_H) \
+    && defined(HAVE_SYS_AUXV_H)
+#    include <arm_neon.h>
+#    include <sys/auxv.h>
+#    ifdef HWCAP_SHA1
+#        define SHA_ARMV8
+#        ifdef __clang__
+#            define ARMV8_CRYPTO_TARGET "crypto"
+#        else
+#            define ARMV8_CRYPTO_TARGET "+crypto"
+#        endif
+#    endif
+#endif
+#if defined(SHA_X86) || defined(SHA_ARMV8)
+#    define ATTRIBUTE_TARGET(x) __attribute__((target(x)))
+#endif
+
 #ifdef SIZEOF_UNSIGNED_LONG
 #    if SIZEOF_UNSIGNED_LONG < 4
 #        error "SHA1 requires an unsigned long of at least 32 bits"
@@ -106,11 +132,84 @@
     A = T32(R32(B, 5) + f##n(C, D, E) + T + *WP++ + CONST##n); \
     C = R32(C, 30)
 
-static void sha_transform(SHA_INFO* sha_info)
+/* run the compression function on an expanded message schedule */
+
+static void sha_rounds(SHA_INFO* sha_info, const uint32_t* W)
+{
+#if !defined(UNRAVEL) && !defined(UNROLL_LOOPS)
+    int i;
+#endif
+    ULONG T, A, B, C, D, E;
+    const uint32_t* WP;
+
+    A = sha_info->digest[0];
+    B = sha_info->digest[1];
+    C = sha_info->digest[2];
+    D = sha_info->digest[3];
+    E = sha_info->digest[4];
+    WP = W;
+#ifdef UNRAVEL
+    /* clang-format off */
+    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
+    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
+    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
+    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
+    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
+    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
+    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
+    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
+    /* clang-format on */
+    sha_info->digest[0] = T32(sha_info->digest[0] + E);
+    sha_info->digest[1] = T32(sha_info->digest[1] + T);
+    sha_info->digest[2] = T32(sha_info->digest[2] + A);
+    sha_info->digest[3] = T32(sha_info->digest[3] + B);
+    sha_info->digest[4] = T32(sha_info->digest[4] + C);
+#else
+#    ifdef UNROLL_LOOPS
+    /* clang-format off */
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    /* clang-format on */
+#    else
+    for (i = 0; i < 20; ++i)
+    {
+        FG(1);
+    }
+    for (i = 20; i < 40; ++i)
+    {
+        FG(2);
+    }
+    for (i = 40; i < 60; ++i)
+    {
+        FG(3);
+    }
+    for (i = 60; i < 80; ++i)
+    {
+        FG(4);
+    }
+#    endif
+    sha_info->digest[0] = T32(sha_info->digest[0] + A);
+    sha_info->digest[1] = T32(sha_info->digest[1] + B);
+    sha_info->digest[2] = T32(sha_info->digest[2] + C);
+    sha_info->digest[3] = T32(sha_info->digest[3] + D);
+    sha_info->digest[4] = T32(sha_info->digest[4] + E);
+#endif
+}
+
+/* the portable fallback for sha_transform */
+
+static void sha_transform_portable(SHA_INFO* sha_info)
 {
     int i;
     sha_byte* dp;
-    ULONG T, A, B, C, D, E, W[80], *WP;
+    ULONG T;
+    uint32_t W[80];
 
     dp = sha_info->data;
 
@@ -183,64 +282,425 @@ nether regions of the anatomy...
         W[i] = R32(W[i], 1);
 #endif
     }
-    A = sha_info->digest[0];
-    B = sha_info->digest[1];
-    C = sha_info->digest[2];
-    D = sha_info->digest[3];
-    E = sha_info->digest[4];
-    WP = W;
-#ifdef UNRAVEL
+    sha_rounds(sha_info, W);
+}
+
+#ifdef SHA_X86
+/* x86 SSSE3: the message schedule is computed four words at a time. The
+   rounds themselves are inherently serial and remain scalar. */
+
+ATTRIBUTE_TARGET("ssse3")
+static void sha_transform_ssse3(SHA_INFO* sha_info)
+{
+    uint32_t W[80];
+    const __m128i bswap =
+        _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    int i;
+
+    for (i = 0; i < 16; i += 4)
+    {
+        __m128i w = _mm_loadu_si128((const __m128i*)(sha_info->data + 4 * i));
+        _mm_storeu_si128((__m128i*)&W[i], _mm_shuffle_epi8(w, bswap));
+    }
+    for (i = 16; i < 80; i += 4)
+    {
+        /* W[i + 3] depends on W[i], which is computed in the same step, so
+           we leave it out first and fix up the last word afterwards. */
+        __m128i t = _mm_xor_si128(
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)&W[i - 16]),
+                          _mm_loadu_si128((const __m128i*)&W[i - 14])),
+            _mm_xor_si128(
+                _mm_loadu_si128((const __m128i*)&W[i - 8]),
+                _mm_srli_si128(_mm_loadu_si128((const __m128i*)&W[i - 4]), 4)));
+        __m128i w = _mm_or_si128(_mm_slli_epi32(t, 1), _mm_srli_epi32(t, 31));
+        __m128i fix = _mm_slli_si128(t, 12);
+        fix = _mm_or_si128(_mm_slli_epi32(fix, 2), _mm_srli_epi32(fix, 30));
+        _mm_storeu_si128((__m128i*)&W[i], _mm_xor_si128(w, fix));
+    }
+    sha_rounds(sha_info, W);
+}
+
+/* x86 SHA extensions: four rounds per instruction. Each step consumes the
+   message words M[k % 4], which are expanded in place for k >= 4. */
+
+#    define SHANI_SCHEDULE(k)                                                \
+        M[(k) % 4] = _mm_sha1msg2_epu32(                                     \
+            _mm_xor_si128(_mm_sha1msg1_epu32(M[(k) % 4], M[((k) + 1) % 4]), \
+                          M[((k) + 2) % 4]),                                 \
+            M[((k) + 3) % 4])
+
+#    define SHANI_ROUNDS(k)                        \
+        E = _mm_sha1nexte_epu32(S, M[(k) % 4]);    \
+        S = ABCD;                                  \
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E, (k) / 5)
+
+#    define SHANI_LOAD(k)                                                  \
+        M[k] = _mm_shuffle_epi8(                                           \
+            _mm_loadu_si128((const __m128i*)(sha_info->data + 16 * (k))), \
+            bswap)
+
+ATTRIBUTE_TARGET("sha,sse4.1,ssse3")
+static void sha_transform_shani(SHA_INFO* sha_info)
+{
+    const __m128i bswap =
+        _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i ABCD, ABCD0, E, E0, S, M[4];
+    uint32_t out[4];
+
+    ABCD0 = ABCD = _mm_set_epi32(
+        (int)sha_info->digest[0], (int)sha_info->digest[1],
+        (int)sha_info->digest[2], (int)sha_info->digest[3]);
+    E0 = _mm_set_epi32((int)sha_info->digest[4], 0, 0, 0);
+
+    SHANI_LOAD(0);
+    E = _mm_add_epi32(E0, M[0]);
+    S = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, 0);
+    SHANI_LOAD(1);
+    SHANI_ROUNDS(1);
+    SHANI_LOAD(2);
+    SHANI_ROUNDS(2);
+    SHANI_LOAD(3);
+    SHANI_ROUNDS(3);
     /* clang-format off */
-    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
-    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
-    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
-    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
-    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
-    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
-    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
-    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
+    SHANI_SCHEDULE(4);  SHANI_ROUNDS(4);  SHANI_SCHEDULE(5);  SHANI_ROUNDS(5);
+    SHANI_SCHEDULE(6);  SHANI_ROUNDS(6);  SHANI_SCHEDULE(7);  SHANI_ROUNDS(7);
+    SHANI_SCHEDULE(8);  SHANI_ROUNDS(8);  SHANI_SCHEDULE(9);  SHANI_ROUNDS(9);
+    SHANI_SCHEDULE(10); SHANI_ROUNDS(10); SHANI_SCHEDULE(11); SHANI_ROUNDS(11);
+    SHANI_SCHEDULE(12); SHANI_ROUNDS(12); SHANI_SCHEDULE(13); SHANI_ROUNDS(13);
+    SHANI_SCHEDULE(14); SHANI_ROUNDS(14); SHANI_SCHEDULE(15); SHANI_ROUNDS(15);
+    SHANI_SCHEDULE(16); SHANI_ROUNDS(16); SHANI_SCHEDULE(17); SHANI_ROUNDS(17);
+    SHANI_SCHEDULE(18); SHANI_ROUNDS(18); SHANI_SCHEDULE(19); SHANI_ROUNDS(19);
     /* clang-format on */
-    sha_info->digest[0] = T32(sha_info->digest[0] + E);
-    sha_info->digest[1] = T32(sha_info->digest[1] + T);
-    sha_info->digest[2] = T32(sha_info->digest[2] + A);
-    sha_info->digest[3] = T32(sha_info->digest[3] + B);
-    sha_info->digest[4] = T32(sha_info->digest[4] + C);
-#else
-#    ifdef UNROLL_LOOPS
+    E = _mm_sha1nexte_epu32(S, E0);
+    ABCD = _mm_add_epi32(ABCD, ABCD0);
+
+    _mm_storeu_si128((__m128i*)out, ABCD);
+    sha_info->digest[0] = out[3];
+    sha_info->digest[1] = out[2];
+    sha_info->digest[2] = out[1];
+    sha_info->digest[3] = out[0];
+    _mm_storeu_si128((__m128i*)out, E);
+    sha_info->digest[4] = out[3];
+}
+
+static unsigned sha_x86_cpuid(unsigned leaf, unsigned reg)
+{
+    unsigned regs[4];
+    if (__get_cpuid_max(0, NULL) < leaf)
+        return 0;
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+    return regs[reg];
+}
+
+static int sha_ssse3_available(void)
+{
+    return (sha_x86_cpuid(1, 2) & (1 << 9)) != 0;
+}
+
+static int sha_shani_available(void)
+{
+    return sha_ssse3_available() && (sha_x86_cpuid(1, 2) & (1 << 19)) != 0
+           && (sha_x86_cpuid(7, 1) & (1 << 29)) != 0;
+}
+#endif
+
+#ifdef SHA_ARMV8
+/* ARMv8 cryptography extensions: four rounds per instruction, with the
+   message schedule expanded in place as in the x86 version. */
+
+#    define ARMV8_SCHEDULE(k)                                               \
+        M[(k) % 4] = vsha1su1q_u32(                                         \
+            vsha1su0q_u32(M[(k) % 4], M[((k) + 1) % 4], M[((k) + 2) % 4]), \
+            M[((k) + 3) % 4])
+
+#    define ARMV8_ROUNDS(k, op, K)                                  \
+        E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));                   \
+        ABCD = op(ABCD, E, vaddq_u32(M[(k) % 4], vdupq_n_u32(K))); \
+        E = E1
+
+#    define ARMV8_LOAD(k)                        \
+        M[k] = vreinterpretq_u32_u8(vrev32q_u8( \
+            vld1q_u8(sha_info->data + 16 * (k))))
+
+ATTRIBUTE_TARGET(ARMV8_CRYPTO_TARGET)
+static void sha_transform_armv8(SHA_INFO* sha_info)
+{
+    uint32_t state[4];
+    uint32x4_t ABCD, ABCD0, M[4];
+    uint32_t E, E0, E1;
+
+    state[0] = (uint32_t)sha_info->digest[0];
+    state[1] = (uint32_t)sha_info->digest[1];
+    state[2] = (uint32_t)sha_info->digest[2];
+    state[3] = (uint32_t)sha_info->digest[3];
+    ABCD0 = ABCD = vld1q_u32(state);
+    E0 = E = (uint32_t)sha_info->digest[4];
+
+    ARMV8_LOAD(0);
+    ARMV8_LOAD(1);
+    ARMV8_LOAD(2);
+    ARMV8_LOAD(3);
     /* clang-format off */
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    ARMV8_ROUNDS(0, vsha1cq_u32, CONST1);
+    ARMV8_ROUNDS(1, vsha1cq_u32, CONST1);
+    ARMV8_ROUNDS(2, vsha1cq_u32, CONST1);
+    ARMV8_ROUNDS(3, vsha1cq_u32, CONST1);
+    ARMV8_SCHEDULE(4);  ARMV8_ROUNDS(4, vsha1cq_u32, CONST1);
+    ARMV8_SCHEDULE(5);  ARMV8_ROUNDS(5, vsha1pq_u32, CONST2);
+    ARMV8_SCHEDULE(6);  ARMV8_ROUNDS(6, vsha1pq_u32, CONST2);
+    ARMV8_SCHEDULE(7);  ARMV8_ROUNDS(7, vsha1pq_u32, CONST2);
+    ARMV8_SCHEDULE(8);  ARMV8_ROUNDS(8, vsha1pq_u32, CONST2);
+    ARMV8_SCHEDULE(9);  ARMV8_ROUNDS(9, vsha1pq_u32, CONST2);
+    ARMV8_SCHEDULE(10); ARMV8_ROUNDS(10, vsha1mq_u32, CONST3);
+    ARMV8_SCHEDULE(11); ARMV8_ROUNDS(11, vsha1mq_u32, CONST3);
+    ARMV8_SCHEDULE(12); ARMV8_ROUNDS(12, vsha1mq_u32, CONST3);
+    ARMV8_SCHEDULE(13); ARMV8_ROUNDS(13, vsha1mq_u32, CONST3);
+    ARMV8_SCHEDULE(14); ARMV8_ROUNDS(14, vsha1mq_u32, CONST3);
+    ARMV8_SCHEDULE(15); ARMV8_ROUNDS(15, vsha1pq_u32, CONST4);
+    ARMV8_SCHEDULE(16); ARMV8_ROUNDS(16, vsha1pq_u32, CONST4);
+    ARMV8_SCHEDULE(17); ARMV8_ROUNDS(17, vsha1pq_u32, CONST4);
+    ARMV8_SCHEDULE(18); ARMV8_ROUNDS(18, vsha1pq_u32, CONST4);
+    ARMV8_SCHEDULE(19); ARMV8_ROUNDS(19, vsha1pq_u32, CONST4);
     /* clang-format on */
+    ABCD = vaddq_u32(ABCD, ABCD0);
+
+    vst1q_u32(state, ABCD);
+    sha_info->digest[0] = state[0];
+    sha_info->digest[1] = state[1];
+    sha_info->digest[2] = state[2];
+    sha_info->digest[3] = state[3];
+    sha_info->digest[4] = T32(E + E0);
+}
+
+static int sha_armv8_available(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+#endif
+
+/* Multi-lane compression function: runs one block through up to
+   SRS_HMAC_LANES independent SHA states at once. The state and message
+   words are stored transposed, with one lane per column. */
+
+typedef uint32_t sha_lanes_state_t[5][SRS_HMAC_LANES];
+typedef uint32_t sha_lanes_block_t[16][SRS_HMAC_LANES];
+
+#ifdef __GNUC__
+typedef uint32_t sha_lanes_t
+    __attribute__((vector_size(SRS_HMAC_LANES * sizeof(uint32_t))));
+
+#    if defined(__clang__) || __GNUC__ >= 8
+#        define LANES_UNROLL _Pragma("GCC unroll 20")
 #    else
+#        define LANES_UNROLL
+#    endif
+
+#    define LANES_R32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#    define LANES_ROUND(i, f, K)                                             \
+        if ((i) >= 16)                                                       \
+        {                                                                    \
+            T = W[((i) + 13) & 15] ^ W[((i) + 8) & 15] ^ W[((i) + 2) & 15]   \
+                ^ W[(i) & 15];                                               \
+            W[(i) & 15] = LANES_R32(T, 1);                                   \
+        }                                                                    \
+        T = LANES_R32(A, 5) + f(B, C, D) + E + W[(i) & 15] + (uint32_t)(K); \
+        E = D;                                                               \
+        D = C;                                                               \
+        C = LANES_R32(B, 30);                                                \
+        B = A;                                                               \
+        A = T
+
+/* Always inlined, so the compiler can emit it once per target ISA */
+static inline __attribute__((always_inline)) void
+sha_lanes_rounds(sha_lanes_state_t state, sha_lanes_block_t block)
+{
+    sha_lanes_t A, B, C, D, E, T, W[16];
+    int i;
+
+    memcpy(&A, state[0], sizeof(A));
+    memcpy(&B, state[1], sizeof(B));
+    memcpy(&C, state[2], sizeof(C));
+    memcpy(&D, state[3], sizeof(D));
+    memcpy(&E, state[4], sizeof(E));
+    memcpy(W, block, sizeof(W));
+    LANES_UNROLL
     for (i = 0; i < 20; ++i)
     {
-        FG(1);
+        LANES_ROUND(i, f1, CONST1);
     }
-    for (i = 20; i < 40; ++i)
+    LANES_UNROLL
+    for (; i < 40; ++i)
     {
-        FG(2);
+        LANES_ROUND(i, f2, CONST2);
     }
-    for (i = 40; i < 60; ++i)
+    LANES_UNROLL
+    for (; i < 60; ++i)
     {
-        FG(3);
+        LANES_ROUND(i, f3, CONST3);
     }
-    for (i = 60; i < 80; ++i)
+    LANES_UNROLL
+    for (; i < 80; ++i)
     {
-        FG(4);
+        LANES_ROUND(i, f4, CONST4);
     }
+    memcpy(&T, state[0], sizeof(T));
+    A += T;
+    memcpy(state[0], &A, sizeof(A));
+    memcpy(&T, state[1], sizeof(T));
+    B += T;
+    memcpy(state[1], &B, sizeof(B));
+    memcpy(&T, state[2], sizeof(T));
+    C += T;
+    memcpy(state[2], &C, sizeof(C));
+    memcpy(&T, state[3], sizeof(T));
+    D += T;
+    memcpy(state[3], &D, sizeof(D));
+    memcpy(&T, state[4], sizeof(T));
+    E += T;
+    memcpy(state[4], &E, sizeof(E));
+}
+
+static void sha_lanes_transform_generic(sha_lanes_state_t state,
+                                        sha_lanes_block_t block)
+{
+    sha_lanes_rounds(state, block);
+}
+
+#    ifdef SHA_X86
+ATTRIBUTE_TARGET("avx2")
+static void sha_lanes_transform_avx2(sha_lanes_state_t state,
+                                     sha_lanes_block_t block)
+{
+    sha_lanes_rounds(state, block);
+}
+
+static int sha_avx2_available(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
 #    endif
-    sha_info->digest[0] = T32(sha_info->digest[0] + A);
-    sha_info->digest[1] = T32(sha_info->digest[1] + B);
-    sha_info->digest[2] = T32(sha_info->digest[2] + C);
-    sha_info->digest[3] = T32(sha_info->digest[3] + D);
-    sha_info->digest[4] = T32(sha_info->digest[4] + E);
+#else
+static void sha_lanes_transform_generic(sha_lanes_state_t state,
+                                        sha_lanes_block_t block)
+{
+    SHA_INFO sha_info;
+    uint32_t W[80];
+    int lane, i;
+
+    for (lane = 0; lane < SRS_HMAC_LANES; ++lane)
+    {
+        for (i = 0; i < 16; ++i)
+            W[i] = block[i][lane];
+        for (i = 16; i < 80; ++i)
+            W[i] = R32((W[i - 3] ^ W[i - 8] ^ W[i - 14] ^ W[i - 16]), 1);
+        for (i = 0; i < 5; ++i)
+            sha_info.digest[i] = state[i][lane];
+        sha_rounds(&sha_info, W);
+        for (i = 0; i < 5; ++i)
+            state[i][lane] = sha_info.digest[i];
+    }
+}
+#endif
+
+/* runtime dispatch of the compression function */
+
+typedef void (*sha_transform_t)(SHA_INFO*);
+typedef void (*sha_lanes_transform_t)(sha_lanes_state_t, sha_lanes_block_t);
+
+static const struct
+{
+    const char* name;
+    sha_transform_t transform;
+    int (*available)(void);
+} sha_backends[SHA_NUM_BACKENDS] = {
+    {"portable", sha_transform_portable, NULL},
+#ifdef SHA_X86
+    {"ssse3", sha_transform_ssse3, sha_ssse3_available},
+    {"sha-ni", sha_transform_shani, sha_shani_available},
+#else
+    {"ssse3", NULL, NULL},
+    {"sha-ni", NULL, NULL},
 #endif
+#ifdef SHA_ARMV8
+    {"armv8", sha_transform_armv8, sha_armv8_available},
+#else
+    {"armv8", NULL, NULL},
+#endif
+};
+
+static void sha_transform_detect(SHA_INFO* sha_info);
+static void sha_lanes_transform_detect(sha_lanes_state_t state,
+                                       sha_lanes_block_t block);
+
+/* The backend is selected on first use, which happens while the
+   configuration is loaded and before any worker threads exist. */
+static sha_transform_t sha_transform = sha_transform_detect;
+static sha_lanes_transform_t sha_lanes_transform = sha_lanes_transform_detect;
+static int sha_backend = SHA_BACKEND_PORTABLE;
+
+int sha_backend_available(int backend)
+{
+    if (backend < 0 || backend >= SHA_NUM_BACKENDS)
+        return 0;
+    if (sha_backends[backend].transform == NULL)
+        return 0;
+    return sha_backends[backend].available == NULL
+           || sha_backends[backend].available();
+}
+
+int sha_set_backend(int backend)
+{
+    if (backend == SHA_BACKEND_AUTO)
+    {
+        /* Prefer the fastest backend, which is listed last */
+        for (backend = SHA_NUM_BACKENDS - 1; backend > 0; --backend)
+        {
+            if (sha_backend_available(backend))
+                break;
+        }
+    }
+    if (!sha_backend_available(backend))
+        return 0;
+    sha_backend = backend;
+    sha_transform = sha_backends[backend].transform;
+    /* Selecting the portable backend also disables AVX2 for the
+       multi-lane HMAC, so both code paths can be tested */
+    sha_lanes_transform = sha_lanes_transform_generic;
+#if defined(__GNUC__) && defined(SHA_X86)
+    if (backend != SHA_BACKEND_PORTABLE && sha_avx2_available())
+        sha_lanes_transform = sha_lanes_transform_avx2;
+#endif
+    return 1;
+}
+
+int sha_get_backend(void)
+{
+    if (sha_transform == sha_transform_detect)
+        sha_set_backend(SHA_BACKEND_AUTO);
+    return sha_backend;
+}
+
+const char* sha_backend_name(int backend)
+{
+    if (backend < 0 || backend >= SHA_NUM_BACKENDS)
+        return NULL;
+    return sha_backends[backend].name;
+}
+
+static void sha_transform_detect(SHA_INFO* sha_info)
+{
+    sha_set_backend(SHA_BACKEND_AUTO);
+    sha_transform(sha_info);
+}
+
+static void sha_lanes_transform_detect(sha_lanes_state_t state,
+                                       sha_lanes_block_t block)
+{
+    sha_set_backend(SHA_BACKEND_AUTO);
+    sha_lanes_transform(state, block);
 }
 
 /* initialize the SHA digest */
@@ -383,9 +843,21 @@ void sha_digest(char* out, const char* data, unsigned len)
     sha_final((sha_byte*)out, &ctx);
 }
 
-void srs_hmac_init(srs_hmac_ctx_t* ctx, char* secret, unsigned len)
+/* resume a SHA digest from a state after exactly one block */
+static void sha_resume(SHA_INFO* sha_info, const ULONG digest[5])
+{
+    memcpy(sha_info->digest, digest, sizeof(sha_info->digest));
+    sha_info->count_lo = (ULONG)SHA_BLOCKSIZE << 3;
+    sha_info->count_hi = 0L;
+    sha_info->local = 0;
+}
+
+void srs_hmac_key_init(srs_hmac_key_t* key, const char* secret, unsigned len)
 {
     char sbuf[SHA_BLOCKSIZE];
+    sha_byte ipad[SHA_BLOCKSIZE];
+    sha_byte opad[SHA_BLOCKSIZE];
+    SHA_INFO sctx;
     unsigned i;
 
     if (len > SHA_BLOCKSIZE)
@@ -395,18 +867,40 @@ void srs_hmac_init(srs_hmac_ctx_t* ctx, char* secret, unsigned len)
         len = SHA_DIGESTSIZE;
     }
 
-    memset(ctx->ipad, 0x36, SHA_BLOCKSIZE);
-    memset(ctx->opad, 0x5c, SHA_BLOCKSIZE);
+    memset(ipad, 0x36, SHA_BLOCKSIZE);
+    memset(opad, 0x5c, SHA_BLOCKSIZE);
     for (i = 0; i < len; i++)
     {
-        ctx->ipad[i] ^= secret[i];
-        ctx->opad[i] ^= secret[i];
+        ipad[i] ^= secret[i];
+        opad[i] ^= secret[i];
     }
 
+    sha_init(&sctx);
+    sha_update(&sctx, ipad, SHA_BLOCKSIZE);
+    memcpy(key->inner, sctx.digest, sizeof(key->inner));
+    sha_init(&sctx);
+    sha_update(&sctx, opad, SHA_BLOCKSIZE);
+    memcpy(key->outer, sctx.digest, sizeof(key->outer));
+
     memset(sbuf, 0, SHA_BLOCKSIZE);
+    memset(ipad, 0, SHA_BLOCKSIZE);
+    memset(opad, 0, SHA_BLOCKSIZE);
+    memset(&sctx, 0, sizeof(sctx));
+}
 
-    sha_init(&ctx->sctx);
-    sha_update(&ctx->sctx, (sha_byte*)ctx->ipad, SHA_BLOCKSIZE);
+void srs_hmac_init_key(srs_hmac_ctx_t* ctx, const srs_hmac_key_t* key)
+{
+    sha_resume(&ctx->sctx, key->inner);
+    memcpy(ctx->outer, key->outer, sizeof(ctx->outer));
+}
+
+void srs_hmac_init(srs_hmac_ctx_t* ctx, char* secret, unsigned len)
+{
+    srs_hmac_key_t key;
+
+    srs_hmac_key_init(&key, secret, len);
+    srs_hmac_init_key(ctx, &key);
+    memset(&key, 0, sizeof(key));
 }
 
 void srs_hmac_update(srs_hmac_ctx_t* ctx, char* data, unsigned len)
@@ -419,8 +913,134 @@ void srs_hmac_fini(srs_hmac_ctx_t* ctx, char* out)
     sha_byte buf[SHA_DIGESTSIZE + 1];
 
     sha_final(buf, &ctx->sctx);
-    sha_init(&ctx->sctx);
-    sha_update(&ctx->sctx, (sha_byte*)ctx->opad, SHA_BLOCKSIZE);
+    sha_resume(&ctx->sctx, ctx->outer);
     sha_update(&ctx->sctx, buf, SHA_DIGESTSIZE);
     sha_final((sha_byte*)out, &ctx->sctx);
 }
+
+/* Multi-lane HMAC: the message is shared by all lanes, only the key
+   states differ */
+
+unsigned srs_hmac_multi_min_keys(void)
+{
+    /* Dedicated SHA instructions outrun a multi-lane pass unless most
+       lanes are in use */
+    int backend = sha_get_backend();
+    if (backend == SHA_BACKEND_SHANI || backend == SHA_BACKEND_ARMV8)
+        return 6;
+    return 2;
+}
+
+static void srs_hmac_multi_block(srs_hmac_multi_ctx_t* ctx)
+{
+    sha_lanes_block_t block;
+    const sha_byte* dp = ctx->sctx.data;
+    uint32_t w;
+    int i, lane;
+
+    for (i = 0; i < 16; ++i, dp += 4)
+    {
+        w = ((uint32_t)dp[0] << 24) | ((uint32_t)dp[1] << 16)
+            | ((uint32_t)dp[2] << 8) | (uint32_t)dp[3];
+        for (lane = 0; lane < SRS_HMAC_LANES; ++lane)
+            block[i][lane] = w;
+    }
+    sha_lanes_transform(ctx->inner, block);
+}
+
+void srs_hmac_multi_init(srs_hmac_multi_ctx_t* ctx, const srs_hmac_key_t* keys,
+                         unsigned num_keys)
+{
+    unsigned i, lane;
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (num_keys > SRS_HMAC_LANES)
+        num_keys = SRS_HMAC_LANES;
+    ctx->num_keys = num_keys;
+    for (lane = 0; lane < num_keys; ++lane)
+    {
+        for (i = 0; i < 5; ++i)
+        {
+            ctx->inner[i][lane] = (uint32_t)keys[lane].inner[i];
+            ctx->outer[i][lane] = (uint32_t)keys[lane].outer[i];
+        }
+    }
+    ctx->sctx.count_lo = (ULONG)SHA_BLOCKSIZE << 3;
+}
+
+void srs_hmac_multi_update(srs_hmac_multi_ctx_t* ctx, const char* data,
+                           unsigned len)
+{
+    SHA_INFO* sctx = &ctx->sctx;
+    ULONG clo;
+    unsigned n;
+
+    clo = T32(sctx->count_lo + ((ULONG)len << 3));
+    if (clo < sctx->count_lo)
+    {
+        ++sctx->count_hi;
+    }
+    sctx->count_lo = clo;
+    sctx->count_hi += (ULONG)len >> 29;
+    while (len > 0)
+    {
+        n = SHA_BLOCKSIZE - sctx->local;
+        if (n > len)
+            n = len;
+        memcpy(sctx->data + sctx->local, data, n);
+        sctx->local += n;
+        data += n;
+        len -= n;
+        if (sctx->local == SHA_BLOCKSIZE)
+        {
+            srs_hmac_multi_block(ctx);
+            sctx->local = 0;
+        }
+    }
+}
+
+void srs_hmac_multi_fini(srs_hmac_multi_ctx_t* ctx, char* out)
+{
+    SHA_INFO* sctx = &ctx->sctx;
+    sha_lanes_block_t block;
+    ULONG lo_bit_count = sctx->count_lo;
+    ULONG hi_bit_count = sctx->count_hi;
+    unsigned i, lane;
+
+    sctx->data[sctx->local++] = 0x80;
+    if (sctx->local > SHA_BLOCKSIZE - 8)
+    {
+        memset(sctx->data + sctx->local, 0, SHA_BLOCKSIZE - sctx->local);
+        srs_hmac_multi_block(ctx);
+        sctx->local = 0;
+    }
+    memset(sctx->data + sctx->local, 0, SHA_BLOCKSIZE - 8 - sctx->local);
+    for (i = 0; i < 4; ++i)
+    {
+        sctx->data[56 + i] = (hi_bit_count >> (24 - 8 * i)) & 0xff;
+        sctx->data[60 + i] = (lo_bit_count >> (24 - 8 * i)) & 0xff;
+    }
+    srs_hmac_multi_block(ctx);
+
+    /* The outer hash processes the padded inner digest of each lane */
+    memset(block, 0, sizeof(block));
+    memcpy(block, ctx->inner, sizeof(ctx->inner));
+    for (lane = 0; lane < SRS_HMAC_LANES; ++lane)
+    {
+        block[5][lane] = 0x80000000;
+        block[15][lane] = (SHA_BLOCKSIZE + SHA_DIGESTSIZE) << 3;
+    }
+    sha_lanes_transform(ctx->outer, block);
+
+    for (lane = 0; lane < ctx->num_keys; ++lane)
+    {
+        for (i = 0; i < 5; ++i)
+        {
+            *out++ = (char)((ctx->outer[i][lane] >> 24) & 0xff);
+            *out++ = (char)((ctx->outer[i][lane] >> 16) & 0xff);
+            *out++ = (char)((ctx->outer[i][lane] >> 8) & 0xff);
+            *out++ = (char)(ctx->outer[i][lane] & 0xff);
+        }
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
@@ -7,12 +7,24 @@
 #ifndef SHA1_H
 #define SHA1_H
 
+#include <stdint.h>
+
 typedef unsigned long ULONG; /* 32-or-more-bit quantity */
 typedef unsigned char sha_byte;
 
 #define SHA_BLOCKSIZE  64
 #define SHA_DIGESTSIZE 20
 
+#define SHA_BACKEND_AUTO     -1
+#define SHA_BACKEND_PORTABLE 0
+#define SHA_BACKEND_SSSE3    1
+#define SHA_BACKEND_SHANI    2
+#define SHA_BACKEND_ARMV8    3
+#define SHA_NUM_BACKENDS     4
+
+/* number of keys processed by one multi-lane HMAC */
+#define SRS_HMAC_LANES 8
+
 typedef struct
 {
     ULONG digest[5];              /* message digest */
@@ -21,16 +33,46 @@ typedef struct
     int local;                    /* unprocessed amount in data */
 } SHA_INFO;
 
+/* SHA states after the inner and outer key blocks have been processed.
+   They only depend on the secret and can be reused for every HMAC. */
+typedef struct _srs_hmac_key_t
+{
+    ULONG inner[5];
+    ULONG outer[5];
+} srs_hmac_key_t;
+
 typedef struct _srs_hmac_ctx_t
 {
     SHA_INFO sctx;
-    char ipad[SHA_BLOCKSIZE + 1];
-    char opad[SHA_BLOCKSIZE + 1];
+    ULONG outer[5];
 } srs_hmac_ctx_t;
 
+/* HMAC of one message under up to SRS_HMAC_LANES keys. The key states are
+   stored transposed so that each word of all lanes is contiguous. */
+typedef struct _srs_hmac_multi_ctx_t
+{
+    SHA_INFO sctx; /* shared message buffer and bit count */
+    uint32_t inner[5][SRS_HMAC_LANES];
+    uint32_t outer[5][SRS_HMAC_LANES];
+    unsigned num_keys;
+} srs_hmac_multi_ctx_t;
+
+int sha_backend_available(int backend);
+int sha_set_backend(int backend);
+int sha_get_backend(void);
+const char* sha_backend_name(int backend);
+
 void sha_digest(char* out, const char* data, unsigned len);
+void srs_hmac_key_init(srs_hmac_key_t* key, const char* secret, unsigned len);
+void srs_hmac_init_key(srs_hmac_ctx_t* ctx, const srs_hmac_key_t* key);
 void srs_hmac_init(srs_hmac_ctx_t* ctx, char* secret, unsigned len);
 void srs_hmac_update(srs_hmac_ctx_t* ctx, char* data, unsigned len);
 void srs_hmac_fini(srs_hmac_ctx_t* ctx, char* out);
+unsigned srs_hmac_multi_min_keys(void);
+void srs_hmac_multi_init(srs_hmac_multi_ctx_t* ctx, const srs_hmac_key_t* keys,
+                         unsigned num_keys);
+void srs_hmac_multi_update(srs_hmac_multi_ctx_t* ctx, const char* data,
+                           unsigned len);
+void srs_hmac_multi_fini(srs_hmac_multi_ctx_t* ctx, char* out);
 
 #endif
@@ -0,0 +1,526 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "socketmap.h"
+
+#include "metrics.h"
+#include "milter.h"
+#include "netstring.h"
+#include "postsrsd_build_config.h"
+#include "srs.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#    include <sys/epoll.h>
+#endif
+#ifdef HAVE_TIME_H
+#    include <time.h>
+#endif
+
+#define PAYLOAD_SIZE MILTER_PAYLOAD_SIZE
+
+static size_t make_response(char* response, size_t size, const char* status,
+                            const char* info)
+{
+    char* eob = response;
+    char* end = response + size;
+    while (*status != 0 && eob < end)
+        *eob++ = *status++;
+    while (info != NULL && *info != 0 && eob < end)
+        *eob++ = *info++;
+    return eob - response;
+}
+
+size_t socketmap_process_request(postsrsd_t* state, database_t* db,
+                                 char* request, size_t len, char* response,
+                                 size_t size, bool* close_connection,
+                                 bool* needs_commit)
+{
+    char* addr;
+    bool error;
+    *close_connection = false;
+    *needs_commit = false;
+    char* query_type = strtok_r(request, " ", &addr);
+    if (query_type == NULL)
+    {
+        log_error("invalid socketmap query, closing connection");
+        *close_connection = true;
+        return make_response(response, size, "PERM Invalid query.", NULL);
+    }
+    if (len > PAYLOAD_SIZE + (size_t)(addr - request))
+    {
+        log_warn("socketmap query is too big");
+        return make_response(response, size, "PERM Too big.", NULL);
+    }
+    const bool always_rewrite = cfg_getbool(state->cfg, "always-rewrite");
+    char* rewritten = NULL;
+    const char* info = NULL;
+    if (strcmp(query_type, "forward") == 0)
+    {
+        rewritten = postsrsd_forward_into(
+            response + 3, size - 3, addr, state->srs_domain, state->srs, db,
+            always_rewrite ? NULL : state->local_domains, &error, &info,
+            "socketmap");
+        /* The envelope may still be pending in a database batch */
+        *needs_commit = rewritten != NULL && db != NULL;
+    }
+    else if (strcmp(query_type, "reverse") == 0)
+    {
+        rewritten = postsrsd_reverse_into(response + 3, size - 3, addr,
+                                          state->srs, db, &error, &info,
+                                          "socketmap");
+    }
+    else
+    {
+        error = true;
+        info = "Invalid map.";
+        log_warn("invalid key in socketmap query");
+    }
+    /* The rewritten address has been stored in the response buffer already,
+       right after the status. */
+    if (rewritten)
+    {
+        memcpy(response, "OK ", 3);
+        return 3 + strlen(rewritten);
+    }
+    return make_response(response, size, error ? "PERM " : "NOTFOUND ", info);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Connections that wait for their next query are kept on a timer wheel with
+   one slot per second. With keep-alive timeouts longer than the wheel
+   circumference, a connection is simply skipped until its deadline is
+   reached in a later round. */
+#    define TIMER_WHEEL_SLOTS 64
+#    define MAX_EVENTS        64
+#    define MAX_LISTENERS     16
+
+/* Once the worker has been told to stop, it no longer accepts connections,
+   but keeps serving the open ones until they have been idle for this many
+   seconds, or the keep-alive time has passed. */
+#    define DRAIN_IDLE_TIMEOUT 1
+
+struct connection
+{
+    int fd;
+    bool listening;
+    bool closing;
+    bool eof;
+    unsigned events;
+    time_t deadline;
+    struct connection* prev;
+    struct connection* next;
+    size_t out_pos;
+    size_t out_len;
+    size_t commit_pos;
+    unsigned commit_replies;
+    char out[NETSTRING_READER_SIZE];
+    netstring_reader_t in;
+};
+
+struct timer_wheel
+{
+    time_t now;
+    time_t expired;
+    struct connection* slots[TIMER_WHEEL_SLOTS];
+};
+
+static time_t monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void timer_wheel_remove(struct timer_wheel* T, struct connection* c)
+{
+    if (c->deadline == 0)
+        return;
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        T->slots[c->deadline % TIMER_WHEEL_SLOTS] = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+    c->deadline = 0;
+}
+
+static void timer_wheel_insert(struct timer_wheel* T, struct connection* c,
+                               int timeout)
+{
+    timer_wheel_remove(T, c);
+    /* A keep-alive timeout of zero disables the timeout, but we still keep
+       track of the connection */
+    c->deadline = T->now + (timeout > 0 ? timeout : 0x3fffffff);
+    struct connection** slot = &T->slots[c->deadline % TIMER_WHEEL_SLOTS];
+    c->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = c;
+    *slot = c;
+}
+
+static void close_connection(int epfd, struct timer_wheel* T,
+                             struct connection* c, size_t* num_connections)
+{
+    timer_wheel_remove(T, c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+    --*num_connections;
+}
+
+static bool watch_connection(int epfd, struct connection* c, unsigned events)
+{
+    struct epoll_event ev;
+    if (c->events == events)
+        return true;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, c->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd,
+                  &ev)
+        < 0)
+    {
+        log_perror(errno, "epoll_ctl");
+        return false;
+    }
+    c->events = events;
+    return true;
+}
+
+static bool append_response(struct connection* c, const char* data,
+                            size_t length)
+{
+    size_t encoded_length;
+    if (c->out_pos == c->out_len)
+        c->out_pos = c->out_len = 0;
+    if (netstring_encode(data, length, c->out + c->out_len,
+                         sizeof(c->out) - c->out_len, &encoded_length)
+        == NULL)
+        return false;
+    c->out_len += encoded_length;
+    return true;
+}
+
+static bool flush_responses(struct connection* c)
+{
+    while (c->out_pos < c->out_len)
+    {
+        ssize_t written =
+            send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, 0);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_pos += written;
+    }
+    c->out_pos = c->out_len = 0;
+    return true;
+}
+
+static bool process_requests(postsrsd_t* state, database_t* db,
+                             struct timer_wheel* T, struct connection* c,
+                             int keep_alive)
+{
+    /* Returns true if we stopped because the output buffer is full and
+       there may be more buffered requests. */
+    char response[SOCKETMAP_REQUEST_SIZE];
+    if (c->out_pos == c->out_len)
+        c->out_pos = c->out_len = 0;
+    for (;;)
+    {
+        if (c->closing)
+            return false;
+        if (sizeof(c->out) - c->out_len < SOCKETMAP_REQUEST_SIZE + 8)
+            return true;
+        size_t len;
+        char* request =
+            netstring_reader_next(&c->in, SOCKETMAP_REQUEST_SIZE, &len);
+        if (request == NULL)
+        {
+            if (len != 0)
+            {
+                if (c->commit_replies > 0)
+                    ++c->commit_replies;
+                append_response(c, "PERM Invalid query.", 19);
+                log_error("invalid socketmap query, closing connection");
+                c->closing = true;
+            }
+            return false;
+        }
+        bool needs_commit;
+        size_t n = socketmap_process_request(state, db, request, len, response,
+                                             sizeof(response), &c->closing,
+                                             &needs_commit);
+        if (needs_commit && c->commit_replies == 0)
+            c->commit_pos = c->out_len;
+        if (c->commit_replies > 0 || needs_commit)
+            ++c->commit_replies;
+        append_response(c, response, n);
+        timer_wheel_insert(T, c, keep_alive);
+    }
+}
+
+static void commit_responses(database_t* db, struct connection* c)
+{
+    /* If the envelopes cannot be committed, the rewritten addresses must
+       not reach the client. All replies from the first one which depends
+       on the failed batch are replaced with temporary failures. */
+    unsigned n = c->commit_replies;
+    c->commit_replies = 0;
+    if (database_flush(db) || n == 0)
+        return;
+    c->out_len = c->commit_pos;
+    while (n-- > 0)
+    {
+        if (!append_response(c, SOCKETMAP_TEMP_FAILURE,
+                             sizeof(SOCKETMAP_TEMP_FAILURE) - 1))
+        {
+            c->closing = true;
+            break;
+        }
+    }
+}
+
+static void accept_connections(int epfd, struct timer_wheel* T, int fd,
+                               size_t* num_connections,
+                               size_t connection_limit, int keep_alive)
+{
+    for (;;)
+    {
+        int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_perror(errno, "accept");
+            return;
+        }
+        if (*num_connections >= connection_limit)
+        {
+            log_warn("connection limit reached");
+            metrics_inc(METRIC_CONNECTION_REJECTED);
+            close(conn);
+            continue;
+        }
+        metrics_inc(METRIC_CONNECTION_ACCEPTED);
+        struct connection* c = malloc(sizeof(struct connection));
+        if (c == NULL)
+        {
+            log_error("out of memory");
+            close(conn);
+            return;
+        }
+        c->fd = conn;
+        c->listening = false;
+        c->closing = false;
+        c->eof = false;
+        c->events = 0;
+        c->deadline = 0;
+        c->prev = c->next = NULL;
+        c->out_pos = c->out_len = 0;
+        c->commit_pos = 0;
+        c->commit_replies = 0;
+        netstring_reader_init(&c->in);
+        if (!watch_connection(epfd, c, EPOLLIN))
+        {
+            close(conn);
+            free(c);
+            continue;
+        }
+        ++*num_connections;
+        timer_wheel_insert(T, c, keep_alive);
+    }
+}
+
+static void drain_connections(struct timer_wheel* T, int idle_timeout)
+{
+    struct connection* drained = NULL;
+    for (time_t t = 0; t < TIMER_WHEEL_SLOTS; ++t)
+    {
+        while (T->slots[t] != NULL)
+        {
+            struct connection* c = T->slots[t];
+            timer_wheel_remove(T, c);
+            c->next = drained;
+            drained = c;
+        }
+    }
+    while (drained != NULL)
+    {
+        struct connection* c = drained;
+        drained = c->next;
+        c->next = NULL;
+        timer_wheel_insert(T, c, idle_timeout);
+    }
+}
+
+static void expire_connections(int epfd, struct timer_wheel* T,
+                               size_t* num_connections)
+{
+    /* The slots are scanned from the last expired tick, which lags behind
+       T->now, because that is also updated after every epoll_wait() */
+    time_t now = monotonic_seconds();
+    time_t t = T->expired;
+    if (now - t > TIMER_WHEEL_SLOTS)
+        t = now - TIMER_WHEEL_SLOTS;
+    T->now = now;
+    T->expired = now;
+    while (t < now)
+    {
+        ++t;
+        struct connection* c = T->slots[t % TIMER_WHEEL_SLOTS];
+        while (c != NULL)
+        {
+            struct connection* next = c->next;
+            if (c->deadline <= now)
+                close_connection(epfd, T, c, num_connections);
+            c = next;
+        }
+    }
+}
+
+bool socketmap_serve_events(postsrsd_t* state, database_t* db,
+                            bool (*keep_running)())
+{
+    int keep_alive = cfg_getint(state->cfg, "keep-alive");
+    struct connection listeners[MAX_LISTENERS];
+    struct pollfd fds[MAX_LISTENERS];
+    struct epoll_event events[MAX_EVENTS];
+    struct timer_wheel T;
+    size_t num_connections = 0;
+    time_t drain_deadline = 0;
+    bool ok = false;
+    memset(&T, 0, sizeof(T));
+    T.now = monotonic_seconds();
+    T.expired = T.now;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        log_perror(errno, "epoll_create1");
+        return false;
+    }
+    size_t num_listeners =
+        endpoint_prepare_poll(state->socketmap, fds, MAX_LISTENERS);
+    for (size_t i = 0; i < num_listeners; ++i)
+    {
+        listeners[i].fd = fds[i].fd;
+        listeners[i].listening = true;
+        listeners[i].events = 0;
+        if (!watch_connection(epfd, &listeners[i], EPOLLIN))
+            goto done;
+    }
+    for (;;)
+    {
+        if (drain_deadline == 0 && !keep_running())
+        {
+            for (size_t i = 0; i < num_listeners; ++i)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, listeners[i].fd, NULL);
+            drain_deadline = T.now + (keep_alive > 0 ? keep_alive : 0x3fffffff);
+            keep_alive = DRAIN_IDLE_TIMEOUT;
+            drain_connections(&T, keep_alive);
+        }
+        if (drain_deadline != 0
+            && (num_connections == 0 || T.now >= drain_deadline))
+            break;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_perror(errno, "epoll_wait");
+            goto done;
+        }
+        T.now = monotonic_seconds();
+        for (int i = 0; i < n; ++i)
+        {
+            struct connection* c = events[i].data.ptr;
+            if (c->listening)
+            {
+                accept_connections(epfd, &T, c->fd, &num_connections,
+                                   state->connection_limit, keep_alive);
+                continue;
+            }
+            if (!c->eof && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                ssize_t r = netstring_reader_fill(&c->in, c->fd);
+                /* A client may shut down its end of the connection right
+                   after its last request, so the buffered requests are still
+                   answered before the connection is closed. */
+                if (r == 0)
+                    c->eof = true;
+                else if (r < 0 && errno != EINTR && errno != EAGAIN
+                         && errno != EWOULDBLOCK)
+                {
+                    close_connection(epfd, &T, c, &num_connections);
+                    continue;
+                }
+            }
+            bool more, flushed;
+            do
+            {
+                more = process_requests(state, db, &T, c, keep_alive);
+                commit_responses(db, c);
+                flushed = flush_responses(c);
+            } while (flushed && more && c->out_len == 0);
+            if (!flushed || ((c->closing || c->eof) && c->out_len == 0))
+            {
+                close_connection(epfd, &T, c, &num_connections);
+                continue;
+            }
+            /* Stop reading while responses are still pending, so that a
+               client which does not read its replies cannot make us buffer
+               an unbounded amount of data. */
+            if (!watch_connection(epfd, c,
+                                  c->out_len != 0 ? EPOLLOUT : EPOLLIN))
+                close_connection(epfd, &T, c, &num_connections);
+        }
+        expire_connections(epfd, &T, &num_connections);
+    }
+    ok = true;
+done:
+    for (time_t t = 0; t < TIMER_WHEEL_SLOTS; ++t)
+    {
+        while (T.slots[t] != NULL)
+            close_connection(epfd, &T, T.slots[t], &num_connections);
+    }
+    close(epfd);
+    return ok;
+}
+
+#else
+
+bool socketmap_serve_events(postsrsd_t* state, database_t* db,
+                            bool (*keep_running)())
+{
+    MAYBE_UNUSED(state);
+    MAYBE_UNUSED(db);
+    MAYBE_UNUSED(keep_running);
+    log_error("event-driven socketmap engine is not supported on this system");
+    return false;
+}
+
+#endif
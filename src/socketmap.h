@@ -0,0 +1,37 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SOCKETMAP_H
+#define SOCKETMAP_H
+
+#include "database.h"
+#include "main.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SOCKETMAP_REQUEST_SIZE 1024
+
+#define SOCKETMAP_TEMP_FAILURE "TEMP Database error."
+
+size_t socketmap_process_request(postsrsd_t* state, database_t* db,
+                                 char* request, size_t len, char* response,
+                                 size_t size, bool* close_connection,
+                                 bool* needs_commit);
+bool socketmap_serve_events(postsrsd_t* state, database_t* db,
+                            bool (*keep_running)());
+
+#endif
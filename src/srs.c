@@ -16,15 +16,16 @@
  */
 #include "srs.h"
 
+#include "metrics.h"
 #include "sha1.h"
 #include "util.h"
 
-#include <ctype.h>
 #include <string.h>
 
-char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
-                       database_t* db, domain_set_t* local_domains, bool* error,
-                       const char** info, const char* queue_id)
+static char* forward_address(char* buf, size_t bufsize, const char* addr,
+                             const char* domain, srs_t* srs, database_t* db,
+                             domain_set_t* local_domains, bool* error,
+                             const char** info, const char* queue_id)
 {
     if (addr == NULL)
         return NULL;
@@ -39,6 +40,7 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
     {
         if (info != NULL)
             *info = "No domain.";
+        metrics_inc(METRIC_FORWARD_NO_DOMAIN);
         log_debug("%s: <%s> not rewritten: no domain", queue_id, addr);
         return NULL;
     }
@@ -50,6 +52,7 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
             *error = true;
         if (info != NULL)
             *info = "Configuration error.";
+        metrics_inc(METRIC_FORWARD_ERROR);
         return NULL;
     }
     const char* input_domain = at + 1;
@@ -57,6 +60,7 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
     {
         if (info != NULL)
             *info = "Need not rewrite local domain.";
+        metrics_inc(METRIC_FORWARD_LOCAL_DOMAIN);
         log_debug("%s: <%s> not rewritten: local domain", queue_id, addr);
         return NULL;
     }
@@ -65,9 +69,10 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
     const char* sender = addr;
     if (db != NULL && !SRS_IS_SRS_ADDRESS(addr))
     {
-        char digest[20];
+        char digest[DATABASE_ALIAS_SIZE];
         sha_digest(digest, addr, strlen(addr));
-        db_alias = b32h_encode(digest, 20, db_alias_buf, sizeof(db_alias_buf));
+        db_alias = b32h_encode(digest, sizeof(digest), db_alias_buf,
+                               sizeof(db_alias_buf));
         if (db_alias == NULL)
         {
             log_warn("<%s> not rewritten: aliasing error", addr);
@@ -75,28 +80,31 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
                 *error = true;
             if (info != NULL)
                 *info = "Aliasing error.";
+            metrics_inc(METRIC_FORWARD_ERROR);
             return NULL;
         }
         strcat(db_alias, "@1");
-        if (!database_write(db, db_alias, addr, srs->maxage * 86400))
+        if (!database_write_alias(db, digest, addr, srs->maxage * 86400))
         {
             log_warn("%s: <%s> not rewritten: database error", queue_id, addr);
             if (error != NULL)
                 *error = true;
             if (info != NULL)
                 *info = "Database error.";
+            metrics_inc(METRIC_FORWARD_ERROR);
             return NULL;
         }
         sender = db_alias;
     }
-    char* output = NULL;
-    int result = srs_forward_alloc(srs, &output, sender, domain);
+    int result = srs_forward(srs, buf, bufsize, sender, domain);
     if (result == SRS_SUCCESS)
     {
-        log_info("%s: <%s> forwarded as <%s>", queue_id, addr, output);
-        return output;
+        metrics_inc(METRIC_FORWARD_REWRITTEN);
+        log_info("%s: <%s> forwarded as <%s>", queue_id, addr, buf);
+        return buf;
     }
-    free(output);
+    metrics_inc(result == SRS_ENOTREWRITTEN ? METRIC_FORWARD_NOT_REWRITTEN
+                                            : METRIC_FORWARD_ERROR);
     if (error != NULL)
         *error = result != SRS_ENOTREWRITTEN;
     if (info != NULL)
@@ -106,10 +114,26 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
     return NULL;
 }
 
-char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
-                       bool* error, const char** info, const char* queue_id)
+static enum metrics_counter reverse_failure(int result)
+{
+    switch (result)
+    {
+        case SRS_ENOTSRSADDRESS:
+            return METRIC_REVERSE_NOT_SRS;
+        case SRS_EHASHTOOSHORT:
+        case SRS_EHASHINVALID:
+            return METRIC_REVERSE_HASH_INVALID;
+        case SRS_ETIMESTAMPOUTOFDATE:
+            return METRIC_REVERSE_TIMESTAMP_EXPIRED;
+        default:
+            return METRIC_REVERSE_ERROR;
+    }
+}
+
+static char* reverse_address(char* buf, size_t bufsize, const char* addr,
+                             srs_t* srs, database_t* db, bool* error,
+                             const char** info, const char* queue_id)
 {
-    char buffer[513];
     if (addr == NULL)
         return NULL;
     if (error != NULL)
@@ -118,9 +142,10 @@ char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
         *info = NULL;
     if (queue_id == NULL)
         queue_id = "NOQUEUE";
-    int result = srs_reverse(srs, buffer, sizeof(buffer), addr);
+    int result = srs_reverse(srs, buf, bufsize, addr);
     if (result != SRS_SUCCESS)
     {
+        metrics_inc(reverse_failure(result));
         if (info != NULL)
             *info = srs_strerror(result);
         if (result != SRS_ENOTSRSADDRESS)
@@ -135,7 +160,7 @@ char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
         }
         return NULL;
     }
-    const char* at = strchr(buffer, '@');
+    const char* at = strchr(buf, '@');
     if (at == NULL)
     {
         log_info("%s: <%s> not reversed: internal error", queue_id, addr);
@@ -143,29 +168,47 @@ char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
             *error = true;
         if (info != NULL)
             *info = "Internal error.";
+        metrics_inc(METRIC_REVERSE_ERROR);
         return NULL;
     }
     if (strcmp(at, "@1") == 0)
     {
         if (db != NULL)
         {
-            unsigned char* p = (unsigned char*)buffer;
-            while (*p)
-            {
-                *p = toupper(*p);
-                ++p;
-            }
-            char* sender = database_read(db, buffer);
+            /* The alias is the base32hex encoded key, which may have been
+               case-folded in transit */
+            char digest[DATABASE_ALIAS_SIZE];
+            char* sender = NULL;
+            if (at - buf == 32
+                && b32h_decode(buf, 32, digest, sizeof(digest)) != NULL)
+                sender = database_read_alias(db, digest);
             if (sender == NULL)
             {
                 log_info("%s: <%s> not reversed: unknown alias", queue_id,
                          addr);
                 if (info != NULL)
                     *info = "Unknown alias.";
+                metrics_inc(METRIC_REVERSE_UNKNOWN_ALIAS);
                 return NULL;
             }
-            log_info("%s: <%s> reversed to <%s>", queue_id, addr, sender);
-            return sender;
+            size_t len = strlen(sender);
+            if (len >= bufsize)
+            {
+                log_warn("%s: <%s> not reversed: %s", queue_id, addr,
+                         srs_strerror(SRS_EBUFTOOSMALL));
+                free(sender);
+                if (error != NULL)
+                    *error = true;
+                if (info != NULL)
+                    *info = srs_strerror(SRS_EBUFTOOSMALL);
+                metrics_inc(METRIC_REVERSE_ERROR);
+                return NULL;
+            }
+            memcpy(buf, sender, len + 1);
+            free(sender);
+            metrics_inc(METRIC_REVERSE_REVERSED);
+            log_info("%s: <%s> reversed to <%s>", queue_id, addr, buf);
+            return buf;
         }
         else
         {
@@ -175,9 +218,60 @@ char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
                 *error = true;
             if (info != NULL)
                 *info = "No database for alias.";
+            metrics_inc(METRIC_REVERSE_ERROR);
             return NULL;
         }
     }
-    log_info("%s: <%s> reversed to <%s>", queue_id, addr, buffer);
+    metrics_inc(METRIC_REVERSE_REVERSED);
+    log_info("%s: <%s> reversed to <%s>", queue_id, addr, buf);
+    return buf;
+}
+
+char* postsrsd_forward_into(char* buf, size_t bufsize, const char* addr,
+                            const char* domain, srs_t* srs, database_t* db,
+                            domain_set_t* local_domains, bool* error,
+                            const char** info, const char* queue_id)
+{
+    uint64_t start = metrics_start();
+    char* result = forward_address(buf, bufsize, addr, domain, srs, db,
+                                   local_domains, error, info, queue_id);
+    metrics_observe(METRIC_FORWARD_DURATION, start);
+    return result;
+}
+
+char* postsrsd_reverse_into(char* buf, size_t bufsize, const char* addr,
+                            srs_t* srs, database_t* db, bool* error,
+                            const char** info, const char* queue_id)
+{
+    uint64_t start = metrics_start();
+    char* result = reverse_address(buf, bufsize, addr, srs, db, error, info,
+                                   queue_id);
+    metrics_observe(METRIC_REVERSE_DURATION, start);
+    return result;
+}
+
+char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
+                       database_t* db, domain_set_t* local_domains, bool* error,
+                       const char** info, const char* queue_id)
+{
+    /* Same size estimate as srs_forward_alloc() */
+    char buffer[(addr != NULL ? strlen(addr) : 0)
+                + (domain != NULL ? strlen(domain) : 0)
+                + (srs != NULL ? srs->hashlength : 0) + 66];
+    if (postsrsd_forward_into(buffer, sizeof(buffer), addr, domain, srs, db,
+                              local_domains, error, info, queue_id)
+        == NULL)
+        return NULL;
+    return strdup(buffer);
+}
+
+char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
+                       bool* error, const char** info, const char* queue_id)
+{
+    char buffer[513];
+    if (postsrsd_reverse_into(buffer, sizeof(buffer), addr, srs, db, error,
+                              info, queue_id)
+        == NULL)
+        return NULL;
     return strdup(buffer);
 }
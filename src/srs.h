@@ -22,6 +22,7 @@
 #include "util.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
 char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
                        database_t* db, domain_set_t* local_domains, bool* error,
@@ -29,4 +30,14 @@ char* postsrsd_forward(const char* addr, const char* domain, srs_t* srs,
 char* postsrsd_reverse(const char* addr, srs_t* srs, database_t* db,
                        bool* error, const char** info, const char* queue_id);
 
+/* Like postsrsd_forward() and postsrsd_reverse(), but the rewritten address
+   is stored in the caller-provided buffer, which is returned on success. */
+char* postsrsd_forward_into(char* buf, size_t bufsize, const char* addr,
+                            const char* domain, srs_t* srs, database_t* db,
+                            domain_set_t* local_domains, bool* error,
+                            const char** info, const char* queue_id);
+char* postsrsd_reverse_into(char* buf, size_t bufsize, const char* addr,
+                            srs_t* srs, database_t* db, bool* error,
+                            const char** info, const char* queue_id);
+
 #endif
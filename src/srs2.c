@@ -130,6 +130,7 @@ void srs_init(srs_t* srs)
 {
     memset(srs, 0, sizeof(srs_t));
     srs->secrets = NULL;
+    srs->hmac_keys = NULL;
     srs->numsecrets = 0;
     srs->separator = '=';
     srs->maxage = 21;
@@ -149,6 +150,9 @@ void srs_free(srs_t* srs)
         srs->secrets[i] = 0;
     }
     srs_f_free(srs->secrets);
+    if (srs->hmac_keys != NULL)
+        memset(srs->hmac_keys, 0, srs->numsecrets * sizeof(srs_hmac_key_t));
+    srs_f_free(srs->hmac_keys);
     srs_f_free(srs);
 }
 
@@ -156,6 +160,10 @@ int srs_add_secret(srs_t* srs, const char* secret)
 {
     int newlen = (srs->numsecrets + 1) * sizeof(char*);
     srs->secrets = (char**)srs_f_realloc(srs->secrets, newlen);
+    newlen = (srs->numsecrets + 1) * sizeof(srs_hmac_key_t);
+    srs->hmac_keys = (srs_hmac_key_t*)srs_f_realloc(srs->hmac_keys, newlen);
+    srs_hmac_key_init(&srs->hmac_keys[srs->numsecrets], secret,
+                      strlen(secret));
     srs->secrets[srs->numsecrets++] = strdup(secret);
     return SRS_SUCCESS;
 }
@@ -261,6 +269,54 @@ const char* SRS_HASH_BASECHARS =
     "abcdefghijklmnopqrstuvwxyz"
     "0123456789-_";
 
+/* A little base64 encoding. Just a little. */
+static void srs_hash_encode(srs_t* srs, const char* srshash, char* buf)
+{
+    const unsigned char* hp = (const unsigned char*)srshash;
+    char* bp = buf;
+    int i;
+    int j;
+
+    for (i = 0; i < srs->hashlength; i++)
+    {
+        switch (i & 0x03)
+        {
+            default: /* NOTREACHED */
+            case 0:
+                j = (*hp >> 2);
+                break;
+            case 1:
+                j = ((*hp & 0x03) << 4) | ((*(hp + 1) & 0xF0) >> 4);
+                hp++;
+                break;
+            case 2:
+                j = ((*hp & 0x0F) << 2) | ((*(hp + 1) & 0xC0) >> 6);
+                hp++;
+                break;
+            case 3:
+                j = (*hp++ & 0x3F);
+                break;
+        }
+        *bp++ = SRS_HASH_BASECHARS[j];
+    }
+
+    *bp = '\0';
+    buf[srs->hashlength] = '\0';
+}
+
+static void srs_hash_lowercase(char* lcdata, const char* data, int len)
+{
+    int j;
+
+    for (j = 0; j < len; j++)
+    {
+        if (isupper((unsigned char)data[j]))
+            lcdata[j] = tolower((unsigned char)data[j]);
+        else
+            lcdata[j] = data[j];
+    }
+}
+
 static void srs_hash_create_v(srs_t* srs, int idx, char* buf, int nargs,
                               va_list ap)
 {
@@ -272,21 +328,16 @@ static void srs_hash_create_v(srs_t* srs, int idx, char* buf, int nargs,
     srs_hmac_ctx_t ctx;
     char srshash[SHA_DIGESTSIZE + 1];
 #endif
-    char* secret;
     char* data;
     int len;
-    unsigned char* hp;
-    char* bp;
     int i;
-    int j;
-
-    secret = srs->secrets[idx];
 
 #ifdef USE_OPENSSL
+    char* secret = srs->secrets[idx];
     HMAC_CTX_init(&ctx);
     HMAC_Init(&ctx, secret, strlen(secret), EVP_sha1());
 #else
-    srs_hmac_init(&ctx, secret, strlen(secret));
+    srs_hmac_init_key(&ctx, &srs->hmac_keys[idx]);
 #endif
 
     for (i = 0; i < nargs; i++)
@@ -294,13 +345,7 @@ static void srs_hash_create_v(srs_t* srs, int idx, char* buf, int nargs,
         data = va_arg(ap, char*);
         len = strlen(data);
         char lcdata[len + 1];
-        for (j = 0; j < len; j++)
-        {
-            if (isupper((unsigned char)data[j]))
-                lcdata[j] = tolower((unsigned char)data[j]);
-            else
-                lcdata[j] = data[j];
-        }
+        srs_hash_lowercase(lcdata, data, len);
 #ifdef USE_OPENSSL
         HMAC_Update(&ctx, lcdata, len);
 #else
@@ -317,35 +362,37 @@ static void srs_hash_create_v(srs_t* srs, int idx, char* buf, int nargs,
     srshash[SHA_DIGESTSIZE] = '\0';
 #endif
 
-    /* A little base64 encoding. Just a little. */
-    hp = (unsigned char*)srshash;
-    bp = buf;
-    for (i = 0; i < srs->hashlength; i++)
+    srs_hash_encode(srs, srshash, buf);
+}
+
+#ifndef USE_OPENSSL
+/* Compute the hashes for secrets first .. first + num_keys - 1 in a
+   single multi-lane pass */
+static void srs_hash_create_multi_v(srs_t* srs, int first, int num_keys,
+                                    char* buf, int nargs, va_list ap)
+{
+    srs_hmac_multi_ctx_t ctx;
+    char srshash[SRS_HMAC_LANES * SHA_DIGESTSIZE];
+    char* data;
+    int len;
+    int i;
+
+    srs_hmac_multi_init(&ctx, &srs->hmac_keys[first], num_keys);
+    for (i = 0; i < nargs; i++)
     {
-        switch (i & 0x03)
-        {
-            default: /* NOTREACHED */
-            case 0:
-                j = (*hp >> 2);
-                break;
-            case 1:
-                j = ((*hp & 0x03) << 4) | ((*(hp + 1) & 0xF0) >> 4);
-                hp++;
-                break;
-            case 2:
-                j = ((*hp & 0x0F) << 2) | ((*(hp + 1) & 0xC0) >> 6);
-                hp++;
-                break;
-            case 3:
-                j = (*hp++ & 0x3F);
-                break;
-        }
-        *bp++ = SRS_HASH_BASECHARS[j];
+        data = va_arg(ap, char*);
+        len = strlen(data);
+        char lcdata[len + 1];
+        srs_hash_lowercase(lcdata, data, len);
+        srs_hmac_multi_update(&ctx, lcdata, len);
     }
+    srs_hmac_multi_fini(&ctx, srshash);
 
-    *bp = '\0';
-    buf[srs->hashlength] = '\0';
+    for (i = 0; i < num_keys; i++)
+        srs_hash_encode(srs, srshash + i * SHA_DIGESTSIZE,
+                        buf + i * (srs->hashlength + 1));
 }
+#endif
 
 int srs_hash_create(srs_t* srs, char* buf, int nargs, ...)
 {
@@ -379,17 +426,83 @@ int srs_hash_check(srs_t* srs, char* hash, int nargs, ...)
         len = srs->hashlength;
     }
 
+    /* Every secret is checked, so a forged hash takes as long to reject
+       as a valid hash for the last secret */
+    int match = 0;
+#ifndef USE_OPENSSL
+    if (srs->numsecrets >= (int)srs_hmac_multi_min_keys())
+    {
+        char srshashes[SRS_HMAC_LANES * (srs->hashlength + 1)];
+        for (i = 0; i < srs->numsecrets; i += SRS_HMAC_LANES)
+        {
+            int num_keys = srs->numsecrets - i;
+            if (num_keys > SRS_HMAC_LANES)
+                num_keys = SRS_HMAC_LANES;
+            va_start(ap, nargs);
+            srs_hash_create_multi_v(srs, i, num_keys, srshashes, nargs, ap);
+            va_end(ap);
+            for (int j = 0; j < num_keys; j++)
+                match |= base64_equivalent(
+                    hash, srshashes + j * (srs->hashlength + 1), len);
+        }
+        return match ? SRS_SUCCESS : SRS_EHASHINVALID;
+    }
+#endif
     char srshash[srs->hashlength + 1];
     for (i = 0; i < srs->numsecrets; i++)
     {
         va_start(ap, nargs);
         srs_hash_create_v(srs, i, srshash, nargs, ap);
         va_end(ap);
-        if (base64_equivalent(hash, srshash, len))
-            return SRS_SUCCESS;
+        match |= base64_equivalent(hash, srshash, len);
     }
 
-    return SRS_EHASHINVALID;
+    return match ? SRS_SUCCESS : SRS_EHASHINVALID;
+}
+
+static char* srs_append(char* bp, const char* str)
+{
+    size_t len = strlen(str);
+    memcpy(bp, str, len);
+    return bp + len;
+}
+
+/* Assemble TAG<sep>field=field...@aliashost into buf, which the caller has
+ * verified to be large enough. This is on the hot path, so we avoid the
+ * format string parsing of sprintf(). */
+static void srs_compose(char* buf, const char* tag, char separator,
+                        const char** fields, int nfields,
+                        const char* aliashost)
+{
+    char* bp = srs_append(buf, tag);
+    int i;
+
+    *bp++ = separator;
+    for (i = 0; i < nfields; i++)
+    {
+        if (i > 0)
+            *bp++ = SRSSEP;
+        bp = srs_append(bp, fields[i]);
+    }
+    *bp++ = '@';
+    bp = srs_append(bp, aliashost);
+    *bp = '\0';
+}
+
+static int srs_join_address(char* buf, unsigned buflen, const char* prefix,
+                            const char* user, const char* host)
+{
+    size_t plen = strlen(prefix);
+    size_t ulen = strlen(user);
+    size_t hlen = strlen(host);
+
+    if (plen + ulen + 1 + hlen >= buflen)
+        return SRS_EBUFTOOSMALL;
+    memcpy(buf, prefix, plen);
+    memcpy(buf + plen, user, ulen);
+    buf[plen + ulen] = '@';
+    memcpy(buf + plen + ulen + 1, host, hlen + 1);
+    return SRS_SUCCESS;
 }
 
 int srs_compile_shortcut(srs_t* srs, char* buf, int buflen, char* sendhost,
@@ -425,8 +538,8 @@ int srs_compile_shortcut(srs_t* srs, char* buf, int buflen, char* sendhost,
     if (ret != SRS_SUCCESS)
         return ret;
 
-    sprintf(buf, SRS0TAG "%c%s%c%s%c%s%c%s@%s", srs->separator, srshash, SRSSEP,
-            srsstamp, SRSSEP, sendhost, SRSSEP, senduser, aliashost);
+    const char* fields[] = {srshash, srsstamp, sendhost, senduser};
+    srs_compose(buf, SRS0TAG, srs->separator, fields, 4, aliashost);
 
     return SRS_SUCCESS;
 }
@@ -463,8 +576,8 @@ int srs_compile_guarded(srs_t* srs, char* buf, int buflen, char* sendhost,
               + strlen(srsuser) + 1 + strlen(aliashost);
         if (len >= buflen)
             return SRS_EBUFTOOSMALL;
-        sprintf(buf, SRS1TAG "%c%s%c%s%c%s@%s", srs->separator, srshash, SRSSEP,
-                srshost, SRSSEP, srsuser, aliashost);
+        const char* fields[] = {srshash, srshost, srsuser};
+        srs_compose(buf, SRS1TAG, srs->separator, fields, 3, aliashost);
         return SRS_SUCCESS;
     }
     else if ((strncasecmp(senduser, SRS0TAG, 4) == 0)
@@ -480,8 +593,8 @@ int srs_compile_guarded(srs_t* srs, char* buf, int buflen, char* sendhost,
               + strlen(srsuser) + 1 + strlen(aliashost);
         if (len >= buflen)
             return SRS_EBUFTOOSMALL;
-        sprintf(buf, SRS1TAG "%c%s%c%s%c%s@%s", srs->separator, srshash, SRSSEP,
-                srshost, SRSSEP, srsuser, aliashost);
+        const char* fields[] = {srshash, srshost, srsuser};
+        srs_compose(buf, SRS1TAG, srs->separator, fields, 3, aliashost);
     }
     else
     {
@@ -523,8 +636,7 @@ int srs_parse_shortcut(srs_t* srs, char* buf, unsigned buflen, char* senduser)
         ret = srs_hash_check(srs, srshash, 3, srsstamp, srshost, srsuser);
         if (ret != SRS_SUCCESS)
             return ret;
-        snprintf(buf, buflen, "%s@%s", srsuser, srshost);
-        return SRS_SUCCESS;
+        return srs_join_address(buf, buflen, "", srsuser, srshost);
     }
 
     return SRS_ENOTSRSADDRESS;
@@ -553,8 +665,7 @@ int srs_parse_guarded(srs_t* srs, char* buf, int buflen, char* senduser)
         ret = srs_hash_check(srs, srshash, 2, srshost, srsuser);
         if (ret != SRS_SUCCESS)
             return ret;
-        sprintf(buf, SRS0TAG "%s@%s", srsuser, srshost);
-        return SRS_SUCCESS;
+        return srs_join_address(buf, buflen, SRS0TAG, srsuser, srshost);
     }
     else
     {
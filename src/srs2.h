@@ -109,6 +109,7 @@ typedef struct _srs_t
 {
     /* Rewriting parameters */
     char** secrets;
+    struct _srs_hmac_key_t* hmac_keys; /* Precomputed per secret */
     int numsecrets;
     char separator;
 
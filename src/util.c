@@ -18,9 +18,11 @@
 
 #include "postsrsd_build_config.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -41,6 +43,9 @@
 #ifdef HAVE_SYS_INOTIFY_H
 #    include <sys/inotify.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#endif
 #ifdef HAVE_SYS_TIME_H
 #    include <sys/time.h>
 #endif
@@ -138,6 +143,41 @@ char* b32h_encode(const char* data, size_t length, char* buffer, size_t bufsize)
     return buffer;
 }
 
+char* b32h_decode(const char* data, size_t length, char* buffer, size_t bufsize)
+{
+    /* Only complete groups of eight characters without padding are
+       accepted, which is all PostSRSd ever needs to decode. Lowercase
+       characters are accepted, too, as mail address localparts are often
+       case-folded in transit. */
+    if (data == NULL || length % 8 != 0 || bufsize < 5 * (length / 8))
+        return NULL;
+    char* out = buffer;
+    for (size_t i = 0, j = 0; i < length; i += 8, j += 5)
+    {
+        uint64_t tmp = 0;
+        for (size_t k = i; k < i + 8; ++k)
+        {
+            unsigned char c = data[k];
+            unsigned value;
+            if (c >= '0' && c <= '9')
+                value = c - '0';
+            else if (c >= 'A' && c <= 'V')
+                value = c - 'A' + 10;
+            else if (c >= 'a' && c <= 'v')
+                value = c - 'a' + 10;
+            else
+                return NULL;
+            tmp = (tmp << 5) | value;
+        }
+        out[j] = (char)(tmp >> 32);
+        out[j + 1] = (char)(tmp >> 24);
+        out[j + 2] = (char)(tmp >> 16);
+        out[j + 3] = (char)(tmp >> 8);
+        out[j + 4] = (char)tmp;
+    }
+    return buffer;
+}
+
 bool file_exists(const char* filename)
 {
     struct stat st;
@@ -239,109 +279,763 @@ bool writev_all(int fd, struct iovec* iov, size_t numv)
     return true;
 }
 
-/* The domain set is implemented as a common prefix tree */
+void deadline_after(struct timespec* deadline, unsigned ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+bool wait_readable(int fd, const struct timespec* deadline)
+{
+    /* Short-lived requests are served by the main loop, so a client must
+       not be able to keep it busy by sending its request byte by byte. */
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long ms = (long long)(deadline->tv_sec - now.tv_sec) * 1000
+                       + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0)
+            return false;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, (int)ms);
+        if (ready > 0)
+            return true;
+        if (ready == 0 || errno != EINTR)
+            return false;
+    }
+}
+
+/* The domain set is an open addressing hash table of the lowercase domain
+   names, which are stored back to back in a single string pool. Entries
+   with a leading dot match all subdomains, so a lookup hashes the domain
+   backwards and probes each suffix which starts at a dot, without copying
+   the domain. */
+struct domain_slot
+{
+    uint32_t hash;
+    /* Offset of the domain in the string pool, or 0 for an empty slot */
+    uint32_t offset;
+};
+
 struct domain_set
 {
-    /* Membership; is the string up to this point a set member? */
-    bool m;
-    /* Child node for subdomain components, effectively (".") */
-    struct domain_set* s;
-    /* Child nodes for letters A-Z, numbers 0-9, and dash ("-"),
-       in that order */
-    struct domain_set* c[37];
+    struct domain_slot* slots;
+    size_t capacity;
+    size_t count;
+    char* pool;
+    size_t pool_size;
+    size_t pool_capacity;
+    /* Read-only table of a compiled domains file, which is shared by all
+       processes that map it */
+    void* index;
+    size_t index_size;
+    const struct domain_slot* index_slots;
+    size_t index_capacity;
+    size_t index_count;
+    const char* index_pool;
+    size_t index_pool_size;
+    /* Incremental changes in shared memory, see domain_set_update() */
+    struct domain_updates* updates;
+};
+
+/* Domains which are added or removed at runtime are recorded in a fixed
+   size table in shared memory, which overrides the base set. Only the main
+   process writes to it, and the forked workers read it under a sequence
+   lock, so they see the changes without being restarted. Each pool entry
+   is prefixed with its state. */
+#define DOMAIN_UPDATE_SLOTS     4096
+#define DOMAIN_UPDATE_POOL_SIZE (64 * DOMAIN_UPDATE_SLOTS)
+#define DOMAIN_UPDATE_NONE      0
+#define DOMAIN_UPDATE_ADDED     1
+#define DOMAIN_UPDATE_REMOVED   2
+#define DOMAIN_UPDATE_MAX_SPINS 16
+
+struct domain_updates
+{
+    uint32_t seq;
+    uint32_t count;
+    uint32_t pool_size;
+    struct domain_slot slots[DOMAIN_UPDATE_SLOTS];
+    char pool[DOMAIN_UPDATE_POOL_SIZE];
+};
+
+/* A compiled domains file holds the header, the hash table slots, and the
+   string pool, in the byte order of the host that compiled it */
+struct domain_index_header
+{
+    char magic[16];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t pool_size;
 };
 
-#define DOMAIN_SET_ADD           1
-#define DOMAIN_SET_PARENTS_MATCH 2
+static const char domain_index_magic[16] = {'P', 'o', 's', 't', 'S', 'R',
+                                            'S', 'd', ' ', 'd', 'o', 'm',
+                                            'a', 'i', 'n', 's'};
+#define DOMAIN_INDEX_VERSION 1
+
+#define DOMAIN_SET_MAX_LENGTH       510
+#define DOMAIN_SET_INITIAL_CAPACITY 64
+#define DOMAIN_SET_FNV_OFFSET       2166136261u
+#define DOMAIN_SET_FNV_PRIME        16777619u
+
+/* Returns the lowercase character, or 0 if it is not valid in a domain */
+static inline char domain_set_char(char ch)
+{
+    if (ch >= 'a' && ch <= 'z')
+        return ch;
+    if (ch >= 'A' && ch <= 'Z')
+        return ch - 'A' + 'a';
+    if ((ch >= '0' && ch <= '9') || ch == '-' || ch == '.')
+        return ch;
+    return 0;
+}
+
+static inline uint32_t domain_set_hash(uint32_t hash, char ch)
+{
+    return (hash ^ (unsigned char)ch) * DOMAIN_SET_FNV_PRIME;
+}
+
+static inline uint32_t domain_set_hash_string(const char* s, size_t length)
+{
+    /* The string is hashed backwards, like the suffixes in lookups */
+    uint32_t hash = DOMAIN_SET_FNV_OFFSET;
+    for (size_t i = length; i > 0; --i)
+        hash = domain_set_hash(hash, s[i - 1]);
+    return hash;
+}
+
+/* Returns the pool offset of the domain, or 0 if it is not found */
+static size_t domain_set_probe(const struct domain_slot* slots,
+                               size_t capacity, const char* pool,
+                               size_t pool_size, uint32_t hash,
+                               const char* domain, size_t length)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    /* The probe sequence is bounded, because a corrupt index might not
+       have any empty slots */
+    for (size_t n = 0; n < capacity && slots[i].offset != 0; ++n)
+    {
+        if (slots[i].hash == hash && slots[i].offset < pool_size)
+        {
+            const char* entry = pool + slots[i].offset;
+            size_t k = 0;
+            while (k < length && entry[k] == domain_set_char(domain[k]))
+                ++k;
+            if (k == length && entry[k] == 0)
+                return slots[i].offset;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+static bool domain_set_find_base(const domain_set_t* D, uint32_t hash,
+                                 const char* domain, size_t length)
+{
+    if (D->index != NULL
+        && domain_set_probe(D->index_slots, D->index_capacity, D->index_pool,
+                            D->index_pool_size, hash, domain, length)
+               != 0)
+        return true;
+    return domain_set_probe(D->slots, D->capacity, D->pool, D->pool_size, hash,
+                            domain, length)
+           != 0;
+}
+
+static int domain_set_find_update(const struct domain_updates* U,
+                                  uint32_t hash, const char* domain,
+                                  size_t length)
+{
+    for (unsigned spins = 0;; ++spins)
+    {
+        /* Give a preempted main process the chance to finish its update */
+        if (spins >= DOMAIN_UPDATE_MAX_SPINS)
+            sched_yield();
+        uint32_t seq = __atomic_load_n(&U->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        /* The last pool byte is never written, so a torn read still finds
+           a terminating zero */
+        size_t offset =
+            domain_set_probe(U->slots, DOMAIN_UPDATE_SLOTS, U->pool,
+                             DOMAIN_UPDATE_POOL_SIZE, hash, domain, length);
+        int state = offset != 0 ? U->pool[offset - 1] : DOMAIN_UPDATE_NONE;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&U->seq, __ATOMIC_RELAXED) == seq)
+            return state;
+    }
+}
+
+static bool domain_set_find(const domain_set_t* D, uint32_t hash,
+                            const char* domain, size_t length)
+{
+    if (D->updates != NULL)
+    {
+        int state = domain_set_find_update(D->updates, hash, domain, length);
+        if (state != DOMAIN_UPDATE_NONE)
+            return state == DOMAIN_UPDATE_ADDED;
+    }
+    return domain_set_find_base(D, hash, domain, length);
+}
+
+static void domain_set_insert(struct domain_slot* slots, size_t capacity,
+                              uint32_t hash, uint32_t offset)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    while (slots[i].offset != 0)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].offset = offset;
+}
+
+static bool domain_set_grow(domain_set_t* D)
+{
+    size_t capacity = 2 * D->capacity;
+    struct domain_slot* slots = calloc(capacity, sizeof(struct domain_slot));
+    if (slots == NULL)
+        return false;
+    for (size_t i = 0; i < D->capacity; ++i)
+        if (D->slots[i].offset != 0)
+            domain_set_insert(slots, capacity, D->slots[i].hash,
+                              D->slots[i].offset);
+    free(D->slots);
+    D->slots = slots;
+    D->capacity = capacity;
+    return true;
+}
 
 domain_set_t* domain_set_create()
 {
     domain_set_t* D = malloc(sizeof(struct domain_set));
-    for (unsigned i = 0; i < sizeof(D->c) / sizeof(D->c[0]); ++i)
-        D->c[i] = NULL;
-    D->s = NULL;
-    D->m = false;
+    if (D == NULL)
+        return NULL;
+    D->capacity = DOMAIN_SET_INITIAL_CAPACITY;
+    D->count = 0;
+    D->index = NULL;
+    D->index_size = 0;
+    D->updates = NULL;
+    D->slots = calloc(D->capacity, sizeof(struct domain_slot));
+    /* Offset 0 marks empty slots, so the pool starts with a dummy byte */
+    D->pool_capacity = 1024;
+    D->pool_size = 1;
+    D->pool = malloc(D->pool_capacity);
+    if (D->slots == NULL || D->pool == NULL)
+    {
+        domain_set_destroy(D);
+        return NULL;
+    }
+    D->pool[0] = 0;
     return D;
 }
 
 void domain_set_destroy(domain_set_t* D)
 {
-    for (unsigned i = 0; i < sizeof(D->c) / sizeof(D->c[0]); ++i)
-        if (D->c[i])
-            domain_set_destroy(D->c[i]);
-    if (D->s != NULL)
-        domain_set_destroy(D->s);
+    if (D == NULL)
+        return;
+    free(D->slots);
+    free(D->pool);
+    if (D->index != NULL)
+    {
+#ifdef HAVE_SYS_MMAN_H
+        munmap(D->index, D->index_size);
+#else
+        free(D->index);
+#endif
+    }
+#ifdef HAVE_SYS_MMAN_H
+    if (D->updates != NULL)
+        munmap(D->updates, sizeof(struct domain_updates));
+#endif
     free(D);
 }
 
-static bool walk_domain_set(domain_set_t* D, char* domain, int flags)
+bool domain_set_add(domain_set_t* D, const char* domain)
 {
-    char* dot = strrchr(domain, '.');
-    char* subdomain = domain;
-    if (dot != NULL)
+    if (D == NULL)
+        return false;
+    size_t length = strnlen(domain, DOMAIN_SET_MAX_LENGTH + 1);
+    if (length > DOMAIN_SET_MAX_LENGTH)
+        return false;
+    uint32_t hash = DOMAIN_SET_FNV_OFFSET;
+    for (size_t i = length; i > 0; --i)
     {
-        subdomain = dot + 1;
-        *dot = 0;
+        char ch = domain_set_char(domain[i - 1]);
+        /* Invalid domains can never match, so they are silently ignored */
+        if (ch == 0)
+            return true;
+        hash = domain_set_hash(hash, ch);
     }
-    int ch;
-    while ((ch = *subdomain++))
+    if (domain_set_find(D, hash, domain, length))
+        return false;
+    if (2 * (D->count + 1) > D->capacity && !domain_set_grow(D))
+        return false;
+    if (D->pool_size + length + 1 > D->pool_capacity)
     {
-        if (ch >= 'A' && ch <= 'Z')
-            ch -= 'A';
-        else if (ch >= 'a' && ch <= 'z')
-            ch -= 'a';
-        else if (ch >= '0' && ch <= '9')
-            ch = ch - '0' + 26;
-        else if (ch == '-')
-            ch = 36;
-        else
+        size_t pool_capacity = 2 * D->pool_capacity;
+        if (pool_capacity > UINT32_MAX)
+            return false;
+        char* pool = realloc(D->pool, pool_capacity);
+        if (pool == NULL)
+            return false;
+        D->pool = pool;
+        D->pool_capacity = pool_capacity;
+    }
+    char* entry = D->pool + D->pool_size;
+    for (size_t i = 0; i < length; ++i)
+        entry[i] = domain_set_char(domain[i]);
+    entry[length] = 0;
+    domain_set_insert(D->slots, D->capacity, hash, (uint32_t)D->pool_size);
+    D->pool_size += length + 1;
+    ++D->count;
+    return true;
+}
+
+bool domain_set_contains(domain_set_t* D, const char* domain)
+{
+    if (D == NULL)
+        return false;
+    size_t length = strnlen(domain, DOMAIN_SET_MAX_LENGTH + 1);
+    if (length > DOMAIN_SET_MAX_LENGTH)
+        return false;
+    /* Suffixes are checked from right to left, so a wildcard entry matches
+       before the remaining labels are validated */
+    uint32_t hash = DOMAIN_SET_FNV_OFFSET;
+    for (size_t i = length; i > 0; --i)
+    {
+        char ch = domain_set_char(domain[i - 1]);
+        if (ch == 0)
+            return false;
+        hash = domain_set_hash(hash, ch);
+        if (ch == '.'
+            && domain_set_find(D, hash, domain + i - 1, length - i + 1))
+            return true;
+    }
+    return domain_set_find(D, hash, domain, length);
+}
+
+size_t domain_set_memory(domain_set_t* D)
+{
+    if (D == NULL)
+        return 0;
+    return sizeof(struct domain_set)
+           + D->capacity * sizeof(struct domain_slot) + D->pool_capacity;
+}
+
+const char* domain_set_first(domain_set_t* D)
+{
+    /* The string pools keep the domains in the order they were added */
+    if (D == NULL)
+        return NULL;
+    if (D->index != NULL && D->index_count > 0)
+        return D->index_pool + 1;
+    if (D->count > 0)
+        return D->pool + 1;
+    return NULL;
+}
+
+bool domain_set_share_updates(domain_set_t* D)
+{
+    if (D == NULL)
+        return false;
+    if (D->updates != NULL)
+        return true;
+#ifdef HAVE_SYS_MMAN_H
+    void* updates =
+        mmap(NULL, sizeof(struct domain_updates), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (updates == MAP_FAILED)
+    {
+        log_perror(errno, "mmap");
+        return false;
+    }
+    /* Anonymous mappings are zero-filled, which is an empty table */
+    D->updates = updates;
+    return true;
+#else
+    log_error("incremental domain updates need shared memory");
+    return false;
+#endif
+}
+
+static void domain_updates_begin(struct domain_updates* U)
+{
+    __atomic_store_n(&U->seq, U->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void domain_updates_end(struct domain_updates* U)
+{
+    __atomic_store_n(&U->seq, U->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Changes the membership of a lowercase domain. Returns 1 if the set was
+   changed, 0 if the domain already had the requested state, and -1 if the
+   update table is full. If cost is not NULL, nothing is changed, and the
+   table space required for the change is added to cost. */
+static int domain_set_change(domain_set_t* D, const char* domain,
+                             size_t length, bool add, size_t* cost)
+{
+    struct domain_updates* U = D->updates;
+    uint32_t hash = domain_set_hash_string(domain, length);
+    char state = add ? DOMAIN_UPDATE_ADDED : DOMAIN_UPDATE_REMOVED;
+    size_t offset =
+        domain_set_probe(U->slots, DOMAIN_UPDATE_SLOTS, U->pool,
+                         DOMAIN_UPDATE_POOL_SIZE, hash, domain, length);
+    if (offset != 0)
+    {
+        if (U->pool[offset - 1] == state)
             return 0;
-        if (D->c[ch] == NULL)
+        if (cost == NULL)
         {
-            if (!(flags & DOMAIN_SET_ADD))
-                return 0;
-            D->c[ch] = domain_set_create();
+            domain_updates_begin(U);
+            U->pool[offset - 1] = state;
+            domain_updates_end(U);
         }
-        D = D->c[ch];
+        return 1;
     }
-    if (dot != NULL)
+    if (domain_set_find_base(D, hash, domain, length) == add)
+        return 0;
+    if (cost != NULL)
     {
-        if (D->s == NULL)
-        {
-            if (!(flags & DOMAIN_SET_ADD))
-                return 0;
-            D->s = domain_set_create();
-        }
-        if (D->s->m && (flags & DOMAIN_SET_PARENTS_MATCH))
-            return 1;
-        return walk_domain_set(D->s, domain, flags);
+        cost[0] += 1;
+        cost[1] += length + 2;
+        return 1;
     }
-    bool result = D->m;
-    if (flags == DOMAIN_SET_ADD)
-        D->m = true;
-    return result;
+    if (2 * (U->count + 1) > DOMAIN_UPDATE_SLOTS
+        || U->pool_size + length + 2 >= DOMAIN_UPDATE_POOL_SIZE)
+        return -1;
+    /* Offset 0 marks empty slots, so the pool starts with a dummy byte */
+    size_t pos = U->pool_size > 0 ? U->pool_size : 1;
+    domain_updates_begin(U);
+    U->pool[pos] = state;
+    memcpy(U->pool + pos + 1, domain, length);
+    U->pool[pos + 1 + length] = 0;
+    domain_set_insert(U->slots, DOMAIN_UPDATE_SLOTS, hash, (uint32_t)pos + 1);
+    U->pool_size = pos + length + 2;
+    ++U->count;
+    domain_updates_end(U);
+    return 1;
 }
 
-bool domain_set_add(domain_set_t* D, const char* domain)
+bool domain_set_update(domain_set_t* D, const char* domain, bool add)
+{
+    char buffer[DOMAIN_SET_MAX_LENGTH + 1];
+    if (D == NULL || D->updates == NULL)
+        return false;
+    size_t length = strnlen(domain, DOMAIN_SET_MAX_LENGTH + 1);
+    if (length == 0 || length > DOMAIN_SET_MAX_LENGTH)
+        return false;
+    for (size_t i = 0; i < length; ++i)
+    {
+        buffer[i] = domain_set_char(domain[i]);
+        if (buffer[i] == 0)
+            return false;
+    }
+    return domain_set_change(D, buffer, length, add, NULL) >= 0;
+}
+
+/* Adds (or removes) all domains in a string pool, except those in the
+   target set T when removing. Returns the number of changes or -1. */
+static long domain_set_change_pool(domain_set_t* D, const domain_set_t* T,
+                                   const char* pool, size_t pool_size,
+                                   bool with_state, bool add, size_t* cost)
+{
+    long changes = 0;
+    size_t offset = 1;
+    while (offset < pool_size)
+    {
+        char state = DOMAIN_UPDATE_ADDED;
+        if (with_state)
+            state = pool[offset++];
+        const char* domain = pool + offset;
+        size_t length = strlen(domain);
+        offset += length + 1;
+        if (length == 0 || state != DOMAIN_UPDATE_ADDED)
+            continue;
+        if (!add
+            && domain_set_find(T, domain_set_hash_string(domain, length),
+                               domain, length))
+            continue;
+        int result = domain_set_change(D, domain, length, add, cost);
+        if (result < 0)
+            return -1;
+        changes += result;
+    }
+    return changes;
+}
+
+static long domain_set_change_all(domain_set_t* D, const domain_set_t* T,
+                                  bool add, size_t* cost)
+{
+    const domain_set_t* S = add ? T : D;
+    long changes = 0;
+    long result = 0;
+    if (S->index != NULL)
+    {
+        result = domain_set_change_pool(D, T, S->index_pool,
+                                        S->index_pool_size, false, add, cost);
+        if (result < 0)
+            return -1;
+        changes += result;
+    }
+    result = domain_set_change_pool(D, T, S->pool, S->pool_size, false, add,
+                                    cost);
+    if (result < 0)
+        return -1;
+    changes += result;
+    if (!add)
+    {
+        result = domain_set_change_pool(D, T, D->updates->pool,
+                                        D->updates->pool_size, true, false,
+                                        cost);
+        if (result < 0)
+            return -1;
+        changes += result;
+    }
+    return changes;
+}
+
+bool domain_set_update_from(domain_set_t* D, domain_set_t* T, size_t* added,
+                            size_t* removed)
+{
+    /* cost[0] counts the new table slots, cost[1] the new pool bytes */
+    size_t cost[2] = {0, 0};
+    if (D == NULL || T == NULL || D->updates == NULL)
+        return false;
+    struct domain_updates* U = D->updates;
+    /* Check first if all changes fit, so they are applied completely or
+       not at all */
+    if (domain_set_change_all(D, T, false, cost) < 0
+        || domain_set_change_all(D, T, true, cost) < 0)
+        return false;
+    if (2 * (U->count + cost[0]) > DOMAIN_UPDATE_SLOTS
+        || U->pool_size + cost[1] + 1 >= DOMAIN_UPDATE_POOL_SIZE)
+        return false;
+    long r = domain_set_change_all(D, T, false, NULL);
+    long a = domain_set_change_all(D, T, true, NULL);
+    if (r < 0 || a < 0)
+        return false;
+    if (removed != NULL)
+        *removed = (size_t)r;
+    if (added != NULL)
+        *added = (size_t)a;
+    return true;
+}
+
+bool is_valid_domain_name(const char* s)
+{
+    char prev = 0;
+    if (s == NULL)
+        return false;
+    if (*s == 0)
+        return false;
+    while (*s != 0)
+    {
+        if (*s == '.' && prev == '.')
+            return false;
+        if (!isalnum((unsigned char)*s) && *s != '-' && *s != '.')
+            return false;
+        prev = *s++;
+    }
+    return prev != '.';
+}
+
+static bool domain_set_map_index(domain_set_t* D, int fd, const char* path)
 {
+    struct stat st;
+    if (D->index != NULL)
+    {
+        log_error("cannot use more than one compiled domains file");
+        return false;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        log_perror(errno, path);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(struct domain_index_header))
+        goto invalid;
+#ifdef HAVE_SYS_MMAN_H
+    void* index = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED)
+    {
+        log_perror(errno, path);
+        return false;
+    }
+#else
+    void* index = malloc(size);
+    if (index == NULL)
+    {
+        log_error("failed to allocate memory for %s", path);
+        return false;
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0 || !read_all(fd, index, size))
+    {
+        log_perror(errno, path);
+        free(index);
+        return false;
+    }
+#endif
+    struct domain_index_header header;
+    memcpy(&header, index, sizeof(header));
+    size_t body_size = size - sizeof(header);
+    size_t slots_size = header.capacity * sizeof(struct domain_slot);
+    /* Only the header is checked, so that mapping the index does not touch
+       all its pages; lookups are bounds checked instead */
+    if (header.version != DOMAIN_INDEX_VERSION || header.capacity == 0
+        || (header.capacity & (header.capacity - 1)) != 0
+        || header.capacity > body_size / sizeof(struct domain_slot)
+        || header.count >= header.capacity
+        || header.pool_size != body_size - slots_size || header.pool_size == 0
+        || header.pool_size > UINT32_MAX
+        || ((const char*)index)[size - 1] != 0)
+    {
+#ifdef HAVE_SYS_MMAN_H
+        munmap(index, size);
+#else
+        free(index);
+#endif
+        goto invalid;
+    }
+    D->index = index;
+    D->index_size = size;
+    D->index_slots =
+        (const struct domain_slot*)((const char*)index + sizeof(header));
+    D->index_capacity = header.capacity;
+    D->index_count = header.count;
+    D->index_pool = (const char*)(D->index_slots + header.capacity);
+    D->index_pool_size = header.pool_size;
+    return true;
+
+invalid:
+    log_error("%s is not a valid compiled domains file", path);
+    return false;
+}
+
+bool domain_set_read_file(domain_set_t* D, const char* path)
+{
+    char buffer[1024];
+    char* domain;
+    char* end;
     if (D == NULL)
         return false;
-    char buffer[512];
-    char* end = stpncpy(buffer, domain, sizeof(buffer) - 1);
-    if (end - buffer >= (ptrdiff_t)sizeof(buffer) - 1)
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        log_error("cannot read local domains from %s", path);
         return false;
-    return !walk_domain_set(D, buffer, DOMAIN_SET_ADD);
+    }
+    if (fread(buffer, 1, sizeof(domain_index_magic), f)
+            == sizeof(domain_index_magic)
+        && memcmp(buffer, domain_index_magic, sizeof(domain_index_magic))
+               == 0)
+    {
+        bool success = domain_set_map_index(D, fileno(f), path);
+        fclose(f);
+        return success;
+    }
+    rewind(f);
+    while ((domain = fgets(buffer, sizeof(buffer), f)) != NULL)
+    {
+        end = strpbrk(domain, "#\r\n");
+        if (end != NULL)
+            *end = 0;
+        else
+            end = domain + strlen(domain);
+        while (isspace((unsigned char)domain[0]))
+            ++domain;
+        while (end != domain && isspace((unsigned char)*(end - 1)))
+            *--end = 0;
+        if (NULL_OR_EMPTY_STRING(domain))
+            continue;
+        if (!is_valid_domain_name(domain))
+        {
+            log_error("invalid domain name '%s' in domains file", domain);
+            fclose(f);
+            return false;
+        }
+        if (!domain_set_add(D, domain))
+            log_warn("duplicate local domain: %s", domain);
+    }
+    fclose(f);
+    return true;
 }
 
-bool domain_set_contains(domain_set_t* D, const char* domain)
+bool domain_set_write_index(domain_set_t* D, const char* path)
 {
+    struct domain_index_header header;
     if (D == NULL)
         return false;
-    char buffer[512];
-    char* end = stpncpy(buffer, domain, sizeof(buffer) - 1);
-    if (end - buffer >= (ptrdiff_t)sizeof(buffer) - 1)
+    if (D->index != NULL)
+    {
+        log_error("cannot compile a set with a compiled domains file");
+        return false;
+    }
+    memcpy(header.magic, domain_index_magic, sizeof(header.magic));
+    header.version = DOMAIN_INDEX_VERSION;
+    header.reserved = 0;
+    header.capacity = D->capacity;
+    header.count = D->count;
+    header.pool_size = D->pool_size;
+    size_t path_len = strlen(path);
+    char* tmp_path = malloc(path_len + 8);
+    if (tmp_path == NULL)
+    {
+        log_error("failed to allocate memory");
+        return false;
+    }
+    /* The index is replaced atomically, so a running PostSRSd instance
+       either maps the old or the new file */
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".XXXXXX", 8);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+    {
+        log_perror(errno, tmp_path);
+        free(tmp_path);
         return false;
-    return walk_domain_set(D, buffer, DOMAIN_SET_PARENTS_MATCH);
+    }
+    struct iovec iov[3];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = D->slots;
+    iov[1].iov_len = D->capacity * sizeof(struct domain_slot);
+    iov[2].iov_base = D->pool;
+    iov[2].iov_len = D->pool_size;
+    if (fchmod(fd, 0644) < 0 || !writev_all(fd, iov, 3) || fsync(fd) < 0)
+    {
+        log_perror(errno, tmp_path);
+        close(fd);
+        goto fail;
+    }
+    if (close(fd) < 0 || rename(tmp_path, path) < 0)
+    {
+        log_perror(errno, path);
+        goto fail;
+    }
+    free(tmp_path);
+    return true;
+
+fail:
+    unlink(tmp_path);
+    free(tmp_path);
+    return false;
 }
 
 struct pid_set
@@ -452,6 +1146,12 @@ void pid_set_wait(pid_set_t* P)
     }
 }
 
+void pid_set_clear(pid_set_t* P)
+{
+    if (P != NULL)
+        P->size = 0;
+}
+
 void pid_set_destroy(pid_set_t* P)
 {
     if (P == NULL)
@@ -890,8 +1590,11 @@ static void vlog(enum log_priority prio, const char* fmt, va_list ap)
     vsnprintf(text, sizeof(buffer) - prefix_len, fmt,  // flawfinder: ignore
               ap);
     buffer[sizeof(buffer) - 1] = 0;
+    /* Keep log lines from concurrent worker threads in one piece */
+    flockfile(stderr);
     fprintf(stderr, "%s\n", buffer);
     fflush(stderr);
+    funlockfile(stderr);
     if (use_syslog)
     {
         syslog(LOG_MAIL | syslog_priorities[prio], "%s", text);
@@ -1070,6 +1773,9 @@ sandbox_t* sandbox_init()
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(time), 0) < 0)
         goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(clock_gettime), 0)
+        < 0)
+        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(brk), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(madvise), 0) < 0)
@@ -1084,20 +1790,20 @@ sandbox_t* sandbox_init()
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(munmap), 0) < 0)
         goto fail;
-#    ifdef WITH_SQLITE
-    /* Syscalls for SQlite database access */
+    /* Spinlocks in shared memory yield to preempted lock holders */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(sched_yield), 0)
+        < 0)
+        goto fail;
+#    if defined(WITH_SQLITE) || defined(WITH_LMDB)
+    /* Syscalls for file-based database access */
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fstat), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(stat), 0) < 0)
         goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(getpid), 0) < 0)
-        goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(geteuid), 0) < 0)
-        goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(lseek), 0) < 0)
-        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(newfstatat), 0) < 0)
         goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(getpid), 0) < 0)
+        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fcntl), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(open), 0) < 0)
@@ -1108,33 +1814,86 @@ sandbox_t* sandbox_init()
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(pread64), 0) < 0)
         goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(preadv), 0) < 0)
-        goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(preadv2), 0) < 0)
-        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(pwrite64), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(pwritev), 0) < 0)
         goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(pwritev2), 0) < 0)
-        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fsync), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fdatasync), 0) < 0)
         goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(ftruncate), 0) < 0)
+        goto fail;
+#    endif
+#    ifdef WITH_SQLITE
+    /* Syscalls for SQlite database access */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(geteuid), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(lseek), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(preadv), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(preadv2), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(pwritev2), 0) < 0)
+        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(unlink), 0) < 0)
         goto fail;
+    /* Shared memory index of WAL databases, and memory-mapped I/O */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(mremap), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(access), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(faccessat), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(readlink), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(lstat), 0) < 0)
+        goto fail;
     /* SQLite calls fchown if it detects that it is run as root */
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(fchown), 0)
         < 0)
         goto fail;
 #    endif
+#    ifdef WITH_LMDB
+    /* Syscalls for LMDB database access: the lock file holds
+       process-shared mutexes, and the data file is memory-mapped */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(msync), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(futex), 0) < 0)
+        goto fail;
+#    endif
 #    ifdef WITH_REDIS
     /* Syscalls for Redis database access */
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(sendto), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(recvfrom), 0) < 0)
         goto fail;
+    /* Syscalls for reopening a lost Redis connection, including the DNS
+       lookup of its hostname. The socket type is masked with 0xf to ignore
+       the SOCK_CLOEXEC and SOCK_NONBLOCK flags. */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket), 1,
+                         SCMP_A1(SCMP_CMP_MASKED_EQ, 0xf, SOCK_STREAM))
+        < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket), 1,
+                         SCMP_A1(SCMP_CMP_MASKED_EQ, 0xf, SOCK_DGRAM))
+        < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(sendmmsg), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(connect), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fcntl), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(poll), 0) < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsockopt), 0)
+        < 0)
+        goto fail;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(getsockopt), 0)
+        < 0)
+        goto fail;
 #    endif
 #    ifdef __SANITIZE_ADDRESS__
     /* These syscalls are used by the Address Sanitizer */
@@ -1159,9 +1918,6 @@ sandbox_t* sandbox_init()
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(wait4), 0) < 0)
         goto fail;
-    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(sched_yield), 0)
-        < 0)
-        goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(ptrace), 0) < 0)
         goto fail;
     if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(getdents64), 0) < 0)
@@ -1184,6 +1940,106 @@ fail:
 #endif
 }
 
+bool sandbox_allow_accept(sandbox_t* sandbox)
+{
+    MAYBE_UNUSED(sandbox);
+#ifdef WITH_SECCOMP
+    scmp_filter_ctx scmp_ctx = (scmp_filter_ctx)sandbox;
+    if (scmp_ctx == NULL)
+        return false;
+    /* Syscalls for pool workers which accept their own connections */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(accept), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(accept4), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(poll), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(ppoll), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(fcntl), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(getppid), 0) < 0)
+        return false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool sandbox_allow_epoll(sandbox_t* sandbox)
+{
+    MAYBE_UNUSED(sandbox);
+#ifdef WITH_SECCOMP
+    scmp_filter_ctx scmp_ctx = (scmp_filter_ctx)sandbox;
+    if (scmp_ctx == NULL)
+        return false;
+    /* Syscalls for the event-driven socketmap engine */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(epoll_create1), 0)
+        < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(epoll_ctl), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(epoll_wait), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(epoll_pwait), 0)
+        < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(sendto), 0) < 0)
+        return false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool sandbox_allow_threads(sandbox_t* sandbox)
+{
+    MAYBE_UNUSED(sandbox);
+#ifdef WITH_SECCOMP
+    scmp_filter_ctx scmp_ctx = (scmp_filter_ctx)sandbox;
+    if (scmp_ctx == NULL)
+        return false;
+    /* Syscalls for worker threads; only threads may be cloned, not
+       processes */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(clone), 1,
+                         SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_THREAD,
+                                 CLONE_THREAD))
+        < 0)
+        return false;
+#    ifdef __SNR_clone3
+    /* The clone3 flags cannot be inspected, so we make the C library fall
+       back to clone */
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3),
+                         0)
+        < 0)
+        return false;
+#    endif
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(futex), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(set_robust_list),
+                         0)
+        < 0)
+        return false;
+#    ifdef __SNR_rseq
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(rseq), 0) < 0)
+        return false;
+#    endif
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(rt_sigprocmask), 0)
+        < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(gettid), 0) < 0)
+        return false;
+    if (seccomp_rule_add(scmp_ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsockopt), 2,
+                         SCMP_A1(SCMP_CMP_EQ, SOL_SOCKET),
+                         SCMP_A2(SCMP_CMP_EQ, SO_RCVTIMEO))
+        < 0)
+        return false;
+    return true;
+#else
+    return false;
+#endif
+}
+
 bool sandbox_enable(sandbox_t* sandbox)
 {
     MAYBE_UNUSED(sandbox);
@@ -1214,6 +2070,15 @@ int signal_set_handler(int signum, signal_handler_t handler)
     return sigaction(signum, &sact, NULL);
 }
 
+int signal_set_handler_restart(int signum, signal_handler_t handler)
+{
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    struct sigaction sact = {
+        .sa_handler = handler, .sa_mask = no_signals, .sa_flags = SA_RESTART};
+    return sigaction(signum, &sact, NULL);
+}
+
 int signal_reset_handler(int signum)
 {
     sigset_t no_signals;
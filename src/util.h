@@ -26,15 +26,24 @@
 #define MAYBE_UNUSED(x) (void)(x)
 
 #ifdef __GNUC__
-#    define ATTRIBUTE(x) __attribute__((x))
+#    define ATTRIBUTE(x)           __attribute__((x))
+#    define ATOMIC_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#    define ATOMIC_STORE(var, val) \
+        __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#    define ATOMIC_ADD(var, val) \
+        __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
 #else
 #    define ATTRIBUTE(x)
+#    define ATOMIC_LOAD(var)       (var)
+#    define ATOMIC_STORE(var, val) ((var) = (val))
+#    define ATOMIC_ADD(var, val)   ((var) += (val))
 #endif
 
 #define NONEMPTY_STRING(s)      ((s) != NULL && *(s) != 0)
 #define NULL_OR_EMPTY_STRING(s) ((s) == NULL || *(s) == 0)
 
 struct pollfd;
+struct timespec;
 struct domain_set;
 typedef struct domain_set domain_set_t;
 struct pid_set;
@@ -57,6 +66,8 @@ bool string_equal(const void* s1, const void* s2);
 void string_set(char** var, char* value);
 char* b32h_encode(const char* data, size_t length, char* buffer,
                   size_t bufsize);
+char* b32h_decode(const char* data, size_t length, char* buffer,
+                  size_t bufsize);
 
 bool file_exists(const char* filename);
 bool directory_exists(const char* dirname);
@@ -66,11 +77,22 @@ void lock_release(const char* path, int fd);
 
 bool read_all(int fd, void* buffer, size_t size);
 bool writev_all(int fd, struct iovec* iov, size_t numv);
+void deadline_after(struct timespec* deadline, unsigned ms);
+bool wait_readable(int fd, const struct timespec* deadline);
 
 domain_set_t* domain_set_create();
 bool domain_set_add(domain_set_t* D, const char* domain);
 bool domain_set_contains(domain_set_t* D, const char* domain);
 void domain_set_destroy(domain_set_t* D);
+size_t domain_set_memory(domain_set_t* D);
+const char* domain_set_first(domain_set_t* D);
+bool domain_set_read_file(domain_set_t* D, const char* path);
+bool domain_set_write_index(domain_set_t* D, const char* path);
+bool domain_set_share_updates(domain_set_t* D);
+bool domain_set_update(domain_set_t* D, const char* domain, bool add);
+bool domain_set_update_from(domain_set_t* D, domain_set_t* T, size_t* added,
+                            size_t* removed);
+bool is_valid_domain_name(const char* s);
 
 pid_set_t* pid_set_create();
 size_t pid_set_size(pid_set_t* P);
@@ -78,6 +100,7 @@ bool pid_set_add(pid_set_t* P, pid_t pid);
 bool pid_set_remove(pid_set_t* P, pid_t pid);
 bool pid_set_kill(pid_set_t* P, int signal);
 void pid_set_wait(pid_set_t* P);
+void pid_set_clear(pid_set_t* P);
 void pid_set_destroy(pid_set_t* P);
 
 list_t* list_create();
@@ -134,12 +157,16 @@ struct sandbox;
 typedef struct sandbox sandbox_t;
 
 sandbox_t* sandbox_init();
+bool sandbox_allow_accept(sandbox_t* sandbox);
+bool sandbox_allow_epoll(sandbox_t* sandbox);
+bool sandbox_allow_threads(sandbox_t* sandbox);
 bool sandbox_enable(sandbox_t* sandbox);
 void sandbox_release(sandbox_t* sandbox);
 
 typedef void (*signal_handler_t)(int);
 int signal_set_handler(int signum, signal_handler_t handler);
 int signal_set_handler_once(int signum, signal_handler_t handler);
+int signal_set_handler_restart(int signum, signal_handler_t handler);
 int signal_ignore(int signum);
 int signal_reset_handler(int signum);
 
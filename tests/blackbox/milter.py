@@ -71,12 +71,16 @@ def execute_queries(
     ],
     database: Database = Database.NONE,
     socket_family: SocketFamily = SocketFamily.UNIX,
+    worker_pool: int = 0,
+    worker_threads: int = 0,
 ):
     with PostSRSd(
         postsrsd,
         when=when,
         database=database,
         socket_family=socket_family,
+        worker_pool=worker_pool,
+        worker_threads=worker_threads,
         socket_type=SocketType.MILTER,
     ) as daemon:
         with daemon.connect_stream() as sock_stream:
@@ -631,6 +635,22 @@ if __name__ == "__main__":
             socket_family=socket_family,
         ):
             sys.exit(1)
+        if not execute_queries(
+            sys.argv[1],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=STATELESS_QUERIES,
+            socket_family=socket_family,
+            worker_pool=2,
+        ):
+            sys.exit(1)
+        if not execute_queries(
+            sys.argv[1],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=STATELESS_QUERIES,
+            socket_family=socket_family,
+            worker_threads=2,
+        ):
+            sys.exit(1)
         if sys.argv[2] == "1":
             if not execute_queries(
                 sys.argv[1],
@@ -640,6 +660,24 @@ if __name__ == "__main__":
                 socket_family=socket_family,
             ):
                 sys.exit(1)
+            if not execute_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=DATABASE_QUERIES,
+                database=Database.SQLITE,
+                socket_family=socket_family,
+                worker_pool=2,
+            ):
+                sys.exit(1)
+            if not execute_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=DATABASE_QUERIES,
+                database=Database.SQLITE,
+                socket_family=socket_family,
+                worker_threads=2,
+            ):
+                sys.exit(1)
         if sys.argv[3] == "1":
             if not execute_queries(
                 sys.argv[1],
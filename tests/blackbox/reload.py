@@ -15,6 +15,7 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #
 import itertools
+import sqlite3
 import sys
 import time
 
@@ -32,8 +33,20 @@ def run_query(sock_stream: SockStream, test_domain: str):
         )
 
 
-def reload_daemon(postsrsd: str, use_file_watch: bool):
-    with PostSRSd(postsrsd, use_file_watch=use_file_watch) as daemon:
+def reload_daemon(
+    postsrsd: str,
+    use_file_watch: bool,
+    worker_pool: int = 0,
+    worker_threads: int = 0,
+    socketmap_engine: str = "process",
+):
+    with PostSRSd(
+        postsrsd,
+        use_file_watch=use_file_watch,
+        worker_pool=worker_pool,
+        worker_threads=worker_threads,
+        socketmap_engine=socketmap_engine,
+    ) as daemon:
         sock_stream = daemon.connect_stream()
         try:
             previous_domain = "example.com"
@@ -71,8 +84,9 @@ def reload_daemon(postsrsd: str, use_file_watch: bool):
                     daemon.reload()
                 try:
                     # We deliberately keep the connection open and continue querying
-                    # PostSRSd. The daemon should close the connection as soon as the
-                    # configuration has been reloaded.
+                    # PostSRSd. The old worker keeps answering with the previous
+                    # configuration, but closes the connection once the keep-alive
+                    # time has passed after the reload.
                     max_wait = 100
                     while max_wait > 0:
                         run_query(sock_stream, previous_domain)
@@ -96,10 +110,216 @@ def reload_daemon(postsrsd: str, use_file_watch: bool):
     return True
 
 
+def graceful_reload(
+    postsrsd: str,
+    worker_pool: int = 0,
+    worker_threads: int = 0,
+    socketmap_engine: str = "process",
+):
+    with PostSRSd(
+        postsrsd,
+        worker_pool=worker_pool,
+        worker_threads=worker_threads,
+        socketmap_engine=socketmap_engine,
+    ) as daemon:
+        sock_stream = daemon.connect_stream()
+        try:
+            run_query(sock_stream, "example.com")
+            with open(daemon.domains_file, "w") as f:
+                f.write("reloaded.com\n")
+            daemon.reload()
+            # The open connection survives the reload and is still served with
+            # the previous configuration.
+            time.sleep(0.3)
+            run_query(sock_stream, "example.com")
+            # Once the connection is idle, the old worker closes it.
+            time.sleep(2)
+            try:
+                netstring_write(sock_stream, "forward test@otherdomain.com")
+                netstring_read(sock_stream)
+                raise AssertionError("idle connection was not closed")
+            except (ConnectionError, TimeoutError):
+                pass
+            sock_stream.close()
+            sock_stream = daemon.connect_stream()
+            run_query(sock_stream, "reloaded.com")
+            sys.stderr.write(
+                f"PASS: graceful reload [pool={worker_pool}, threads={worker_threads}, "
+                f"engine={socketmap_engine}]\n"
+            )
+        except Exception as e:
+            sys.stderr.write(f"*** FAIL: {e.__class__.__name__}: {str(e)}\n")
+            return False
+        finally:
+            sock_stream.close()
+    return True
+
+
+def slow_reload(postsrsd: str):
+    with PostSRSd(postsrsd, database=Database.SQLITE) as daemon:
+        # The unprivileged check of the new configuration opens the database,
+        # which is locked for a while, so the check takes a few seconds.
+        config = daemon.config_file.read_text()
+        daemon.config_file.write_text(
+            config.replace('postsrsd.db"', 'postsrsd.db?busy-timeout=5000"')
+        )
+        with open(daemon.domains_file, "w") as f:
+            f.write("reloaded.com\n")
+        lock = sqlite3.connect(daemon.database_file, isolation_level=None)
+        try:
+            lock.execute("BEGIN EXCLUSIVE")
+            daemon.reload()
+            # New connections are still accepted and served with the previous
+            # configuration while the check runs.
+            started = time.monotonic()
+            while time.monotonic() - started < 2.5:
+                with daemon.connect_stream() as sock_stream:
+                    netstring_write(sock_stream, "forward test@example.com")
+                    result = netstring_read(sock_stream)
+                    if not result.startswith("NOTFOUND"):
+                        raise AssertionError(f"expected 'NOTFOUND', got {result!r}")
+                time.sleep(0.1)
+            lock.execute("ROLLBACK")
+            max_wait = 100
+            while max_wait > 0:
+                with daemon.connect_stream() as sock_stream:
+                    netstring_write(sock_stream, "forward test@otherdomain.com")
+                    if netstring_read(sock_stream).endswith("@reloaded.com"):
+                        break
+                time.sleep(0.1)
+                max_wait -= 1
+            if max_wait == 0:
+                raise AssertionError("configuration update failed")
+            sys.stderr.write("PASS: slow reload\n")
+        except Exception as e:
+            sys.stderr.write(f"*** FAIL: {e.__class__.__name__}: {str(e)}\n")
+            return False
+        finally:
+            lock.close()
+    return True
+
+
+def drain_idle_connection(
+    postsrsd: str,
+    socket_type: SocketType,
+    keep_alive: int,
+    worker_pool: int = 0,
+    worker_threads: int = 0,
+):
+    with PostSRSd(
+        postsrsd,
+        socket_type=socket_type,
+        worker_pool=worker_pool,
+        worker_threads=worker_threads,
+        keep_alive=keep_alive,
+    ) as daemon:
+        sock = daemon.connect()
+        sock.settimeout(10)
+        sock_stream = SockStream(sock)
+        try:
+            if socket_type == SocketType.MILTER:
+                milter_write(sock_stream, struct.pack(">cLLL", b"O", 6, 0xFF, 0xFF))
+                if milter_read(sock_stream)[:1] != b"O":
+                    raise AssertionError("milter option negotiation failed")
+            else:
+                run_query(sock_stream, "example.com")
+            daemon.reload()
+            # The idle connection is closed shortly after the reload, long
+            # before the keep-alive time has passed.
+            started = time.monotonic()
+            try:
+                sock_stream.read(1)
+                raise AssertionError("idle connection received unexpected data")
+            except ConnectionError:
+                pass
+            elapsed = time.monotonic() - started
+            if elapsed > 3:
+                raise AssertionError(f"idle connection was closed after {elapsed:.1f} s")
+            sys.stderr.write(
+                f"PASS: drain idle connection [{socket_type.name.lower()}, "
+                f"keep-alive={keep_alive}, pool={worker_pool}, "
+                f"threads={worker_threads}]\n"
+            )
+        except Exception as e:
+            sys.stderr.write(f"*** FAIL: {e.__class__.__name__}: {str(e)}\n")
+            return False
+        finally:
+            sock_stream.close()
+    return True
+
+
+def update_domains(postsrsd: str, worker_pool: int = 0):
+    with PostSRSd(postsrsd, use_file_watch=True, worker_pool=worker_pool) as daemon:
+        sock_stream = daemon.connect_stream()
+        try:
+            for domains, local in [
+                ("example.com\nadded.org\n", True),
+                ("example.com\n", False),
+            ]:
+                tmp_file = pathlib.Path(str(daemon.domains_file) + ".tmp")
+                with open(tmp_file, "w") as f:
+                    f.write(domains)
+                tmp_file.rename(daemon.domains_file)
+                # The connection stays open, because adding or removing a
+                # domain does not require the workers to restart.
+                max_wait = 100
+                while max_wait > 0:
+                    netstring_write(sock_stream, "forward test@added.org")
+                    result = netstring_read(sock_stream)
+                    if result.startswith("NOTFOUND") == local:
+                        break
+                    time.sleep(0.1)
+                    max_wait -= 1
+                if max_wait == 0:
+                    raise AssertionError("domain update failed")
+                run_query(sock_stream, "example.com")
+                sys.stderr.write(
+                    f"PASS: domain update [added.org {'local' if local else 'remote'}]\n"
+                )
+        except Exception as e:
+            sys.stderr.write(f"*** FAIL: {e.__class__.__name__}: {str(e)}\n")
+            return False
+        finally:
+            sock_stream.close()
+    return True
+
+
 if __name__ == "__main__":
     if not reload_daemon(sys.argv[1], use_file_watch=False):
         sys.exit(1)
+    if not reload_daemon(sys.argv[1], use_file_watch=False, worker_pool=2):
+        sys.exit(1)
+    if not reload_daemon(sys.argv[1], use_file_watch=False, worker_threads=2):
+        sys.exit(1)
+    if not reload_daemon(sys.argv[1], use_file_watch=False, socketmap_engine="event"):
+        sys.exit(1)
+    if not graceful_reload(sys.argv[1]):
+        sys.exit(1)
+    if not graceful_reload(sys.argv[1], worker_pool=2):
+        sys.exit(1)
+    if not graceful_reload(sys.argv[1], worker_threads=2):
+        sys.exit(1)
+    if not graceful_reload(sys.argv[1], socketmap_engine="event"):
+        sys.exit(1)
+    if not slow_reload(sys.argv[1]):
+        sys.exit(1)
+    for socket_type, keep_alive, worker_pool, worker_threads in [
+        (SocketType.MILTER, 30, 0, 0),
+        (SocketType.MILTER, 30, 2, 0),
+        (SocketType.MILTER, 30, 0, 2),
+        (SocketType.MILTER, 0, 0, 2),
+        (SocketType.SOCKETMAP, 30, 0, 2),
+        (SocketType.SOCKETMAP, 0, 0, 2),
+    ]:
+        if not drain_idle_connection(
+            sys.argv[1], socket_type, keep_alive, worker_pool, worker_threads
+        ):
+            sys.exit(1)
     if sys.argv[2] == "1":
         if not reload_daemon(sys.argv[1], use_file_watch=True):
             sys.exit(1)
+        if not update_domains(sys.argv[1]):
+            sys.exit(1)
+        if not update_domains(sys.argv[1], worker_pool=2):
+            sys.exit(1)
     sys.exit(0)
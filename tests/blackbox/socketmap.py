@@ -15,6 +15,7 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #
 import sys
+import time
 
 from testhelper import *
 from collections.abc import Iterable
@@ -26,12 +27,18 @@ def execute_queries(
     queries: Iterable[tuple[str, str]],
     database: Database = Database.NONE,
     socket_family: SocketFamily = SocketFamily.UNIX,
+    worker_pool: int = 0,
+    worker_threads: int = 0,
+    socketmap_engine: str = "process",
 ):
     with PostSRSd(
         postsrsd,
         when=when,
         database=database,
         socket_family=socket_family,
+        worker_pool=worker_pool,
+        worker_threads=worker_threads,
+        socketmap_engine=socketmap_engine,
         socket_type=SocketType.SOCKETMAP,
     ) as daemon:
         with daemon.connect_stream() as sock_stream:
@@ -52,10 +59,106 @@ def execute_queries(
     return True
 
 
+def execute_pipelined_queries(
+    postsrsd: str,
+    when: str,
+    queries: list[tuple[str, str]],
+    socket_family: SocketFamily = SocketFamily.UNIX,
+    socketmap_engine: str = "process",
+):
+    with PostSRSd(
+        postsrsd,
+        when=when,
+        socket_family=socket_family,
+        socketmap_engine=socketmap_engine,
+        socket_type=SocketType.SOCKETMAP,
+    ) as daemon:
+        with daemon.connect_stream() as sock_stream:
+            try:
+                # Send all queries at once, then collect the replies
+                request = b""
+                for query in queries:
+                    data = query[0].encode()
+                    request += f"{len(data)}:".encode() + data + b","
+                sock_stream.write(request)
+                for query in queries:
+                    result = netstring_read(sock_stream)
+                    if result != query[1]:
+                        raise AssertionError(
+                            f"{query[0]!r}: expected reply {query[1]!r}, got: {result!r}"
+                        )
+                sys.stderr.write(
+                    f"PASS: {socket_family!r},{socketmap_engine},pipelined\n"
+                )
+            except AssertionError as e:
+                sys.stderr.write(
+                    f"*** FAIL: {socket_family!r},{socketmap_engine},{str(e)}\n"
+                )
+                return False
+    return True
+
+
+def connection_lifecycle(
+    postsrsd: str,
+    when: str,
+    socket_family: SocketFamily = SocketFamily.UNIX,
+    socketmap_engine: str = "process",
+):
+    with PostSRSd(
+        postsrsd,
+        when=when,
+        socket_family=socket_family,
+        socketmap_engine=socketmap_engine,
+        socket_type=SocketType.SOCKETMAP,
+    ) as daemon:
+        try:
+            # The client shuts down its end right after the request, but still
+            # expects the reply
+            with daemon.connect_stream() as sock_stream:
+                netstring_write(sock_stream, "forward test@example.com")
+                sock_stream.shutdown_write()
+                result = netstring_read(sock_stream)
+                if result != "NOTFOUND Need not rewrite local domain.":
+                    raise AssertionError(
+                        f"half-closed connection: unexpected reply {result!r}"
+                    )
+            # An idle connection is closed after the keep-alive timeout
+            with daemon.connect_stream() as sock_stream:
+                netstring_write(sock_stream, "forward test@example.com")
+                netstring_read(sock_stream)
+                time.sleep(2.5)
+                try:
+                    sock_stream.read(1)
+                    raise AssertionError("idle connection was not closed")
+                except ConnectionResetError:
+                    pass
+                except TimeoutError:
+                    raise AssertionError("idle connection was not closed")
+            sys.stderr.write(
+                f"PASS: {socket_family!r},{socketmap_engine},connection lifecycle\n"
+            )
+        except Exception as e:
+            sys.stderr.write(
+                f"*** FAIL: {socket_family!r},{socketmap_engine},"
+                f"{e.__class__.__name__}: {str(e)}\n"
+            )
+            return False
+    return True
+
+
 def socketmap_protocol_violations(
-    postsrsd: str, when: str, queries: Iterable[bytes], socket_family: SocketFamily
+    postsrsd: str,
+    when: str,
+    queries: Iterable[bytes],
+    socket_family: SocketFamily,
+    socketmap_engine: str = "process",
 ):
-    with PostSRSd(postsrsd, when=when, socket_family=socket_family) as daemon:
+    with PostSRSd(
+        postsrsd,
+        when=when,
+        socket_family=socket_family,
+        socketmap_engine=socketmap_engine,
+    ) as daemon:
         for query in queries:
             with daemon.connect_stream() as sock_stream:
                 try:
@@ -277,6 +380,30 @@ if __name__ == "__main__":
             socket_family=socket_family,
         ):
             sys.exit(1)
+        if not execute_queries(
+            sys.argv[1],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=STATELESS_QUERIES,
+            socket_family=socket_family,
+            worker_pool=2,
+        ):
+            sys.exit(1)
+        if not execute_queries(
+            sys.argv[1],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=STATELESS_QUERIES,
+            socket_family=socket_family,
+            worker_threads=2,
+        ):
+            sys.exit(1)
+        if not execute_queries(
+            sys.argv[1],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=STATELESS_QUERIES,
+            socket_family=socket_family,
+            socketmap_engine="event",
+        ):
+            sys.exit(1)
         if sys.argv[2] == "1":
             if not execute_queries(
                 sys.argv[1],
@@ -286,6 +413,33 @@ if __name__ == "__main__":
                 socket_family=socket_family,
             ):
                 sys.exit(1)
+            if not execute_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=DATABASE_QUERIES,
+                database=Database.SQLITE,
+                socket_family=socket_family,
+                worker_pool=2,
+            ):
+                sys.exit(1)
+            if not execute_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=DATABASE_QUERIES,
+                database=Database.SQLITE,
+                socket_family=socket_family,
+                worker_threads=2,
+            ):
+                sys.exit(1)
+            if not execute_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=DATABASE_QUERIES,
+                database=Database.SQLITE,
+                socket_family=socket_family,
+                socketmap_engine="event",
+            ):
+                sys.exit(1)
         if sys.argv[3] == "1":
             if not execute_queries(
                 sys.argv[1],
@@ -295,21 +449,47 @@ if __name__ == "__main__":
                 socket_family=socket_family,
             ):
                 sys.exit(1)
-        if not socketmap_protocol_violations(
+        if not execute_queries(
             sys.argv[1],
-            when="1577836860",
-            queries=[
-                # Empty query
-                b"0:,",
-                # Netstring that exceeds the allowed length
-                (b"1024:forward " + b"a" * 1016 + b","),
-                # Old-style TCP table query
-                b"get test@example.com\n",
-                # Excessively large netstring length
-                b"18446744073709551616:some data...",
-                # Invalid netstring terminator
-                b"28:forward test@otherdomain.com;",
-            ],
+            when="1577836860",  # 2020-01-01 00:01:00 UTC
+            queries=DATABASE_QUERIES,
+            database=Database.MMAP,
             socket_family=socket_family,
+            worker_pool=2,
         ):
             sys.exit(1)
+        for socketmap_engine in ["process", "event"]:
+            if not execute_pipelined_queries(
+                sys.argv[1],
+                when="1577836860",  # 2020-01-01 00:01:00 UTC
+                queries=STATELESS_QUERIES,
+                socket_family=socket_family,
+                socketmap_engine=socketmap_engine,
+            ):
+                sys.exit(1)
+            if not connection_lifecycle(
+                sys.argv[1],
+                when="1577836860",
+                socket_family=socket_family,
+                socketmap_engine=socketmap_engine,
+            ):
+                sys.exit(1)
+            if not socketmap_protocol_violations(
+                sys.argv[1],
+                when="1577836860",
+                queries=[
+                    # Empty query
+                    b"0:,",
+                    # Netstring that exceeds the allowed length
+                    (b"1024:forward " + b"a" * 1016 + b","),
+                    # Old-style TCP table query
+                    b"get test@example.com\n",
+                    # Excessively large netstring length
+                    b"18446744073709551616:some data...",
+                    # Invalid netstring terminator
+                    b"28:forward test@otherdomain.com;",
+                ],
+                socket_family=socket_family,
+                socketmap_engine=socketmap_engine,
+            ):
+                sys.exit(1)
@@ -40,6 +40,7 @@ class Database(enum.Enum):
     NONE = 0
     SQLITE = 1
     REDIS = 2
+    MMAP = 3
 
 
 class SockStream:
@@ -70,6 +71,9 @@ class SockStream:
     def write(self, data: bytes):
         self._sock.sendall(data)
 
+    def shutdown_write(self):
+        self._sock.shutdown(socket.SHUT_WR)
+
     def close(self):
         self._sock.close()
 
@@ -113,6 +117,10 @@ class PostSRSd:
         socket_family: SocketFamily = SocketFamily.UNIX,
         socket_type: SocketType = SocketType.SOCKETMAP,
         use_file_watch: bool = False,
+        worker_pool: int = 0,
+        worker_threads: int = 0,
+        socketmap_engine: str = "process",
+        keep_alive: int = 1,
     ):
         self._executable = executable
         self._when = when
@@ -140,13 +148,18 @@ class PostSRSd:
                 database_uri = f'sqlite:{self._tmpdir_path / "postsrsd.db"}'
             elif database == Database.REDIS:
                 database_uri = "redis:localhost:6379"
+            elif database == Database.MMAP:
+                database_uri = f'mmap:{self._tmpdir_path / "postsrsd.kv"}'
             else:
                 database_uri = ""
             with open(self._tmpdir_path / "postsrsd.conf", "w") as f:
                 f.write(
                     f'domains-file = "{self._tmpdir_path / "postsrsd.domains"}"\n'
                     f'domains-file-watch = {"on" if use_file_watch else "off"}\n'
-                    "keep-alive = 1\n"
+                    f"keep-alive = {keep_alive}\n"
+                    f"worker-pool = {worker_pool}\n"
+                    f"worker-threads = {worker_threads}\n"
+                    f"socketmap-engine = {socketmap_engine}\n"
                     "milter-recipient-limit = 5\n"
                     'chroot-dir = ""\n'
                     'unprivileged-user = ""\n'
@@ -217,6 +230,14 @@ class PostSRSd:
     def domains_file(self) -> pathlib.Path:
         return self._tmpdir_path / "postsrsd.domains"
 
+    @property
+    def config_file(self) -> pathlib.Path:
+        return self._tmpdir_path / "postsrsd.conf"
+
+    @property
+    def database_file(self) -> pathlib.Path:
+        return self._tmpdir_path / "postsrsd.db"
+
     def cleanup(self):
         if self._notify_sock is not None:
             self._notify_sock.close()
@@ -71,8 +71,44 @@ START_TEST(config_domains_file)
 }
 END_TEST
 
+START_TEST(config_domains_index)
+{
+    FILE* f = fopen("domains.txt", "w");
+    fprintf(f, ".Wild.org\nexample.com\n");
+    fclose(f);
+    domain_set_t* D = domain_set_create();
+    ck_assert_int_eq(domain_set_read_file(D, "domains.txt"), true);
+    ck_assert_int_eq(domain_set_write_index(D, "domains.idx"), true);
+    domain_set_destroy(D);
+    cfg_t* cfg = config_defaults();
+    cfg_setstr(cfg, "domains-file", "domains.idx");
+
+    char* srs_domain = NULL;
+    ck_assert_int_eq(srs_domains_from_config(cfg, &srs_domain, &D), true);
+    ck_assert_int_eq(domain_set_contains(D, "example.com"), true);
+    ck_assert_int_eq(domain_set_contains(D, "mail.wild.org"), true);
+    ck_assert_int_eq(domain_set_contains(D, "other.org"), false);
+    /* The SRS domain is added on top of the read-only index */
+    ck_assert_str_eq(srs_domain, "wild.org");
+    ck_assert_int_eq(domain_set_contains(D, "wild.org"), true);
+    ck_assert_int_eq(domain_set_write_index(D, "domains.idx"), false);
+    domain_set_destroy(D);
+    free(srs_domain);
+
+    f = fopen("domains.idx", "r+");
+    fseek(f, -1, SEEK_END);
+    fputc('x', f);
+    fclose(f);
+    ck_assert_int_eq(srs_domains_from_config(cfg, &srs_domain, &D), false);
+    ck_assert_int_eq(unlink("domains.txt"), 0);
+    ck_assert_int_eq(unlink("domains.idx"), 0);
+    cfg_free(cfg);
+}
+END_TEST
+
 BEGIN_TEST_SUITE(config)
 ADD_TEST_CASE_WITH_UNCHECKED_FIXTURE(fs, setup_fs, teardown_fs)
 ADD_TEST_TO_TEST_CASE(fs, config_domains_file)
+ADD_TEST_TO_TEST_CASE(fs, config_domains_index)
 END_TEST_SUITE()
 TEST_MAIN(config)
@@ -18,9 +18,16 @@
 #include "database.h"
 
 #include <check.h>
+#include <fcntl.h>
 #include <postsrsd_build_config.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef WITH_SQLITE
+#    include <sqlite3.h>
+#endif
 
 START_TEST(invalid_database)
 {
@@ -55,6 +62,496 @@ START_TEST(database_sqlite_expiry)
     database_disconnect(db);
 }
 END_TEST
+
+START_TEST(database_sqlite_expire_batch)
+{
+    char key[16];
+    size_t removed;
+    database_t* db = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db);
+    for (int i = 0; i < 5; ++i)
+    {
+        snprintf(key, sizeof(key), "mykey%d", i);
+        database_write(db, key, "myvalue", 0);
+    }
+    database_write(db, "otherkey", "othervalue", 60);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 2);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 2);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 1);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 0);
+    char* value = database_read(db, "otherkey");
+    ck_assert_str_eq(value, "othervalue");
+    free(value);
+    database_disconnect(db);
+}
+END_TEST
+
+START_TEST(database_sqlite_alias)
+{
+    /* Aliases are binary and may contain NUL bytes */
+    static const char alias1[DATABASE_ALIAS_SIZE] = {0, 1};
+    static const char alias2[DATABASE_ALIAS_SIZE] = {0, 2};
+    database_t* db = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write_alias(db, alias1, "myvalue", 10));
+    ck_assert_ptr_null(database_read_alias(db, alias2));
+    char* value = database_read_alias(db, alias1);
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db);
+}
+END_TEST
+
+START_TEST(database_sqlite_legacy_keys)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char uri[64];
+    sqlite3* handle;
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+    /* Table layout and text key of an older version */
+    ck_assert_int_eq(sqlite3_open(path, &handle), SQLITE_OK);
+    ck_assert_int_eq(
+        sqlite3_exec(handle,
+                     "CREATE TABLE kv ("
+                     "k TEXT NOT NULL UNIQUE ON CONFLICT REPLACE,"
+                     "v TEXT NOT NULL,"
+                     "lt INTEGER NOT NULL);"
+                     "INSERT INTO kv VALUES ("
+                     "'5L86USRKAD956P1D5L86USRKAD956P1D@1',"
+                     "'user@example.com', 4102444800);"
+                     "INSERT INTO kv VALUES ('mykey', 'myvalue', 4102444800);",
+                     NULL, NULL, NULL),
+        SQLITE_OK);
+    sqlite3_close(handle);
+    snprintf(uri, sizeof(uri), "sqlite:%s", path);
+    database_t* db = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db);
+    char* value = database_read_alias(db, "-PostSRSd--PostSRSd-");
+    ck_assert_str_eq(value, "user@example.com");
+    free(value);
+    ck_assert_ptr_null(
+        database_read(db, "5L86USRKAD956P1D5L86USRKAD956P1D@1"));
+    database_disconnect(db);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_sqlite_reconnect)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char uri[64];
+    sqlite3* handle;
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+    snprintf(uri, sizeof(uri), "sqlite:%s?busy-timeout=0", path);
+    database_t* db = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write(db, "mykey", "myvalue", 60));
+    /* Enough failed reads on a locked database to reopen the connection */
+    ck_assert_int_eq(sqlite3_open(path, &handle), SQLITE_OK);
+    ck_assert_int_eq(
+        sqlite3_exec(handle, "BEGIN EXCLUSIVE", NULL, NULL, NULL), SQLITE_OK);
+    for (int i = 0; i < 20; ++i)
+        ck_assert_ptr_null(database_read(db, "mykey"));
+    sqlite3_exec(handle, "COMMIT", NULL, NULL, NULL);
+    sqlite3_close(handle);
+    char* value = database_read(db, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_sqlite_invalid_options)
+{
+    ck_assert_ptr_null(database_connect("sqlite::memory:?journal", true));
+    ck_assert_ptr_null(
+        database_connect("sqlite::memory:?journal=bogus", true));
+    ck_assert_ptr_null(
+        database_connect("sqlite::memory:?busy-timeout=-1", true));
+    ck_assert_ptr_null(database_connect("sqlite::memory:?batch=x", true));
+    ck_assert_ptr_null(database_connect("sqlite::memory:?foo=bar", true));
+}
+END_TEST
+
+START_TEST(database_sqlite_batch)
+{
+    database_t* db = database_connect(
+        "sqlite::memory:?profile=concurrent&synchronous=full&batch=4", true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write(db, "mykey1", "myvalue1", 10));
+    ck_assert(database_write(db, "mykey2", "myvalue2", 10));
+    char* value = database_read(db, "mykey1");
+    ck_assert_str_eq(value, "myvalue1");
+    free(value);
+    ck_assert(database_flush(db));
+    ck_assert(database_flush(db));
+    value = database_read(db, "mykey2");
+    ck_assert_str_eq(value, "myvalue2");
+    free(value);
+    database_disconnect(db);
+}
+END_TEST
+
+START_TEST(database_sqlite_batch_failure)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char uri[64];
+    sqlite3* handle;
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+    snprintf(uri, sizeof(uri), "sqlite:%s?batch=4", path);
+    database_t* db = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert_int_eq(sqlite3_open(path, &handle), SQLITE_OK);
+    ck_assert_int_eq(sqlite3_exec(handle,
+                                  "CREATE TRIGGER reject BEFORE INSERT ON kv "
+                                  "WHEN NEW.v = 'badvalue' BEGIN "
+                                  "SELECT RAISE(ABORT, 'rejected'); END",
+                                  NULL, NULL, NULL),
+                     SQLITE_OK);
+    sqlite3_close(handle);
+    /* A failed first write must not leave the batch transaction open */
+    ck_assert(!database_write(db, "badkey", "badvalue", 60));
+    ck_assert(database_write(db, "mykey", "myvalue", 60));
+    ck_assert(database_flush(db));
+    char* value = database_read(db, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_sqlite_cache)
+{
+    ck_assert(database_cache_init(16, 60, 60, 0));
+    database_t* db1 = database_connect("sqlite::memory:", true);
+    database_t* db2 = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db1);
+    ck_assert_ptr_nonnull(db2);
+    database_write(db1, "mykey", "myvalue", 60);
+    /* The second database does not have the key, so the value must have
+       been served from the cache */
+    char* value = database_read(db2, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db1);
+    database_disconnect(db2);
+    database_cache_shutdown();
+}
+END_TEST
+
+START_TEST(database_sqlite_write_coalescing)
+{
+    ck_assert(database_cache_init(16, 60, 60, 60));
+    database_t* db1 = database_connect("sqlite::memory:", true);
+    database_t* db2 = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db1);
+    ck_assert_ptr_nonnull(db2);
+    ck_assert(database_write(db1, "mykey", "myvalue", 60));
+    ck_assert(database_write(db2, "mykey", "myvalue", 60));
+    ck_assert(database_write(db2, "otherkey", "othervalue", 60));
+    database_cache_shutdown();
+    /* The repeated write must have been skipped */
+    ck_assert_ptr_null(database_read(db2, "mykey"));
+    char* value = database_read(db2, "otherkey");
+    ck_assert_str_eq(value, "othervalue");
+    free(value);
+    database_disconnect(db1);
+    database_disconnect(db2);
+}
+END_TEST
+
+START_TEST(database_sqlite_batch_coalescing)
+{
+    ck_assert(database_cache_init(16, 60, 60, 60));
+    database_t* db1 = database_connect("sqlite::memory:?batch=4", true);
+    database_t* db2 = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db1);
+    ck_assert_ptr_nonnull(db2);
+    /* Uncommitted writes must not suppress writes by other workers */
+    ck_assert(database_write(db1, "mykey", "myvalue", 60));
+    ck_assert(database_write(db2, "mykey", "myvalue", 60));
+    ck_assert(database_flush(db1));
+    ck_assert(database_write(db1, "otherkey", "othervalue", 60));
+    ck_assert(database_flush(db1));
+    ck_assert(database_write(db2, "otherkey", "othervalue", 60));
+    database_cache_shutdown();
+    char* value = database_read(db2, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    ck_assert_ptr_null(database_read(db2, "otherkey"));
+    database_disconnect(db1);
+    database_disconnect(db2);
+}
+END_TEST
+
+START_TEST(database_sqlite_cache_negative)
+{
+    ck_assert(database_cache_init(16, 60, 60, 0));
+    database_t* db = database_connect("sqlite::memory:", true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert_ptr_null(database_read(db, "mykey"));
+    ck_assert_ptr_null(database_read(db, "mykey"));
+    /* Writes must replace the cached negative result */
+    database_write(db, "mykey", "myvalue", 60);
+    char* value = database_read(db, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db);
+    database_cache_shutdown();
+}
+END_TEST
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+static char* mmap_database_uri(char* path)
+{
+    static char uri[64];
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+    unlink(path);
+    snprintf(uri, sizeof(uri), "mmap:%s?slots=64", path);
+    return uri;
+}
+
+START_TEST(database_mmap_key_value)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    const char* uri = mmap_database_uri(path);
+    database_t* db1 = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db1);
+    database_t* db2 = database_connect(uri, false);
+    ck_assert_ptr_nonnull(db2);
+    ck_assert_ptr_null(database_read(db1, "mykey"));
+    ck_assert(database_write(db1, "mykey", "myvalue", 10));
+    char* value = database_read(db2, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    ck_assert(database_write(db2, "mykey", "othervalue", 10));
+    value = database_read(db1, "mykey");
+    ck_assert_str_eq(value, "othervalue");
+    free(value);
+    /* Aliases are binary and may contain NUL bytes */
+    static const char alias1[DATABASE_ALIAS_SIZE] = {0, 1};
+    static const char alias2[DATABASE_ALIAS_SIZE] = {0, 2};
+    ck_assert(database_write_alias(db1, alias1, "myvalue", 10));
+    ck_assert_ptr_null(database_read_alias(db2, alias2));
+    value = database_read_alias(db2, alias1);
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    database_disconnect(db1);
+    database_disconnect(db2);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_mmap_expiry)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char key[16];
+    size_t removed;
+    database_t* db = database_connect(mmap_database_uri(path), true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write(db, "mykey", "myvalue", 0));
+    ck_assert_ptr_null(database_read(db, "mykey"));
+    /* More keys than slots: the entries which expire first are replaced */
+    for (int i = 0; i < 100; ++i)
+    {
+        snprintf(key, sizeof(key), "mykey%d", i);
+        ck_assert(database_write(db, key, "myvalue", 10 + i));
+    }
+    char* value = database_read(db, "mykey99");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    ck_assert(database_write(db, "otherkey", "othervalue", 0));
+    ck_assert(database_expire_batch(db, 0, &removed));
+    ck_assert_uint_eq(removed, 1);
+    database_disconnect(db);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_mmap_recovery)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char key[16];
+    const char* uri = mmap_database_uri(path);
+    database_t* db = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db);
+    database_disconnect(db);
+    /* Simulate a writer which was killed while it held all stripe locks and
+       the first slot */
+    char locks[1024];
+    uint32_t seq = 1;
+    memset(locks, 1, sizeof(locks));
+    int fd = open(path, O_RDWR);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pwrite(fd, locks, sizeof(locks), 24), sizeof(locks));
+    ck_assert_int_eq(pwrite(fd, &seq, sizeof(seq), 4096), sizeof(seq));
+    close(fd);
+    db = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db);
+    for (int i = 0; i < 100; ++i)
+    {
+        snprintf(key, sizeof(key), "mykey%d", i);
+        ck_assert(database_write(db, key, "myvalue", 10 + i));
+    }
+    database_disconnect(db);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(database_mmap_invalid)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(write(fd, "not a database", 14), 14);
+    close(fd);
+    char uri[64];
+    snprintf(uri, sizeof(uri), "mmap:%s", path);
+    ck_assert_ptr_null(database_connect(uri, true));
+    snprintf(uri, sizeof(uri), "mmap:%s?slots=1", path);
+    ck_assert_ptr_null(database_connect(uri, true));
+    unlink(path);
+}
+END_TEST
+#endif
+
+#ifdef WITH_LMDB
+static char* lmdb_database_uri(char* path)
+{
+    static char uri[64];
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+    unlink(path);
+    snprintf(uri, sizeof(uri), "lmdb:%s?map-size=1&sync=off", path);
+    return uri;
+}
+
+static void lmdb_database_remove(const char* path)
+{
+    char lock_path[64];
+    snprintf(lock_path, sizeof(lock_path), "%s-lock", path);
+    unlink(path);
+    unlink(lock_path);
+}
+
+START_TEST(database_lmdb_key_value)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    const char* uri = lmdb_database_uri(path);
+    ck_assert_ptr_null(database_connect(uri, false));
+    database_t* db1 = database_connect(uri, true);
+    ck_assert_ptr_nonnull(db1);
+    database_t* db2 = database_connect(uri, false);
+    ck_assert_ptr_nonnull(db2);
+    ck_assert_ptr_null(database_read(db1, "mykey"));
+    ck_assert(database_write(db1, "mykey", "myvalue", 10));
+    char* value = database_read(db2, "mykey");
+    ck_assert_str_eq(value, "myvalue");
+    free(value);
+    ck_assert(database_write(db2, "mykey", "othervalue", 10));
+    value = database_read(db1, "mykey");
+    ck_assert_str_eq(value, "othervalue");
+    free(value);
+    database_disconnect(db1);
+    database_disconnect(db2);
+    lmdb_database_remove(path);
+}
+END_TEST
+
+START_TEST(database_lmdb_expiry)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char key[16];
+    size_t removed;
+    database_t* db = database_connect(lmdb_database_uri(path), true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write(db, "mykey", "myvalue", 0));
+    ck_assert_ptr_null(database_read(db, "mykey"));
+    for (int i = 0; i < 4; ++i)
+    {
+        snprintf(key, sizeof(key), "mykey%d", i);
+        ck_assert(database_write(db, key, "myvalue", 0));
+    }
+    ck_assert(database_write(db, "otherkey", "othervalue", 60));
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 2);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 2);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 1);
+    ck_assert(database_expire_batch(db, 2, &removed));
+    ck_assert_uint_eq(removed, 0);
+    char* value = database_read(db, "otherkey");
+    ck_assert_str_eq(value, "othervalue");
+    free(value);
+    database_disconnect(db);
+    lmdb_database_remove(path);
+}
+END_TEST
+
+START_TEST(database_lmdb_expire_scan)
+{
+    char path[] = "/tmp/postsrsd_test_XXXXXX";
+    char key[16];
+    size_t removed;
+    database_t* db = database_connect(lmdb_database_uri(path), true);
+    ck_assert_ptr_nonnull(db);
+    /* The expired keys are sorted behind many more live keys than a single
+       transaction examines */
+    for (int i = 0; i < 10000; ++i)
+    {
+        snprintf(key, sizeof(key), "live%05d", i);
+        ck_assert(database_write(db, key, "myvalue", 60));
+    }
+    ck_assert(database_write(db, "old1", "myvalue", 0));
+    ck_assert(database_write(db, "old2", "myvalue", 0));
+    ck_assert(database_expire_batch(db, 10, &removed));
+    ck_assert_uint_eq(removed, 2);
+    ck_assert(database_expire_batch(db, 10, &removed));
+    ck_assert_uint_eq(removed, 0);
+    database_disconnect(db);
+    lmdb_database_remove(path);
+}
+END_TEST
+
+START_TEST(database_lmdb_invalid_options)
+{
+    ck_assert_ptr_null(database_connect("lmdb:/tmp/db?sync", true));
+    ck_assert_ptr_null(database_connect("lmdb:/tmp/db?sync=maybe", true));
+    ck_assert_ptr_null(database_connect("lmdb:/tmp/db?map-size=0", true));
+    ck_assert_ptr_null(database_connect("lmdb:/tmp/db?max-readers=x", true));
+    ck_assert_ptr_null(database_connect("lmdb:/tmp/db?foo=bar", true));
+}
+END_TEST
+#endif
+
+#ifdef WITH_REDIS
+START_TEST(database_redis_invalid_options)
+{
+    ck_assert_ptr_null(database_connect("redis:localhost:6379?writes", true));
+    ck_assert_ptr_null(
+        database_connect("redis:localhost:6379?writes=maybe", true));
+    ck_assert_ptr_null(
+        database_connect("redis:localhost:6379?max-pending=0", true));
+    ck_assert_ptr_null(database_connect("redis:localhost:6379?foo=bar", true));
+}
+END_TEST
 #endif
 
 #if defined(WITH_REDIS) && defined(TESTS_WITH_REDIS)
@@ -70,6 +567,24 @@ START_TEST(database_redis_key_value)
 }
 END_TEST
 
+START_TEST(database_redis_async_writes)
+{
+    database_t* db = database_connect(
+        "redis:localhost:6379?writes=async&max-pending=2", true);
+    ck_assert_ptr_nonnull(db);
+    ck_assert(database_write(db, "mykey1", "myvalue1", 10));
+    ck_assert(database_write(db, "mykey2", "myvalue2", 10));
+    ck_assert(database_write(db, "mykey3", "myvalue3", 10));
+    char* value = database_read(db, "mykey3");
+    ck_assert_str_eq(value, "myvalue3");
+    free(value);
+    value = database_read(db, "mykey1");
+    ck_assert_str_eq(value, "myvalue1");
+    free(value);
+    database_disconnect(db);
+}
+END_TEST
+
 START_TEST(database_redis_expiry)
 {
     database_t* db = database_connect("redis:localhost:6379", true);
@@ -91,9 +606,36 @@ ADD_TEST(invalid_database)
 #ifdef WITH_SQLITE
 ADD_TEST(database_sqlite_key_value)
 ADD_TEST(database_sqlite_expiry)
+ADD_TEST(database_sqlite_expire_batch)
+ADD_TEST(database_sqlite_alias)
+ADD_TEST(database_sqlite_legacy_keys)
+ADD_TEST(database_sqlite_reconnect)
+ADD_TEST(database_sqlite_invalid_options)
+ADD_TEST(database_sqlite_batch)
+ADD_TEST(database_sqlite_batch_failure)
+ADD_TEST(database_sqlite_cache)
+ADD_TEST(database_sqlite_cache_negative)
+ADD_TEST(database_sqlite_write_coalescing)
+ADD_TEST(database_sqlite_batch_coalescing)
+#endif
+#ifdef HAVE_SYS_MMAN_H
+ADD_TEST(database_mmap_key_value)
+ADD_TEST(database_mmap_expiry)
+ADD_TEST(database_mmap_recovery)
+ADD_TEST(database_mmap_invalid)
+#endif
+#ifdef WITH_LMDB
+ADD_TEST(database_lmdb_key_value)
+ADD_TEST(database_lmdb_expiry)
+ADD_TEST(database_lmdb_expire_scan)
+ADD_TEST(database_lmdb_invalid_options)
+#endif
+#ifdef WITH_REDIS
+ADD_TEST(database_redis_invalid_options)
 #endif
 #if defined(WITH_REDIS) && defined(TESTS_WITH_REDIS)
 ADD_TEST(database_redis_key_value)
+ADD_TEST(database_redis_async_writes)
 ADD_TEST(database_redis_expiry)
 #endif
 END_TEST_SUITE()
@@ -0,0 +1,131 @@
+/* PostSRSd - Sender Rewriting Scheme daemon for Postfix
+ * Copyright 2012-2026 Timo Röhling <timo@gaussglocke.de>
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "common.h"
+#include "metrics.h"
+
+#include <check.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+START_TEST(metrics_format_test)
+{
+    char buffer[16384];
+    size_t length;
+
+    /* Without metrics_init(), nothing is recorded but the format is valid */
+    metrics_inc(METRIC_FORWARD_REWRITTEN);
+    length = metrics_format(buffer, sizeof(buffer));
+    ck_assert_uint_eq(length, strlen(buffer));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_forward_total{result=\"rewritten\"} 0\n"));
+
+    ck_assert(metrics_init());
+    metrics_inc(METRIC_FORWARD_REWRITTEN);
+    metrics_inc(METRIC_FORWARD_REWRITTEN);
+    metrics_inc(METRIC_REVERSE_HASH_INVALID);
+    metrics_set(METRIC_CONNECTION_LIMIT, 200);
+    metrics_observe(METRIC_FORWARD_DURATION, metrics_start());
+    length = metrics_format(buffer, sizeof(buffer));
+    ck_assert_uint_eq(length, strlen(buffer));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "# TYPE postsrsd_forward_total counter\n"));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_forward_total{result=\"rewritten\"} 2\n"));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_reverse_total{result=\"hash_invalid\"} 1\n"));
+    ck_assert_ptr_nonnull(strstr(buffer, "postsrsd_connection_limit 200\n"));
+    ck_assert_ptr_nonnull(strstr(
+        buffer, "postsrsd_forward_duration_seconds_bucket{le=\"+Inf\"} 1\n"));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_forward_duration_seconds_count 1\n"));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_reverse_duration_seconds_count 0\n"));
+
+    /* Truncated output is still NUL-terminated */
+    length = metrics_format(buffer, 64);
+    ck_assert_uint_eq(length, 63);
+    ck_assert_uint_eq(strlen(buffer), 63);
+    metrics_shutdown();
+}
+END_TEST
+
+START_TEST(metrics_serve_test)
+{
+    char buffer[16384];
+    size_t received = 0;
+    ssize_t r;
+    int fds[2];
+
+    ck_assert(metrics_init());
+    metrics_inc(METRIC_CONNECTION_ACCEPTED);
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    ck_assert_int_eq(write(fds[1], "GET /metrics HTTP/1.0\r\n\r\n", 25), 25);
+    metrics_serve(fds[0]);
+    close(fds[0]);
+    while ((r = read(fds[1], buffer + received,
+                     sizeof(buffer) - 1 - received))
+           > 0)
+        received += r;
+    buffer[received] = 0;
+    close(fds[1]);
+    ck_assert_ptr_eq(strstr(buffer, "HTTP/1.0 200 OK\r\n"), buffer);
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "Content-Type: text/plain; version=0.0.4\r\n"));
+    ck_assert_ptr_nonnull(
+        strstr(buffer, "postsrsd_connections_total{result=\"accepted\"} 1\n"));
+    metrics_shutdown();
+}
+END_TEST
+
+START_TEST(metrics_serve_slow_client_test)
+{
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    pid_t pid = fork();
+    ck_assert_int_ge(pid, 0);
+    if (pid == 0)
+    {
+        /* Trickle the request header, one byte every 100 ms */
+        close(fds[0]);
+        for (int i = 0; i < 50; ++i)
+        {
+            if (write(fds[1], "X", 1) != 1)
+                break;
+            usleep(100000);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    time_t start = time(NULL);
+    metrics_serve(fds[0]);
+    ck_assert_int_le(time(NULL) - start, 2);
+    close(fds[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+END_TEST
+
+BEGIN_TEST_SUITE(metrics)
+ADD_TEST(metrics_format_test)
+ADD_TEST(metrics_serve_test)
+ADD_TEST(metrics_serve_slow_client_test)
+END_TEST_SUITE()
+TEST_MAIN(metrics)
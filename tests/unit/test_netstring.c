@@ -18,7 +18,9 @@
 #include "netstring.h"
 
 #include <check.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 START_TEST(netstring_encode_test)
@@ -149,9 +151,93 @@ START_TEST(netstring_io_test)
 }
 END_TEST
 
+START_TEST(netstring_reader_test)
+{
+    netstring_reader_t reader;
+    char* data;
+    size_t length;
+    int fds[2];
+    ck_assert_int_eq(pipe(fds), 0);
+    netstring_reader_init(&reader);
+
+    ck_assert_int_eq(write(fds[1], "8:PostSRSd,0:,3:ab", 18), 18);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 18);
+
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_nonnull(data);
+    ck_assert_uint_eq(length, 8);
+    ck_assert_str_eq(data, "PostSRSd");
+
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_nonnull(data);
+    ck_assert_uint_eq(length, 0);
+
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_null(data);
+    ck_assert_uint_eq(length, 0);
+
+    ck_assert_int_eq(write(fds[1], "c,", 2), 2);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 2);
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_nonnull(data);
+    ck_assert_uint_eq(length, 3);
+    ck_assert_str_eq(data, "abc");
+
+    ck_assert_int_eq(write(fds[1], "16:", 3), 3);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 3);
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_null(data);
+    ck_assert_uint_eq(length, SIZE_MAX);
+
+    netstring_reader_init(&reader);
+    ck_assert_int_eq(write(fds[1], "3:abc;", 6), 6);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 6);
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_null(data);
+    ck_assert_uint_eq(length, SIZE_MAX);
+
+    netstring_reader_init(&reader);
+    ck_assert_int_eq(write(fds[1], ":,", 2), 2);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 2);
+    data = netstring_reader_next(&reader, 16, &length);
+    ck_assert_ptr_null(data);
+    ck_assert_uint_eq(length, SIZE_MAX);
+
+    close(fds[1]);
+    ck_assert_int_eq(netstring_reader_fill(&reader, fds[0]), 0);
+    close(fds[0]);
+}
+END_TEST
+
+START_TEST(netstring_frame_test)
+{
+    char buffer[NETSTRING_HEADER_SIZE + 16];
+    char* data = buffer + NETSTRING_HEADER_SIZE;
+    char* result;
+    size_t length;
+
+    memcpy(data, "PostSRSd", 8);
+    result = netstring_frame(data, 8, &length);
+    ck_assert_ptr_eq(result, data - 2);
+    ck_assert_uint_eq(length, 11);
+    ck_assert_mem_eq(result, "8:PostSRSd,", length);
+
+    memcpy(data, "0123456789abcdef", 15);
+    result = netstring_frame(data, 15, &length);
+    ck_assert_uint_eq(length, 19);
+    ck_assert_mem_eq(result, "15:0123456789abcde,", length);
+
+    result = netstring_frame(data, 0, &length);
+    ck_assert_uint_eq(length, 3);
+    ck_assert_mem_eq(result, "0:,", length);
+}
+END_TEST
+
 BEGIN_TEST_SUITE(netstring)
 ADD_TEST(netstring_encode_test)
 ADD_TEST(netstring_decode_test)
 ADD_TEST(netstring_io_test)
+ADD_TEST(netstring_reader_test)
+ADD_TEST(netstring_frame_test)
 END_TEST_SUITE()
 TEST_MAIN(netstring)
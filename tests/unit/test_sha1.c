@@ -18,7 +18,9 @@
 #include "sha1.h"
 
 #include <check.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 START_TEST(sha1_test_vectors)
 {
@@ -82,8 +84,127 @@ START_TEST(hmac_sha1_test_vectors)
                      20);
 }
 
+START_TEST(hmac_sha1_precomputed_key)
+{
+    srs_hmac_key_t key;
+    srs_hmac_ctx_t ctx;
+    char digest[20];
+    srs_hmac_key_init(&key, "Jefe", 4);
+    for (int i = 0; i < 2; ++i)
+    {
+        srs_hmac_init_key(&ctx, &key);
+        srs_hmac_update(&ctx, "what do ya want for nothing?", 28);
+        srs_hmac_fini(&ctx, digest);
+        ck_assert_mem_eq(digest,
+                         "\xef\xfc\xdf\x6a\xe5\xeb\x2f\xa2\xd2\x74\x16\xd5"
+                         "\xf1\x84\xdf\x9c\x25\x9a\x7c\x79",
+                         20);
+    }
+    srs_hmac_init_key(&ctx, &key);
+    srs_hmac_fini(&ctx, digest);
+    ck_assert_mem_eq(digest,
+                     "\x09\xd9\xe5\x9d\x72\x23\x9e\x62\xa8\x15\x5c\x58\x3d\x52"
+                     "\x74\x3d\xe9\xb7\x23\x1a",
+                     20);
+}
+END_TEST
+
+START_TEST(sha1_backends_agree)
+{
+    char data[300];
+    char expected[20], digest[20];
+    unsigned seed = 1;
+    for (unsigned i = 0; i < sizeof(data); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)(seed >> 16);
+    }
+    ck_assert_int_eq(sha_backend_available(SHA_BACKEND_PORTABLE), 1);
+    for (int backend = 0; backend < SHA_NUM_BACKENDS; ++backend)
+    {
+        if (!sha_backend_available(backend))
+        {
+            ck_assert_int_eq(sha_set_backend(backend), 0);
+            continue;
+        }
+        ck_assert_int_eq(sha_set_backend(backend), 1);
+        ck_assert_int_eq(sha_get_backend(), backend);
+        ck_assert_ptr_nonnull(sha_backend_name(backend));
+        for (unsigned len = 0; len <= sizeof(data); ++len)
+        {
+            sha_set_backend(SHA_BACKEND_PORTABLE);
+            sha_digest(expected, data, len);
+            sha_set_backend(backend);
+            sha_digest(digest, data, len);
+            ck_assert_mem_eq(digest, expected, 20);
+        }
+        sha_digest(digest, "abc", 3);
+        ck_assert_mem_eq(digest,
+                         "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e\x25"
+                         "\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d",
+                         20);
+        srs_hmac_ctx_t ctx;
+        srs_hmac_init(&ctx, "Jefe", 4);
+        srs_hmac_update(&ctx, "what do ya want for nothing?", 28);
+        srs_hmac_fini(&ctx, digest);
+        ck_assert_mem_eq(digest,
+                         "\xef\xfc\xdf\x6a\xe5\xeb\x2f\xa2\xd2\x74\x16\xd5"
+                         "\xf1\x84\xdf\x9c\x25\x9a\x7c\x79",
+                         20);
+    }
+    ck_assert_int_eq(sha_set_backend(SHA_BACKEND_AUTO), 1);
+    ck_assert_int_ne(sha_get_backend(), SHA_BACKEND_AUTO);
+}
+END_TEST
+
+START_TEST(hmac_sha1_multi_lane)
+{
+    srs_hmac_key_t keys[SRS_HMAC_LANES];
+    srs_hmac_multi_ctx_t mctx;
+    srs_hmac_ctx_t ctx;
+    char secret[16];
+    char data[150];
+    char expected[20];
+    char digests[SRS_HMAC_LANES * 20];
+
+    for (unsigned i = 0; i < sizeof(data); ++i)
+        data[i] = (char)(i * 7);
+    for (int i = 0; i < SRS_HMAC_LANES; ++i)
+    {
+        snprintf(secret, sizeof(secret), "secret%d", i);
+        srs_hmac_key_init(&keys[i], secret, strlen(secret));
+    }
+    /* The portable backend selects the generic multi-lane code */
+    for (int backend = SHA_BACKEND_PORTABLE; backend <= SHA_BACKEND_AUTO;
+         --backend)
+    {
+        ck_assert_int_eq(sha_set_backend(backend), 1);
+        for (unsigned num_keys = 1; num_keys <= SRS_HMAC_LANES; ++num_keys)
+        {
+            for (unsigned len = 0; len <= sizeof(data); len += 17)
+            {
+                srs_hmac_multi_init(&mctx, keys, num_keys);
+                srs_hmac_multi_update(&mctx, data, len / 2);
+                srs_hmac_multi_update(&mctx, data + len / 2, len - len / 2);
+                srs_hmac_multi_fini(&mctx, digests);
+                for (unsigned i = 0; i < num_keys; ++i)
+                {
+                    srs_hmac_init_key(&ctx, &keys[i]);
+                    srs_hmac_update(&ctx, data, len);
+                    srs_hmac_fini(&ctx, expected);
+                    ck_assert_mem_eq(digests + 20 * i, expected, 20);
+                }
+            }
+        }
+    }
+}
+END_TEST
+
 BEGIN_TEST_SUITE(sha1)
 ADD_TEST(sha1_test_vectors)
 ADD_TEST(hmac_sha1_test_vectors)
+ADD_TEST(hmac_sha1_precomputed_key)
+ADD_TEST(sha1_backends_agree)
+ADD_TEST(hmac_sha1_multi_lane)
 END_TEST_SUITE()
 TEST_MAIN(sha1)
@@ -15,9 +15,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "common.h"
+#include "sha1.h"
 #include "srs2.h"
 
 #include <check.h>
+#include <stdio.h>
 
 srs_t* create_srs_t()
 {
@@ -70,8 +72,72 @@ START_TEST(srs2_reversing)
 }
 END_TEST
 
+START_TEST(srs2_guarded)
+{
+    static const char srs0[] = "SRS0=vmyz=2W=otherdomain.com=test@example.com";
+    static const char srs1[] = "SRS1=JO9m=example.com==vmyz=2W=otherdomain.com="
+                               "test@example.org";
+    srs_t* srs = create_srs_t();
+    char buffer[sizeof(srs1)];
+    int result;
+
+    result = srs_forward(srs, buffer, sizeof(buffer), srs0, "example.org");
+    ck_assert_int_eq(result, SRS_SUCCESS);
+    ck_assert_str_eq(buffer, srs1);
+
+    result = srs_forward(srs, buffer, sizeof(buffer) - 1, srs0, "example.org");
+    ck_assert_int_eq(result, SRS_EBUFTOOSMALL);
+
+    result = srs_reverse(srs, buffer, sizeof(buffer), srs1);
+    ck_assert_int_eq(result, SRS_SUCCESS);
+    ck_assert_str_eq(buffer, srs0);
+
+    srs_free(srs);
+}
+END_TEST
+
+START_TEST(srs2_reversing_many_secrets)
+{
+    char secret[16];
+    char* output = NULL;
+    int result;
+
+    for (int backend = SHA_BACKEND_AUTO; backend < SHA_NUM_BACKENDS;
+         ++backend)
+    {
+        if (backend != SHA_BACKEND_AUTO && !sha_backend_available(backend))
+            continue;
+        ck_assert_int_eq(sha_set_backend(backend), 1);
+        /* The valid secret ends up in the second group of lanes */
+        srs_t* srs = srs_new();
+        srs->faketime = 1577836860;
+        for (int i = 0; i < SRS_HMAC_LANES + 2; ++i)
+        {
+            snprintf(secret, sizeof(secret), "secret%d", i);
+            srs_add_secret(srs, secret);
+        }
+        srs_add_secret(srs, "tops3cr3t");
+
+        result = srs_reverse_alloc(
+            srs, &output, "SRS0=vmyz=2W=otherdomain.com=test@example.com");
+        ck_assert_int_eq(result, SRS_SUCCESS);
+        ck_assert_str_eq(output, "test@otherdomain.com");
+        free(output);
+
+        result = srs_reverse_alloc(
+            srs, &output, "SRS0=vmyy=2W=otherdomain.com=test@example.com");
+        ck_assert_int_eq(result, SRS_EHASHINVALID);
+
+        srs_free(srs);
+    }
+    sha_set_backend(SHA_BACKEND_AUTO);
+}
+END_TEST
+
 BEGIN_TEST_SUITE(srs2)
 ADD_TEST(srs2_forwarding);
 ADD_TEST(srs2_reversing);
+ADD_TEST(srs2_guarded);
+ADD_TEST(srs2_reversing_many_secrets);
 END_TEST_SUITE()
 TEST_MAIN(srs2)
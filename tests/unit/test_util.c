@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 static char pwd[500];
@@ -276,6 +277,34 @@ START_TEST(util_b32h_encode)
 }
 END_TEST
 
+START_TEST(util_b32h_decode)
+{
+    char buffer[16];
+    char* data;
+
+    data = b32h_decode("", 0, buffer, sizeof(buffer));
+    ck_assert_ptr_nonnull(data);
+
+    data = b32h_decode("5L86USRKAD956P1D", 16, buffer, sizeof(buffer));
+    ck_assert_ptr_nonnull(data);
+    ck_assert_mem_eq(data, "-PostSRSd-", 10);
+
+    data = b32h_decode("5l86usrkad956p1d", 16, buffer, sizeof(buffer));
+    ck_assert_ptr_nonnull(data);
+    ck_assert_mem_eq(data, "-PostSRSd-", 10);
+
+    data = b32h_decode("G2081040G2081040", 16, buffer, sizeof(buffer));
+    ck_assert_ptr_nonnull(data);
+    ck_assert_mem_eq(data, "\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80",
+                     10);
+
+    ck_assert_ptr_null(b32h_decode("5L86USRKAD956P1D", 16, buffer, 9));
+    ck_assert_ptr_null(b32h_decode("C4======", 8, buffer, sizeof(buffer)));
+    ck_assert_ptr_null(b32h_decode("C5H66P3W", 8, buffer, sizeof(buffer)));
+    ck_assert_ptr_null(b32h_decode("C5H66P3", 7, buffer, sizeof(buffer)));
+}
+END_TEST
+
 START_TEST(util_dotlock)
 {
 #if defined(LOCK_EX) && defined(LOCK_NB)
@@ -296,8 +325,9 @@ START_TEST(util_domain_set)
     ck_assert(!domain_set_contains(D, "example.com"));
     ck_assert(!domain_set_contains(D, ".example.com"));
     ck_assert(!domain_set_contains(D, "exam.com"));
-    domain_set_add(D, "example.com");
-    domain_set_add(D, "www.example.com");
+    ck_assert(domain_set_add(D, "example.com"));
+    ck_assert(domain_set_add(D, "www.example.com"));
+    ck_assert(!domain_set_add(D, "Example.COM"));
     ck_assert(domain_set_contains(D, "example.com"));
     ck_assert(domain_set_contains(D, "EXAMPLE.COM"));
     ck_assert(domain_set_contains(D, "www.example.com"));
@@ -310,6 +340,8 @@ START_TEST(util_domain_set)
     ck_assert(domain_set_contains(D, "www.example.com"));
     ck_assert(domain_set_contains(D, "mail.example.com"));
     ck_assert(!domain_set_contains(D, "exam.com"));
+    ck_assert(domain_set_contains(D, "in$valid.example.com"));
+    ck_assert(!domain_set_contains(D, "www.ex$ample.com"));
     domain_set_add(D, ".my-examples.com");
     ck_assert(!domain_set_contains(D, "my-examples.com"));
     ck_assert(domain_set_contains(D, "another.one.of.my-examples.com"));
@@ -343,6 +375,98 @@ START_TEST(util_domain_set)
     domain_set_destroy(D);
 }
 
+START_TEST(util_domain_set_many)
+{
+    char domain[64];
+    domain_set_t* D = domain_set_create();
+    for (unsigned i = 0; i < 20000; i += 2)
+    {
+        snprintf(domain, sizeof(domain), "domain%u.example", i);
+        ck_assert(domain_set_add(D, domain));
+        snprintf(domain, sizeof(domain), ".wild%u.example", i);
+        ck_assert(domain_set_add(D, domain));
+    }
+    for (unsigned i = 0; i < 20000; ++i)
+    {
+        snprintf(domain, sizeof(domain), "DOMAIN%u.example", i);
+        ck_assert_int_eq(domain_set_contains(D, domain), i % 2 == 0);
+        snprintf(domain, sizeof(domain), "mail.wild%u.example", i);
+        ck_assert_int_eq(domain_set_contains(D, domain), i % 2 == 0);
+        snprintf(domain, sizeof(domain), "wild%u.example", i);
+        ck_assert(!domain_set_contains(D, domain));
+    }
+    domain_set_destroy(D);
+}
+
+START_TEST(util_domain_set_updates)
+{
+    int fds[2];
+    char ch = 0;
+    int status;
+    domain_set_t* D = domain_set_create();
+    domain_set_add(D, "example.com");
+    domain_set_add(D, ".wild.org");
+    ck_assert(!domain_set_update(D, "new.net", true));
+    ck_assert(domain_set_share_updates(D));
+    ck_assert_int_eq(pipe(fds), 0);
+    pid_t pid = fork();
+    ck_assert_int_ge(pid, 0);
+    if (pid == 0)
+    {
+        /* The forked child sees the changes made by its parent */
+        close(fds[1]);
+        if (read(fds[0], &ch, 1) != 1)
+            _exit(2);
+        _exit(domain_set_contains(D, "New.net")
+                      && !domain_set_contains(D, "example.com")
+                      && !domain_set_contains(D, "mail.wild.org")
+                  ? 0
+                  : 1);
+    }
+    close(fds[0]);
+    ck_assert(domain_set_update(D, "NEW.net", true));
+    ck_assert(domain_set_update(D, "example.com", false));
+    ck_assert(domain_set_update(D, ".wild.org", false));
+    ck_assert(domain_set_update(D, "example.com", false));
+    ck_assert(!domain_set_update(D, "in$valid.com", true));
+    ck_assert_int_eq(write(fds[1], &ch, 1), 1);
+    close(fds[1]);
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    ck_assert(WIFEXITED(status));
+    ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+    domain_set_t* T = domain_set_create();
+    domain_set_add(T, "example.com");
+    domain_set_add(T, "other.org");
+    domain_set_add(T, ".wild.org");
+    size_t added = 0, removed = 0;
+    ck_assert(domain_set_update_from(D, T, &added, &removed));
+    ck_assert_uint_eq(added, 3);
+    ck_assert_uint_eq(removed, 1);
+    ck_assert(domain_set_contains(D, "example.com"));
+    ck_assert(domain_set_contains(D, "other.org"));
+    ck_assert(domain_set_contains(D, "mail.wild.org"));
+    ck_assert(!domain_set_contains(D, "new.net"));
+    ck_assert(domain_set_update_from(D, T, &added, &removed));
+    ck_assert_uint_eq(added, 0);
+    ck_assert_uint_eq(removed, 0);
+    domain_set_destroy(T);
+
+    /* Changes which do not fit the update table are rejected as a whole */
+    char domain[64];
+    T = domain_set_create();
+    for (unsigned i = 0; i < 5000; ++i)
+    {
+        snprintf(domain, sizeof(domain), "domain%u.example", i);
+        domain_set_add(T, domain);
+    }
+    ck_assert(!domain_set_update_from(D, T, &added, &removed));
+    ck_assert(domain_set_contains(D, "example.com"));
+    ck_assert(!domain_set_contains(D, "domain1.example"));
+    domain_set_destroy(T);
+    domain_set_destroy(D);
+}
+
 START_TEST(util_log)
 {
     char buffer[2049];
@@ -364,7 +488,10 @@ ADD_TEST_TO_TEST_CASE(fs, util_file_watch)
 ADD_TEST(util_string_set)
 ADD_TEST(util_list);
 ADD_TEST(util_b32h_encode)
+ADD_TEST(util_b32h_decode)
 ADD_TEST(util_domain_set)
+ADD_TEST(util_domain_set_many)
+ADD_TEST(util_domain_set_updates)
 ADD_TEST(util_log)
 END_TEST_SUITE()
 TEST_MAIN(util)